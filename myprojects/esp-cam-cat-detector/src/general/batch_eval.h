@@ -0,0 +1,298 @@
+#ifndef BATCH_EVAL_H
+#define BATCH_EVAL_H
+
+#include <SD_MMC.h>
+
+#include <general/inference_util.h>
+#include <general/latency_stats.h>
+#include <general/util.h>
+
+#define BATCH_EVAL_MAX_FOLDERS 4
+#define BATCH_EVAL_MAX_JPEG (512 * 1024)
+#define BATCH_EVAL_FOLDER "/eval"
+#define BATCH_EVAL_SUMMARY_PATH BATCH_EVAL_FOLDER "/summary.json"
+#define BATCH_EVAL_DISAGREEMENTS_PATH BATCH_EVAL_FOLDER "/disagreements.txt"
+
+/*
+ * Re-runs the current model over the images saveImg wrote to the SD card and compares the result with the
+ * certainty stored in each file name.
+ *
+ * A low priority task walks the folders, reading every JPEG once into a single PSRAM buffer, and keeps a
+ * confusion count of the stored trigger decision against the new one. The stored value is smoothed by the
+ * detection tracker over several frames while the new one comes from a single frame, so some disagreement around
+ * the threshold is expected. Live inference should stay paused while running, see running().
+ */
+namespace BatchEval
+{
+    struct Results
+    {
+        uint32_t images = 0;
+        uint32_t failed = 0; // read or inference errors
+        uint32_t skipped = 0; // larger than BATCH_EVAL_MAX_JPEG
+        uint32_t bothTriggered = 0;
+        uint32_t neitherTriggered = 0;
+        uint32_t onlyStored = 0; // stored file triggered, the current model doesn't
+        uint32_t onlyCurrent = 0;
+        uint32_t unscored = 0; // no certainty in the file name, counted by folder
+        float certaintyErrorSum = 0;
+        unsigned long elapsedMs = 0;
+        LatencyStats::Histogram readUs{};
+        LatencyStats::Histogram inferenceUs{};
+    };
+
+    inline Results results{};
+    inline volatile bool active = false;
+    inline volatile bool cancelRequested = false;
+    inline TaskHandle_t taskHandle = nullptr;
+
+    inline const char* folders[BATCH_EVAL_MAX_FOLDERS]{};
+    inline bool folderTriggered[BATCH_EVAL_MAX_FOLDERS]{};
+    inline size_t folderCount = 0;
+    inline float triggerThreshold = 0;
+    inline uint8_t* readBuffer = nullptr;
+
+    inline bool running()
+    {
+        return active;
+    }
+
+    // Certainty saveImg encoded as "__a_<percent>.jpg", -1 if the name doesn't have one
+    inline float storedCertainty(const char* name)
+    {
+        const char* marker = strstr(name, "__a_");
+        if (marker == nullptr)
+        {
+            return -1;
+        }
+
+        char* end = nullptr;
+        long percent = strtol(marker + 4, &end, 10);
+        return end != marker + 4 && strcmp(end, ".jpg") == 0 ? percent / 100.0f : -1;
+    }
+
+    inline size_t toJson(char* buf, size_t len)
+    {
+        const Results& r = results;
+        LatencyStats::Summary read = LatencyStats::summarize(r.readUs);
+        LatencyStats::Summary inference = LatencyStats::summarize(r.inferenceUs);
+        uint32_t compared = r.bothTriggered + r.neitherTriggered + r.onlyStored + r.onlyCurrent;
+        uint32_t scored = compared - r.unscored;
+
+        return snprintf(buf, len,
+                        "{\"running\":%s,\"images\":%lu,\"failed\":%lu,\"skipped\":%lu,\"elapsedMs\":%lu,"
+                        "\"imagesPerSecond\":%.2f,\"threshold\":%.2f,"
+                        "\"bothTriggered\":%lu,\"neitherTriggered\":%lu,\"onlyStored\":%lu,\"onlyCurrent\":%lu,"
+                        "\"agreement\":%.4f,\"meanCertaintyError\":%.4f,"
+                        "\"readUs\":{\"mean\":%lu,\"p50\":%lu,\"p95\":%lu,\"max\":%lu},"
+                        "\"inferenceUs\":{\"mean\":%lu,\"p50\":%lu,\"p95\":%lu,\"p99\":%lu,\"max\":%lu}}",
+                        active ? "true" : "false",
+                        (unsigned long) r.images,
+                        (unsigned long) r.failed,
+                        (unsigned long) r.skipped,
+                        r.elapsedMs,
+                        r.elapsedMs > 0 ? r.images * 1000.0f / r.elapsedMs : 0.0f,
+                        triggerThreshold,
+                        (unsigned long) r.bothTriggered,
+                        (unsigned long) r.neitherTriggered,
+                        (unsigned long) r.onlyStored,
+                        (unsigned long) r.onlyCurrent,
+                        compared > 0 ? (float) (r.bothTriggered + r.neitherTriggered) / compared : 0.0f,
+                        scored > 0 ? r.certaintyErrorSum / scored : 0.0f,
+                        (unsigned long) read.mean,
+                        (unsigned long) read.p50,
+                        (unsigned long) read.p95,
+                        (unsigned long) read.max,
+                        (unsigned long) inference.mean,
+                        (unsigned long) inference.p50,
+                        (unsigned long) inference.p95,
+                        (unsigned long) inference.p99,
+                        (unsigned long) inference.max);
+    }
+
+    inline void evaluate(File& file, bool folderIsTriggered, File& disagreements)
+    {
+        size_t size = file.size();
+        if (size > BATCH_EVAL_MAX_JPEG)
+        {
+            results.skipped++;
+            return;
+        }
+
+        unsigned long start = micros();
+        size_t read = file.read(readBuffer, size);
+        LatencyStats::add(results.readUs, micros() - start);
+
+        if (read != size)
+        {
+            results.failed++;
+            return;
+        }
+
+        InferenceUtil::InferenceOutput output{};
+        start = micros();
+        InferenceUtil::runInferenceFromImage(output, readBuffer, size);
+        LatencyStats::add(results.inferenceUs, micros() - start);
+
+        results.images++;
+        if (output.status != ModelUtil::OK)
+        {
+            results.failed++;
+            return;
+        }
+
+        float current = InferenceUtil::triggerCertainty(output);
+        float stored = storedCertainty(file.name());
+        bool storedTriggered = folderIsTriggered;
+        if (stored >= 0)
+        {
+            storedTriggered = stored >= triggerThreshold;
+            results.certaintyErrorSum += fabsf(stored - current);
+        }
+        else
+        {
+            results.unscored++;
+        }
+
+        bool currentTriggered = current >= triggerThreshold;
+        if (storedTriggered && currentTriggered)
+        {
+            results.bothTriggered++;
+        }
+        else if (!storedTriggered && !currentTriggered)
+        {
+            results.neitherTriggered++;
+        }
+        else
+        {
+            if (storedTriggered)
+            {
+                results.onlyStored++;
+            }
+            else
+            {
+                results.onlyCurrent++;
+            }
+
+            if (disagreements)
+            {
+                disagreements.printf("%s %.2f %.2f\n", file.path(), stored, current);
+            }
+        }
+    }
+
+    inline void writeSummary()
+    {
+        char summary[768];
+        size_t len = toJson(summary, sizeof(summary));
+
+        File file = SD_MMC.open(BATCH_EVAL_SUMMARY_PATH, FILE_WRITE);
+        if (file)
+        {
+            file.write((const uint8_t*) summary, std::min(len, sizeof(summary) - 1));
+            file.close();
+        }
+    }
+
+    inline void evalTask(void* args)
+    {
+        unsigned long start = millis();
+
+        if (!SD_MMC.exists(BATCH_EVAL_FOLDER))
+        {
+            SD_MMC.mkdir(BATCH_EVAL_FOLDER);
+        }
+
+        // Lines of "<path> <stored certainty> <current certainty>"
+        File disagreements = SD_MMC.open(BATCH_EVAL_DISAGREEMENTS_PATH, FILE_WRITE);
+
+        for (size_t i = 0; i < folderCount && !cancelRequested; i++)
+        {
+            File dir = SD_MMC.open(folders[i]);
+            if (!dir || !dir.isDirectory())
+            {
+                continue;
+            }
+
+            File file = dir.openNextFile();
+            while (file && !cancelRequested)
+            {
+                if (!file.isDirectory())
+                {
+                    evaluate(file, folderTriggered[i], disagreements);
+                    results.elapsedMs = millis() - start;
+                }
+
+                file.close();
+                file = dir.openNextFile();
+                vTaskDelay(1);
+            }
+
+            dir.close();
+        }
+
+        if (disagreements)
+        {
+            disagreements.close();
+        }
+
+        results.elapsedMs = millis() - start;
+        writeSummary();
+        MLOGF("Batch evaluation done: %lu images in %lu ms.\n", (unsigned long) results.images, results.elapsedMs);
+
+        active = false;
+        taskHandle = nullptr;
+        vTaskDelete(nullptr);
+    }
+
+    // Adds a folder to evaluate, triggered tells whether the images in it were saved as detections
+    inline bool addFolder(const char* folder, bool triggered)
+    {
+        if (folderCount >= BATCH_EVAL_MAX_FOLDERS)
+        {
+            return false;
+        }
+
+        folders[folderCount] = folder;
+        folderTriggered[folderCount] = triggered;
+        folderCount++;
+        return true;
+    }
+
+    inline bool start(float threshold)
+    {
+        if (active || !sdInit)
+        {
+            return false;
+        }
+
+        if (readBuffer == nullptr)
+        {
+            readBuffer = (uint8_t*) ps_malloc(BATCH_EVAL_MAX_JPEG);
+            if (readBuffer == nullptr)
+            {
+                MLOGN("Could not allocate the batch evaluation buffer.");
+                return false;
+            }
+        }
+
+        results = Results{};
+        triggerThreshold = threshold;
+        cancelRequested = false;
+        active = true;
+
+        if (xTaskCreatePinnedToCore(evalTask, "evaltask", 8192, nullptr, 1, &taskHandle, 1) != pdPASS)
+        {
+            active = false;
+            return false;
+        }
+
+        return true;
+    }
+
+    inline void stop()
+    {
+        cancelRequested = true;
+    }
+}
+
+#endif //BATCH_EVAL_H
@@ -0,0 +1,107 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <general/log.h>
+
+#define BUFFER_POOL_MAX_SLOTS 8
+
+/*
+ * Fixed set of PSRAM buffers reserved once at startup and shared by the inference pipeline stages.
+ * Stages borrow a buffer and give it back when done, so nothing is allocated or freed while running.
+ */
+namespace BufferPool
+{
+    enum Stage
+    {
+        DECODE,
+        OVERLAY,
+        ENCODE,
+        STAGE_COUNT,
+    };
+
+    struct Slot
+    {
+        uint8_t* buf = nullptr;
+        size_t size = 0;
+        Stage stage = DECODE;
+        bool inUse = false;
+    };
+
+    inline Slot slots[BUFFER_POOL_MAX_SLOTS]{};
+    inline size_t slotCount = 0;
+    inline portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+    inline bool reserve(Stage stage, size_t size, size_t count = 1)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (slotCount >= BUFFER_POOL_MAX_SLOTS)
+            {
+                MLOGN("Buffer pool is full.");
+                return false;
+            }
+
+            auto buf = (uint8_t*) ps_malloc(size);
+            if (buf == nullptr)
+            {
+                MLOGF("Failed to reserve pool buffer of %zu bytes.\n", size);
+                return false;
+            }
+
+            Slot& slot = slots[slotCount++];
+            slot.buf = buf;
+            slot.size = size;
+            slot.stage = stage;
+            slot.inUse = false;
+        }
+
+        return true;
+    }
+
+    // Returns nullptr if every buffer of the stage is in use or too small
+    inline uint8_t* borrow(Stage stage, size_t minSize = 0, size_t* outSize = nullptr)
+    {
+        uint8_t* buf = nullptr;
+
+        portENTER_CRITICAL(&lock);
+        for (size_t i = 0; i < slotCount; i++)
+        {
+            Slot& slot = slots[i];
+            if (slot.stage == stage && !slot.inUse && slot.size >= minSize)
+            {
+                slot.inUse = true;
+                buf = slot.buf;
+
+                if (outSize != nullptr)
+                {
+                    *outSize = slot.size;
+                }
+                break;
+            }
+        }
+        portEXIT_CRITICAL(&lock);
+
+        return buf;
+    }
+
+    inline void giveBack(const uint8_t* buf)
+    {
+        if (buf == nullptr)
+        {
+            return;
+        }
+
+        portENTER_CRITICAL(&lock);
+        for (size_t i = 0; i < slotCount; i++)
+        {
+            if (slots[i].buf == buf)
+            {
+                slots[i].inUse = false;
+                break;
+            }
+        }
+        portEXIT_CRITICAL(&lock);
+    }
+}
+
+#endif //BUFFER_POOL_H
@@ -54,7 +54,7 @@ inline camera_config_t camConfig = {
     .pixel_format = PIXFORMAT_JPEG,
     .frame_size = FRAMESIZE_240X240,
     .jpeg_quality = 10,
-    .fb_count = 1,
+    .fb_count = 3, // one being filled, one waiting in the capture pipeline and one being inferred
     .fb_location = CAMERA_FB_IN_PSRAM,
     .grab_mode = CAMERA_GRAB_LATEST
 };
@@ -19,6 +19,9 @@
 #include <ESP-FTP-Server-Lib.h>
 #include <general/secrets.h>
 #include <general/cam_config.h>
+#include <general/jpeg_util.h>
+#include <general/stream_broadcaster.h>
+#include <general/inference_scheduler.h>
 
 FTPServer ftp;
 
@@ -29,31 +32,88 @@ namespace ConfigPageSetup
     inline framesize_t defaultFramesize = camConfig.frame_size;
     inline framesize_t infFramesize = FRAMESIZE_96X96;
 
-    inline int frameIntervalMs = (1000 / 1);
-    inline unsigned long lastFrameSent = 0;
-    inline WiFiClient currentClient;
-    inline bool streamActive = false;
+
+    // Percentage of changed pixels needed to run the model, 0 disables the motion gate. Only parseSettings reads
+    // the env vars, the tasks use its Settings
+    inline ESP_CONFIG_PAGE::EnvVar* motionThreshold = new ESP_CONFIG_PAGE::EnvVar("MOTION_THRESHOLD", "1.5");
+
+    // Inference period bounds in ms, see InferenceScheduler
+    inline ESP_CONFIG_PAGE::EnvVar* schedulerIdleMs = new ESP_CONFIG_PAGE::EnvVar("SCHEDULER_IDLE_MS", "3000");
+    inline ESP_CONFIG_PAGE::EnvVar* schedulerBurstMs = new ESP_CONFIG_PAGE::EnvVar("SCHEDULER_BURST_MS", "250");
+    inline ESP_CONFIG_PAGE::EnvVar* schedulerDarkMs = new ESP_CONFIG_PAGE::EnvVar("SCHEDULER_DARK_MS", "10000");
+
+    // Presence probability the gate model needs to run the detector, and how often a rejected frame is audited
+    inline ESP_CONFIG_PAGE::EnvVar* gateThreshold = new ESP_CONFIG_PAGE::EnvVar("GATE_THRESHOLD", "0.3");
+    inline ESP_CONFIG_PAGE::EnvVar* gateAuditInterval = new ESP_CONFIG_PAGE::EnvVar("GATE_AUDIT_INTERVAL", "50");
+
+    // What the tasks read, parsed from the env vars and clamped when they are loaded or saved
+    struct Settings
+    {
+        float motionThreshold = 1.5f;
+        InferenceScheduler::Policy scheduler{};
+        InferenceUtil::CascadePolicy cascade{};
+    };
+
+    inline Settings currentSettings{};
+    inline portMUX_TYPE settingsLock = portMUX_INITIALIZER_UNLOCKED;
+
+    inline float parseFloat(const ESP_CONFIG_PAGE::EnvVar* var, float min, float max)
+    {
+        float value = var->value.toFloat();
+        return std::isnan(value) ? min : std::min(std::max(value, min), max);
+    }
+
+    inline uint32_t parseInt(const ESP_CONFIG_PAGE::EnvVar* var, long min, long max)
+    {
+        return std::min(std::max(var->value.toInt(), min), max);
+    }
+
+    /*
+     * Runs where the env var Strings are written, at setup and from the save callback of the web server, so they
+     * are never read while being replaced. The other tasks only copy the parsed values under settingsLock.
+     */
+    inline void parseSettings()
+    {
+        Settings parsed;
+        parsed.motionThreshold = parseFloat(motionThreshold, 0, 100);
+        parsed.scheduler.burstMs = parseInt(schedulerBurstMs, 50, 60000);
+        parsed.scheduler.idleMs = parseInt(schedulerIdleMs, parsed.scheduler.burstMs, 600000);
+        parsed.scheduler.darkMs = parseInt(schedulerDarkMs, 0, 600000);
+        parsed.cascade.gateThreshold = parseFloat(gateThreshold, 0, 1);
+        parsed.cascade.auditInterval = parseInt(gateAuditInterval, 0, 100000);
+
+        portENTER_CRITICAL(&settingsLock);
+        currentSettings = parsed;
+        portEXIT_CRITICAL(&settingsLock);
+    }
+
+    inline Settings settings()
+    {
+        portENTER_CRITICAL(&settingsLock);
+        Settings copy = currentSettings;
+        portEXIT_CRITICAL(&settingsLock);
+        return copy;
+    }
+
+    // StreamBroadcaster detaches the request and writes to it with httpd_resp_* directly
+    static_assert(std::is_same<ESP_CONFIG_PAGE::REQUEST_T, httpd_req_t*>::value, "the stream needs ESP_CONFIG_PAGE on esp_http_server");
 
     inline void mjpegStreamHandle()
     {
         ESP_CONFIG_PAGE::addServerHandler("/stream", HTTP_GET, [](ESP_CONFIG_PAGE::REQUEST_T req)
         {
             MLOGN("Stream connection received");
-            LOGF("%s", esp_camera_available_frames() ? "has frame" : "no frame");
-            if (streamActive)
-            {
-                MLOGN("Stream already in use");
-                ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::BAD_REQUEST, "stream already in use.", req);
-                return;
-            }
+
+            framesize_t framesize = defaultFramesize;
+            int intervalMs = 1000;
 
             char paramBuf[128]{};
             if (ESP_CONFIG_PAGE::getParam(req, "framesize", paramBuf, sizeof(paramBuf)))
             {
-                int framesize = String(paramBuf).toInt();
-                if (framesize >= 0 && framesize <= maxFramesize)
+                int requested = String(paramBuf).toInt();
+                if (requested >= 0 && requested <= maxFramesize)
                 {
-                    CamConfig::setRes((framesize_t)framesize);
+                    framesize = (framesize_t) requested;
                 }
             }
 
@@ -62,91 +122,38 @@ namespace ConfigPageSetup
                 int fps = String(paramBuf).toInt();
                 if (fps > 0 && fps <= maxFps)
                 {
-                    frameIntervalMs = 1000 / fps;
+                    intervalMs = 1000 / fps;
                 }
             }
 
-            bool inferenceActive = false;
+            bool annotated = false;
             if (ESP_CONFIG_PAGE::getParam(req, "inf", paramBuf, sizeof(paramBuf)))
             {
-                inferenceActive = true;
-                CamConfig::setRes(infFramesize);
+                annotated = true;
+                framesize = infFramesize;
             }
 
-            streamActive = true;
-
-            ESP_CONFIG_PAGE::ResponseContext c{};
-            ESP_CONFIG_PAGE::initResponseContext(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, "multipart/x-mixed-replace; boundary=frame", 0, c);
-            ESP_CONFIG_PAGE::startResponse(req, c);
-            ESP_CONFIG_PAGE::sendHeader("cache-control", "no-cache", c);
-
-            bool first = true;
-            char headerBuf[128]{};
-            while (true)
+            if (!StreamBroadcaster::subscribe(req, annotated, framesize, intervalMs))
             {
-                camera_fb_t* fb = esp_camera_fb_get();
-                if (fb == nullptr)
-                {
-                    break;
-                }
-
-                uint8_t *outImg = nullptr;
-                size_t outImgLen = 0;
-                if (inferenceActive)
-                {
-                    InferenceUtil::InferenceOutput output{};
-                    InferenceUtil::runInferenceFromImage(output, fb->buf, fb->len, &outImg, &outImgLen);
-                    if (outImg != nullptr)
-                    {
-                        InferenceUtil::drawMarkers(output, outImg);
-                        uint8_t *outJpeg = nullptr;
-                        size_t outJpegLen = 0;
-                        fmt2jpg(outImg, outImgLen, MODEL_INPUT_WIDTH, MODEL_INPUT_HEIGHT, PIXFORMAT_RGB888, 90, &outJpeg, &outJpegLen);
-                        free(outImg);
-
-                        outImg = outJpeg;
-                        outImgLen = outJpegLen;
-                    }
-                }
-                else
-                {
-                    outImg = fb->buf;
-                    outImgLen = fb->len;
-                }
-
-                snprintf(headerBuf,
-                         sizeof(headerBuf),
-                         "%s--frame\r\n"
-                         "Content-Type: image/jpeg\r\n"
-                         "Content-Length: %u\r\n\r\n",
-                         first ? "" : "\r\n",
-                         outImgLen);
-
-                ESP_CONFIG_PAGE::writeResponse(headerBuf, c);
-                int written = ESP_CONFIG_PAGE::writeResponse(outImg, outImgLen, c);
-                if (written < 0)
-                {
-                    esp_camera_fb_return(fb);
-                    if (inferenceActive)
-                    {
-                        free(outImg);
-                    }
-                    break;
-                }
-
-                first = false;
-                esp_camera_fb_return(fb);
-                if (inferenceActive)
-                {
-                    free(outImg);
-                }
-                vTaskDelay(pdMS_TO_TICKS(frameIntervalMs));
+                MLOGN("No stream slot left");
+                ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::BAD_REQUEST, "too many stream viewers.", req);
             }
+        });
 
-            streamActive = false;
-            CamConfig::setRes(defaultFramesize);
-            ESP_CONFIG_PAGE::endResponse(req, c);
-            MLOGN("Stream ended");
+        ESP_CONFIG_PAGE::addServerHandler("/stream-stats", HTTP_GET, [](ESP_CONFIG_PAGE::REQUEST_T req)
+        {
+            const StreamBroadcaster::Stats &stats = StreamBroadcaster::stats;
+            char out[224];
+            snprintf(out, sizeof(out),
+                "{\"clients\":%d,\"published\":%lu,\"encoded\":%lu,\"sent\":%lu,\"dropped\":%lu,\"noBuffer\":%lu,\"oversize\":%lu}",
+                StreamBroadcaster::clientCount,
+                (unsigned long) stats.published,
+                (unsigned long) stats.encoded,
+                (unsigned long) stats.sent,
+                (unsigned long) stats.dropped,
+                (unsigned long) stats.noBuffer,
+                (unsigned long) stats.oversize);
+            ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, out, req);
         });
     }
 
@@ -166,6 +173,13 @@ namespace ConfigPageSetup
             testRun();
         });
 
+        ESP_CONFIG_PAGE::addCustomAction("SCHEDULER", [](ESP_CONFIG_PAGE::REQUEST_T req)
+        {
+            char out[512];
+            InferenceScheduler::toJson(out, sizeof(out));
+            ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, out, req);
+        });
+
         httpd_ssl_config sslConfig = HTTPD_SSL_CONFIG_DEFAULT();
         ESP_CONFIG_PAGE::setupServerConfig(&sslConfig);
 
@@ -177,11 +191,27 @@ namespace ConfigPageSetup
             return;
         }
 
+        ESP_CONFIG_PAGE::addEnvVar(motionThreshold);
+        ESP_CONFIG_PAGE::addEnvVar(schedulerIdleMs);
+        ESP_CONFIG_PAGE::addEnvVar(schedulerBurstMs);
+        ESP_CONFIG_PAGE::addEnvVar(schedulerDarkMs);
+        ESP_CONFIG_PAGE::addEnvVar(gateThreshold);
+        ESP_CONFIG_PAGE::addEnvVar(gateAuditInterval);
+        ESP_CONFIG_PAGE::setAndUpdateEnvVarStorage(new ESP_CONFIG_PAGE::LittleFSKeyValueStorage("/env"));
+        parseSettings();
+        ESP_CONFIG_PAGE::saveEnvVarsCallback = [](ESP_CONFIG_PAGE::EnvVar**, uint8_t)
+        {
+            parseSettings();
+        };
+
         ESP_CONFIG_PAGE::setAPConfig(nodeName, password);
         ESP_CONFIG_PAGE::initModules(&server, username, password, nodeName);
 
         defaultFramesize = camConfig.frame_size;
-        mjpegStreamHandle();
+        if (StreamBroadcaster::setup(defaultFramesize) && StreamBroadcaster::start())
+        {
+            mjpegStreamHandle();
+        }
 
         ESP_CONFIG_PAGE::otaStartCallback = []()
         {
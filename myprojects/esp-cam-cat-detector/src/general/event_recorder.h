@@ -0,0 +1,370 @@
+#ifndef EVENT_RECORDER_H
+#define EVENT_RECORDER_H
+
+#include <general/log.h>
+#include <general/sd_writer.h>
+
+#define EVENT_RING_BYTES (1536 * 1024)
+#define EVENT_PREROLL_BYTES (768 * 1024) // the rest of the ring is left for the post roll
+#define EVENT_PREROLL_MAX_FRAMES 8
+#define EVENT_RING_MAX_FRAMES 32
+#define EVENT_POST_FRAMES 4
+#define EVENT_FOLDER "/events"
+#define EVENT_WRITE_TIMEOUT_MS 2000
+
+/*
+ * Keeps the last JPEG frames in a PSRAM ring so a detection can be saved with what led up to it.
+ *
+ * Every frame the inference task consumes is pushed, gated or not. The ring is sized in bytes rather than frames,
+ * frames are stored back to back and the oldest are evicted as the write position comes around. On a trigger the
+ * newest frames within EVENT_PREROLL_BYTES and EVENT_PREROLL_MAX_FRAMES are pinned, the next EVENT_POST_FRAMES
+ * frames are added to the event and a bundler task then writes them through SdWriter into a folder of their own:
+ *   /events/<date>__<time>/<index>_<ms from trigger>[__a_<certainty>].jpg
+ *
+ * Pinned frames are never evicted, a push that would need their space is dropped instead, so the bundle always
+ * matches what was pinned. Triggers during an event are merged into it.
+ */
+namespace EventRecorder
+{
+    struct Entry
+    {
+        uint32_t seq;
+        size_t offset;
+        size_t len;
+        int64_t timestampMs;
+        float certainty; // -1 for frames that weren't inferred
+    };
+
+    enum State
+    {
+        IDLE,
+        POST_ROLL,
+        BUNDLING
+    };
+
+    struct Stats
+    {
+        uint32_t pushed = 0;
+        uint32_t evicted = 0;
+        uint32_t dropped = 0; // too large, or the space was pinned by an event being written
+        uint32_t events = 0;
+        uint32_t merged = 0; // triggers during an event
+        uint32_t framesWritten = 0;
+        uint32_t framesFailed = 0;
+        uint32_t lastEventFrames = 0;
+        uint32_t maxBundleMs = 0;
+    };
+
+    inline uint8_t* ring = nullptr;
+    inline Entry entries[EVENT_RING_MAX_FRAMES]{};
+    inline size_t tail = 0; // oldest entry
+    inline size_t count = 0;
+    inline size_t writeOffset = 0;
+    inline uint32_t nextSeq = 0;
+
+    inline State state = IDLE;
+    inline uint32_t pinnedFrom = UINT32_MAX; // first sequence of the event, nothing from here on can be evicted
+    inline uint32_t eventEnd = 0; // last sequence of the event once the post roll is done
+    inline uint32_t postRemaining = 0;
+    inline int64_t triggerMs = 0;
+    inline char triggerStamp[40]{};
+
+    inline Stats stats{};
+    inline SemaphoreHandle_t mutex = nullptr;
+    inline TaskHandle_t bundlerHandle = nullptr;
+
+    inline const Entry& entryAt(size_t i)
+    {
+        return entries[(tail + i) % EVENT_RING_MAX_FRAMES];
+    }
+
+    inline bool overlaps(const Entry& entry, size_t offset, size_t len)
+    {
+        return entry.offset < offset + len && offset < entry.offset + entry.len;
+    }
+
+    // Evicts the oldest entry unless it belongs to the pinned event
+    inline bool evictOldest()
+    {
+        if (entries[tail].seq >= pinnedFrom)
+        {
+            return false;
+        }
+
+        tail = (tail + 1) % EVENT_RING_MAX_FRAMES;
+        count--;
+        stats.evicted++;
+        return true;
+    }
+
+    // Makes room for len bytes, sets offset to where they go. Called with the mutex held
+    inline bool reserve(size_t len, size_t* offset)
+    {
+        size_t start = writeOffset;
+        if (start + len > EVENT_RING_BYTES)
+        {
+            // The frames left past the write position are the oldest, they go before wrapping
+            while (count > 0 && entries[tail].offset >= writeOffset)
+            {
+                if (!evictOldest())
+                {
+                    return false;
+                }
+            }
+            start = 0;
+        }
+
+        while (count > 0 && (count == EVENT_RING_MAX_FRAMES || overlaps(entries[tail], start, len)))
+        {
+            if (!evictOldest())
+            {
+                return false;
+            }
+        }
+
+        *offset = start;
+        return true;
+    }
+
+    inline void finishPostRoll()
+    {
+        eventEnd = nextSeq - 1;
+        state = BUNDLING;
+        if (bundlerHandle != nullptr)
+        {
+            xTaskNotifyGive(bundlerHandle);
+        }
+    }
+
+    // Copies the frame into the ring, certainty is -1 when the frame wasn't inferred
+    inline void push(const uint8_t* jpeg, size_t len, int64_t timestampMs, float certainty)
+    {
+        if (ring == nullptr)
+        {
+            return;
+        }
+
+        if (len > EVENT_PREROLL_BYTES)
+        {
+            stats.dropped++;
+            return;
+        }
+
+        xSemaphoreTake(mutex, portMAX_DELAY);
+
+        size_t offset = 0;
+        if (!reserve(len, &offset))
+        {
+            stats.dropped++;
+            // Keeps the post roll from waiting forever on frames that can't be stored
+            if (state == POST_ROLL && --postRemaining == 0)
+            {
+                finishPostRoll();
+            }
+            xSemaphoreGive(mutex);
+            return;
+        }
+
+        // Pinned entries are read by the bundler without the mutex, the reserved space never overlaps them
+        memcpy(ring + offset, jpeg, len);
+        entries[(tail + count) % EVENT_RING_MAX_FRAMES] = Entry{nextSeq++, offset, len, timestampMs, certainty};
+        count++;
+        writeOffset = offset + len;
+        stats.pushed++;
+
+        if (state == POST_ROLL && --postRemaining == 0)
+        {
+            finishPostRoll();
+        }
+
+        xSemaphoreGive(mutex);
+    }
+
+    // Starts an event from the frames already in the ring, the last one pushed is taken as the trigger frame
+    inline void trigger()
+    {
+        if (ring == nullptr || count == 0)
+        {
+            return;
+        }
+
+        xSemaphoreTake(mutex, portMAX_DELAY);
+
+        if (state != IDLE)
+        {
+            stats.merged++;
+            xSemaphoreGive(mutex);
+            return;
+        }
+
+        // Newest frames that fit the pre roll budget, at least the trigger frame as push caps frames to it
+        size_t bytes = 0;
+        size_t first = count;
+        while (first > 0 && count - first < EVENT_PREROLL_MAX_FRAMES && bytes + entryAt(first - 1).len <= EVENT_PREROLL_BYTES)
+        {
+            first--;
+            bytes += entryAt(first).len;
+        }
+
+        pinnedFrom = entryAt(first).seq;
+        triggerMs = entryAt(count - 1).timestampMs;
+        SdWriter::timestamp(triggerStamp, sizeof(triggerStamp));
+        postRemaining = EVENT_POST_FRAMES;
+        state = POST_ROLL;
+        stats.events++;
+
+        xSemaphoreGive(mutex);
+    }
+
+    // Copy of the entry with the given sequence, false if it isn't in the ring
+    inline bool findEntry(uint32_t seq, Entry* out)
+    {
+        bool found = false;
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        if (count > 0 && seq >= entries[tail].seq && seq - entries[tail].seq < count)
+        {
+            *out = entryAt(seq - entries[tail].seq);
+            found = true;
+        }
+        xSemaphoreGive(mutex);
+        return found;
+    }
+
+    inline void writeBundle()
+    {
+        unsigned long start = millis();
+
+        char folder[64]{};
+        snprintf(folder, sizeof(folder), "%s/%s", EVENT_FOLDER, triggerStamp);
+
+        uint32_t frames = 0;
+        char path[SD_WRITER_MAX_PATH]{};
+        for (uint32_t seq = pinnedFrom; seq <= eventEnd; seq++)
+        {
+            Entry entry{};
+            if (!findEntry(seq, &entry))
+            {
+                // Dropped while the post roll was pinned, or the push failed
+                continue;
+            }
+
+            int len = snprintf(path, sizeof(path), "%s/%02lu_%lld", folder, (unsigned long) frames, (long long) (entry.timestampMs - triggerMs));
+            if (entry.certainty >= 0)
+            {
+                len += snprintf(path + len, sizeof(path) - len, "__a_%d", (int) (entry.certainty * 100));
+            }
+            snprintf(path + len, sizeof(path) - len, ".jpg");
+
+            // Waits on the writer, the frames are pinned so taking a while only costs new pushes
+            if (SdWriter::enqueue(path, ring + entry.offset, entry.len, pdMS_TO_TICKS(EVENT_WRITE_TIMEOUT_MS)))
+            {
+                stats.framesWritten++;
+            }
+            else
+            {
+                stats.framesFailed++;
+            }
+            frames++;
+        }
+
+        stats.lastEventFrames = frames;
+        stats.maxBundleMs = std::max<uint32_t>(stats.maxBundleMs, millis() - start);
+        MLOGF("Event of %lu frames queued to %s.\n", (unsigned long) frames, folder);
+    }
+
+    inline void bundlerTask(void* args)
+    {
+        while (true)
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            if (state != BUNDLING)
+            {
+                continue;
+            }
+
+            writeBundle();
+
+            xSemaphoreTake(mutex, portMAX_DELAY);
+            pinnedFrom = UINT32_MAX;
+            state = IDLE;
+            xSemaphoreGive(mutex);
+        }
+    }
+
+    // Call once the sd writer is running
+    inline bool setup()
+    {
+        if (bundlerHandle != nullptr)
+        {
+            return true;
+        }
+
+        if (mutex == nullptr)
+        {
+            mutex = xSemaphoreCreateMutex();
+        }
+        ring = (uint8_t*) ps_malloc(EVENT_RING_BYTES);
+        if (mutex == nullptr || ring == nullptr)
+        {
+            MLOGN("Could not allocate the event ring.");
+            free(ring);
+            ring = nullptr;
+            return false;
+        }
+
+        // SdWriter only creates the last folder of a path
+        if (!SD_MMC.exists(EVENT_FOLDER))
+        {
+            SD_MMC.mkdir(EVENT_FOLDER);
+        }
+
+        // Without the bundler nothing could ever finish an event, so the recorder stays disabled
+        if (xTaskCreatePinnedToCore(bundlerTask, "eventtask", 4096, nullptr, 1, &bundlerHandle, 0) != pdPASS)
+        {
+            MLOGN("Could not start the event bundler task.");
+            free(ring);
+            ring = nullptr;
+            bundlerHandle = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    inline size_t toJson(char* buf, size_t len)
+    {
+        if (ring == nullptr)
+        {
+            return snprintf(buf, len, "{\"state\":\"disabled\"}");
+        }
+
+        size_t used = 0;
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        for (size_t i = 0; i < count; i++)
+        {
+            used += entryAt(i).len;
+        }
+        size_t frames = count;
+        xSemaphoreGive(mutex);
+
+        static constexpr const char* stateNames[] = {"idle", "postRoll", "bundling"};
+        return snprintf(buf, len,
+                        "{\"state\":\"%s\",\"ringFrames\":%u,\"ringBytes\":%u,\"capacityBytes\":%u,\"pushed\":%lu,"
+                        "\"evicted\":%lu,\"dropped\":%lu,\"events\":%lu,\"merged\":%lu,\"framesWritten\":%lu,"
+                        "\"framesFailed\":%lu,\"lastEventFrames\":%lu,\"maxBundleMs\":%lu}",
+                        stateNames[state],
+                        (unsigned) frames,
+                        (unsigned) used,
+                        (unsigned) EVENT_RING_BYTES,
+                        (unsigned long) stats.pushed,
+                        (unsigned long) stats.evicted,
+                        (unsigned long) stats.dropped,
+                        (unsigned long) stats.events,
+                        (unsigned long) stats.merged,
+                        (unsigned long) stats.framesWritten,
+                        (unsigned long) stats.framesFailed,
+                        (unsigned long) stats.lastEventFrames,
+                        (unsigned long) stats.maxBundleMs);
+    }
+}
+
+#endif //EVENT_RECORDER_H
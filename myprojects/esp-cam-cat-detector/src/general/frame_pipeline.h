@@ -0,0 +1,143 @@
+#ifndef FRAME_PIPELINE_H
+#define FRAME_PIPELINE_H
+
+#include <general/util.h>
+#include <esp_camera.h>
+#include <esp_timer.h>
+
+/*
+ * Capture side of the inference pipeline.
+ *
+ * A producer task on core 0 keeps grabbing frames while capturing is wanted and hands the newest one over through a
+ * single slot queue. When the consumer has not taken the previous frame yet it is given back to the camera and
+ * counted as dropped, so the consumer always gets the freshest frame without waiting for a capture.
+ */
+namespace FramePipeline
+{
+    using CaptureCondition = bool (*)();
+
+    struct Stats
+    {
+        uint32_t captured = 0;
+        uint32_t dropped = 0;
+        uint32_t consumed = 0;
+        uint32_t captureErrors = 0;
+        int64_t lastLatencyUs = 0; // frame capture to release by the consumer
+        int64_t maxLatencyUs = 0;
+    };
+
+    inline QueueHandle_t frameQueue = nullptr;
+    inline TaskHandle_t producerHandle = nullptr;
+    inline CaptureCondition shouldCapture = nullptr;
+    inline Stats stats{}; // written by both tasks, read it through snapshot
+    inline portMUX_TYPE statsLock = portMUX_INITIALIZER_UNLOCKED;
+
+    inline int64_t frameTimestampUs(const camera_fb_t* fb)
+    {
+        return (int64_t) fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+    }
+
+    // Gives the waiting frame, if any, back to the camera
+    inline void flush()
+    {
+        camera_fb_t* stale = nullptr;
+        if (frameQueue != nullptr && xQueueReceive(frameQueue, &stale, 0) == pdTRUE)
+        {
+            esp_camera_fb_return(stale);
+            portENTER_CRITICAL(&statsLock);
+            stats.dropped++;
+            portEXIT_CRITICAL(&statsLock);
+        }
+    }
+
+    inline void producerTask(void* args)
+    {
+        while (true)
+        {
+            if (shouldCapture != nullptr && !shouldCapture())
+            {
+                flush();
+                vTaskDelay(pdMS_TO_TICKS(100));
+                continue;
+            }
+
+            // Blocks until the camera has a new frame
+            camera_fb_t* fb = esp_camera_fb_get();
+            if (fb == nullptr)
+            {
+                portENTER_CRITICAL(&statsLock);
+                stats.captureErrors++;
+                portEXIT_CRITICAL(&statsLock);
+                vTaskDelay(pdMS_TO_TICKS(10));
+                continue;
+            }
+
+            portENTER_CRITICAL(&statsLock);
+            stats.captured++;
+            portEXIT_CRITICAL(&statsLock);
+            flush();
+            xQueueSend(frameQueue, &fb, 0);
+        }
+    }
+
+    inline bool start(CaptureCondition condition)
+    {
+        if (producerHandle != nullptr)
+        {
+            return true;
+        }
+
+        shouldCapture = condition;
+        frameQueue = xQueueCreate(1, sizeof(camera_fb_t*));
+        if (frameQueue == nullptr)
+        {
+            MLOGN("Failed to create frame queue.");
+            return false;
+        }
+
+        return xTaskCreatePinnedToCore(
+            producerTask,
+            "capturetask",
+            4096,
+            nullptr,
+            2,
+            &producerHandle,
+            0) == pdPASS;
+    }
+
+    // Takes the newest captured frame, waiting up to timeout for one. Must be given back with release
+    inline camera_fb_t* acquire(TickType_t timeout)
+    {
+        camera_fb_t* fb = nullptr;
+        if (frameQueue == nullptr || xQueueReceive(frameQueue, &fb, timeout) != pdTRUE)
+        {
+            return nullptr;
+        }
+
+        portENTER_CRITICAL(&statsLock);
+        stats.consumed++;
+        portEXIT_CRITICAL(&statsLock);
+        return fb;
+    }
+
+    inline void release(camera_fb_t* fb)
+    {
+        int64_t latencyUs = esp_timer_get_time() - frameTimestampUs(fb);
+        portENTER_CRITICAL(&statsLock);
+        stats.lastLatencyUs = latencyUs;
+        stats.maxLatencyUs = std::max(stats.maxLatencyUs, latencyUs);
+        portEXIT_CRITICAL(&statsLock);
+        esp_camera_fb_return(fb);
+    }
+
+    // Consistent copy of the counters, the 64 bit latencies can't be read atomically
+    inline Stats snapshot()
+    {
+        portENTER_CRITICAL(&statsLock);
+        Stats copy = stats;
+        portEXIT_CRITICAL(&statsLock);
+        return copy;
+    }
+}
+
+#endif //FRAME_PIPELINE_H
@@ -1,5 +1,14 @@
 #pragma once
 
+#include <algorithm>
+#include <cstring>
+
+#ifdef ESP_PLATFORM
+#include <jpeg_decoder.h>
+#endif
+
+#define RESIZE_MAX_DST_SIZE 256
+
 namespace IMAGE_UTIL
 {
     enum Status
@@ -18,30 +27,54 @@ namespace IMAGE_UTIL
         int height = -1;
     };
 
+    // BT.601 luma in Q8, the weights add up to 256 so white stays 255
     inline uint8_t rgbToGrayscale(uint8_t r, uint8_t g, uint8_t b)
     {
-        return (uint8_t)(0.299f * r + 0.587f * g + 0.114f * b);
+        return (uint8_t)((77 * r + 150 * g + 29 * b + 128) >> 8);
     }
 
-    inline void rgbBgrSwap(uint8_t* buffer, size_t length)
+    // Expands a single channel image to three channels, the same in either order. out holds pixels * 3 bytes
+    inline void grayToBgr(const uint8_t* gray, size_t pixels, uint8_t* out)
     {
-        if (!buffer || length < 3) return;
-
-        // Must be a multiple of 3 bytes per pixel
-        size_t pixels = length / 3;
-
         for (size_t i = 0; i < pixels; i++)
         {
-            uint8_t* p = buffer + i * 3;
+            out[i * 3 + 0] = gray[i];
+            out[i * 3 + 1] = gray[i];
+            out[i * 3 + 2] = gray[i];
+        }
+    }
 
-            uint8_t r = p[0];
-            uint8_t g = p[1];
-            uint8_t b = p[2];
+    /*
+     * Byte order of a three channel buffer. The model takes RGB, while esp32-camera's RGB888 (fmt2jpg and its
+     * decoders) is BGR in memory. Decoders write the order their consumer asks for instead of swapping afterwards.
+     */
+    enum class ChannelOrder
+    {
+        RGB,
+        BGR
+    };
+
+    inline void storePixel(uint8_t* p, uint8_t r, uint8_t g, uint8_t b, ChannelOrder order)
+    {
+        p[0] = order == ChannelOrder::RGB ? r : b;
+        p[1] = g;
+        p[2] = order == ChannelOrder::RGB ? b : r;
+    }
 
-            // write B,G,R
-            p[0] = b;
-            p[1] = g;
-            p[2] = r;
+    // Copies a row of pixels, swapping the first and last channel when the orders differ
+    inline void copyPixels(const uint8_t* src, ChannelOrder srcOrder, uint8_t* dst, ChannelOrder dstOrder, size_t pixels)
+    {
+        if (srcOrder == dstOrder)
+        {
+            memcpy(dst, src, pixels * 3);
+            return;
+        }
+
+        for (size_t i = 0; i < pixels; i++)
+        {
+            dst[i * 3 + 0] = src[i * 3 + 2];
+            dst[i * 3 + 1] = src[i * 3 + 1];
+            dst[i * 3 + 2] = src[i * 3 + 0];
         }
     }
 
@@ -54,15 +87,14 @@ namespace IMAGE_UTIL
 
     static inline void setPixel(
         uint8_t* img,
+        int imgWidth,
         int x,
         int y,
-        BGR c
+        BGR c,
+        ChannelOrder order
     )
     {
-        int idx = (y * 96 + x) * 3;
-        img[idx + 0] = c.b;
-        img[idx + 1] = c.g;
-        img[idx + 2] = c.r;
+        storePixel(img + (y * imgWidth + x) * 3, c.r, c.g, c.b, order);
     }
 
     inline void drawCross(
@@ -73,7 +105,8 @@ namespace IMAGE_UTIL
         int cy,
         BGR c,
         int size = 4, // half-length of arms
-        int thickness = 1 // line thickness
+        int thickness = 1, // line thickness
+        ChannelOrder order = ChannelOrder::BGR
     )
     {
         if (thickness <= 0)
@@ -90,7 +123,7 @@ namespace IMAGE_UTIL
                 int y = cy + t;
 
                 if (x >= 0 && x < imgWidth && y >= 0 && y < imgHeight)
-                    setPixel(img, x, y, c);
+                    setPixel(img, imgWidth, x, y, c, order);
             }
 
             // vertical arm
@@ -100,7 +133,7 @@ namespace IMAGE_UTIL
                 int y = cy + i;
 
                 if (x >= 0 && x < imgWidth && y >= 0 && y < imgHeight)
-                    setPixel(img, x, y, c);
+                    setPixel(img, imgWidth, x, y, c, order);
             }
         }
     }
@@ -113,7 +146,8 @@ namespace IMAGE_UTIL
         int cy,
         BGR c,
         int size = 12, // outer radius
-        int thickness = 1 // outline thickness
+        int thickness = 1, // outline thickness
+        ChannelOrder order = ChannelOrder::BGR
     )
     {
         if (thickness <= 0)
@@ -140,47 +174,199 @@ namespace IMAGE_UTIL
                 int y = cy + dy;
 
                 if (x >= 0 && x < imgWidth && y >= 0 && y < imgHeight)
-                    setPixel(img, x, y, c);
+                    setPixel(img, imgWidth, x, y, c, order);
             }
         }
     }
 
-    inline void cropResizeInPlace(uint8_t* src, int src_w, int src_h, int dst_w, int dst_h)
+    /*
+     * Fixed-point bilinear resize.
+     *
+     * Source positions are precomputed once per axis as taps with a Q8 weight. Resizing is separable: every
+     * source row is first resampled horizontally (each row only once, even if two output rows use it) and
+     * output rows are then blended vertically from two horizontal rows. Both passes round to the nearest
+     * integer, so all variants of the vertical blend must produce exactly the same bytes.
+     *
+     * Defining IMAGE_UTIL_RESIZE_SIMD switches the vertical blend to a packed variant that processes four
+     * channels per 32-bit word; blendRowsReference is the portable scalar version it is checked against.
+     */
+    constexpr int RESIZE_WEIGHT_BITS = 8;
+    constexpr uint32_t RESIZE_WEIGHT_ONE = 1 << RESIZE_WEIGHT_BITS;
+
+    struct ResizeTap
     {
-        // Determine square crop (fit shortest axis)
-        int crop_size = src_w < src_h ? src_w : src_h;
-        int x_offset = (src_w - crop_size) / 2;
-        int y_offset = (src_h - crop_size) / 2;
+        uint16_t i0 = 0; // first source index
+        uint16_t i1 = 0; // second source index, clamped to the last one
+        uint16_t weight = 0; // Q8 weight of i1
+    };
 
-        float x_ratio = (float)(crop_size - 1) / (dst_w - 1);
-        float y_ratio = (float)(crop_size - 1) / (dst_h - 1);
+    // Maps dstSize positions over srcSize with aligned corners, same as (srcSize - 1) / (dstSize - 1) in float
+    inline void computeResizeTaps(int srcSize, int dstSize, ResizeTap* taps)
+    {
+        for (int i = 0; i < dstSize; i++)
+        {
+            uint32_t pos = dstSize > 1 ? ((uint32_t)i * (srcSize - 1) << RESIZE_WEIGHT_BITS) / (dstSize - 1) : 0;
+            taps[i].i0 = pos >> RESIZE_WEIGHT_BITS;
+            taps[i].i1 = taps[i].i0 + 1 < srcSize ? taps[i].i0 + 1 : taps[i].i0;
+            taps[i].weight = pos & (RESIZE_WEIGHT_ONE - 1);
+        }
+    }
 
-        // We write the output directly to src (overwrite top-left)
-        for (int y = 0; y < dst_h; y++)
+    // Resamples one RGB888 row to dstWidth pixels
+    inline void resizeRowHorizontal(const uint8_t* src, const ResizeTap* xTaps, int dstWidth, uint8_t* out)
+    {
+        for (int x = 0; x < dstWidth; x++)
+        {
+            const uint8_t* p0 = src + xTaps[x].i0 * 3;
+            const uint8_t* p1 = src + xTaps[x].i1 * 3;
+            uint32_t w1 = xTaps[x].weight;
+            uint32_t w0 = RESIZE_WEIGHT_ONE - w1;
+
+            out[0] = (p0[0] * w0 + p1[0] * w1 + (RESIZE_WEIGHT_ONE >> 1)) >> RESIZE_WEIGHT_BITS;
+            out[1] = (p0[1] * w0 + p1[1] * w1 + (RESIZE_WEIGHT_ONE >> 1)) >> RESIZE_WEIGHT_BITS;
+            out[2] = (p0[2] * w0 + p1[2] * w1 + (RESIZE_WEIGHT_ONE >> 1)) >> RESIZE_WEIGHT_BITS;
+            out += 3;
+        }
+    }
+
+    // Resamples one single channel row to dstWidth pixels
+    inline void resizeRowHorizontalLuma(const uint8_t* src, const ResizeTap* xTaps, int dstWidth, uint8_t* out)
+    {
+        for (int x = 0; x < dstWidth; x++)
+        {
+            uint32_t w1 = xTaps[x].weight;
+            uint32_t w0 = RESIZE_WEIGHT_ONE - w1;
+            out[x] = (src[xTaps[x].i0] * w0 + src[xTaps[x].i1] * w1 + (RESIZE_WEIGHT_ONE >> 1)) >> RESIZE_WEIGHT_BITS;
+        }
+    }
+
+    inline void blendRowsReference(const uint8_t* top, const uint8_t* bottom, uint16_t weight, size_t len, uint8_t* out)
+    {
+        uint32_t w1 = weight;
+        uint32_t w0 = RESIZE_WEIGHT_ONE - w1;
+
+        for (size_t i = 0; i < len; i++)
         {
-            float fy = y * y_ratio;
-            int y0 = (int)fy;
-            int y1 = y0 + 1 < crop_size ? y0 + 1 : y0;
-            float wy = fy - y0;
+            out[i] = (top[i] * w0 + bottom[i] * w1 + (RESIZE_WEIGHT_ONE >> 1)) >> RESIZE_WEIGHT_BITS;
+        }
+    }
+
+    /*
+     * Four channels per 32-bit word, split in two words of two 16-bit lanes. A lane never overflows since
+     * 255 * 256 + 128 < 65536. Falls back to the reference for unaligned rows and the tail.
+     */
+    inline void blendRowsPacked(const uint8_t* top, const uint8_t* bottom, uint16_t weight, size_t len, uint8_t* out)
+    {
+        constexpr uint32_t laneMask = 0x00FF00FF;
+        constexpr uint32_t laneRound = 0x00800080;
+
+        size_t i = 0;
+        if ((((uintptr_t)top | (uintptr_t)bottom | (uintptr_t)out) & 3) == 0)
+        {
+            uint32_t w1 = weight;
+            uint32_t w0 = RESIZE_WEIGHT_ONE - w1;
+
+            auto top32 = (const uint32_t*)top;
+            auto bottom32 = (const uint32_t*)bottom;
+            auto out32 = (uint32_t*)out;
 
-            for (int x = 0; x < dst_w; x++)
+            for (size_t words = len / 4; i < words; i++)
             {
-                float fx = x * x_ratio;
-                int x0 = (int)fx;
-                int x1 = x0 + 1 < crop_size ? x0 + 1 : x0;
-                float wx = fx - x0;
+                uint32_t t = top32[i];
+                uint32_t b = bottom32[i];
+
+                uint32_t even = ((t & laneMask) * w0 + (b & laneMask) * w1 + laneRound) >> RESIZE_WEIGHT_BITS;
+                uint32_t odd = (((t >> 8) & laneMask) * w0 + ((b >> 8) & laneMask) * w1 + laneRound) >> RESIZE_WEIGHT_BITS;
+                out32[i] = (even & laneMask) | ((odd & laneMask) << 8);
+            }
+
+            i *= 4;
+        }
+
+        blendRowsReference(top + i, bottom + i, weight, len - i, out + i);
+    }
+
+    inline void blendRows(const uint8_t* top, const uint8_t* bottom, uint16_t weight, size_t len, uint8_t* out)
+    {
+#ifdef IMAGE_UTIL_RESIZE_SIMD
+        blendRowsPacked(top, bottom, weight, len, out);
+#else
+        blendRowsReference(top, bottom, weight, len, out);
+#endif
+    }
+
+    // Horizontally resampled versions of the last two source rows used
+    struct ResizeRowCache
+    {
+        alignas(4) uint8_t rows[2][RESIZE_MAX_DST_SIZE * 3]{};
+        int rowIds[2] = {-1, -1};
 
-                for (int c = 0; c < 3; c++)
+        void clear()
+        {
+            rowIds[0] = -1;
+            rowIds[1] = -1;
+        }
+
+        // Resamples srcRow into the slot not holding keepRow, unless it is already cached. channels is 3 or 1
+        const uint8_t* get(int srcRow, int keepRow, const uint8_t* srcRowData, const ResizeTap* xTaps, int dstWidth, int channels = 3)
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                if (rowIds[i] == srcRow)
                 {
-                    // B, G, R channels
-                    float val = (1 - wx) * (1 - wy) * src[((y0 + y_offset) * src_w + (x0 + x_offset)) * 3 + c] +
-                        wx * (1 - wy) * src[((y0 + y_offset) * src_w + (x1 + x_offset)) * 3 + c] +
-                        (1 - wx) * wy * src[((y1 + y_offset) * src_w + (x0 + x_offset)) * 3 + c] +
-                        wx * wy * src[((y1 + y_offset) * src_w + (x1 + x_offset)) * 3 + c];
-                    src[(y * dst_w + x) * 3 + c] = (uint8_t)(val + 0.5f);
+                    return rows[i];
                 }
             }
+
+            int slot = rowIds[0] == keepRow ? 1 : 0;
+            if (channels == 1)
+            {
+                resizeRowHorizontalLuma(srcRowData, xTaps, dstWidth, rows[slot]);
+            }
+            else
+            {
+                resizeRowHorizontal(srcRowData, xTaps, dstWidth, rows[slot]);
+            }
+            rowIds[slot] = srcRow;
+            return rows[slot];
         }
+    };
+
+    inline Status cropResizeInPlace(uint8_t* src, int src_w, int src_h, int dst_w, int dst_h)
+    {
+        if (dst_w > RESIZE_MAX_DST_SIZE || dst_h > RESIZE_MAX_DST_SIZE)
+        {
+            return BUFFER_TOO_SMALL;
+        }
+
+        // Determine square crop (fit shortest axis)
+        int crop_size = src_w < src_h ? src_w : src_h;
+        int x_offset = (src_w - crop_size) / 2;
+        int y_offset = (src_h - crop_size) / 2;
+
+        ResizeTap xTaps[RESIZE_MAX_DST_SIZE];
+        ResizeTap yTaps[RESIZE_MAX_DST_SIZE];
+        computeResizeTaps(crop_size, dst_w, xTaps);
+        computeResizeTaps(crop_size, dst_h, yTaps);
+
+        static ResizeRowCache cache;
+        cache.clear();
+
+        auto sourceRow = [&](int row)
+        {
+            return src + ((size_t)(row + y_offset) * src_w + x_offset) * 3;
+        };
+
+        // We write the output directly to src (overwrite top-left), output row y never reaches a source row still needed
+        for (int y = 0; y < dst_h; y++)
+        {
+            const ResizeTap& tap = yTaps[y];
+            const uint8_t* top = cache.get(tap.i0, tap.i1, sourceRow(tap.i0), xTaps, dst_w);
+            const uint8_t* bottom = cache.get(tap.i1, tap.i0, sourceRow(tap.i1), xTaps, dst_w);
+            blendRows(top, bottom, tap.weight, (size_t)dst_w * 3, src + (size_t)y * dst_w * 3);
+        }
+
+        return OK;
     }
 
     inline bool jpegGetSize(const uint8_t* data, uint32_t len, ImageDimensions& dims)
@@ -254,17 +440,70 @@ namespace IMAGE_UTIL
         return false;
     }
 
-    inline void adjustDimensionsScale(ImageDimensions &dimensions, esp_jpeg_image_scale_t scale)
+    inline int scaleDivisor(esp_jpeg_image_scale_t scale)
     {
-        uint32_t scale_div = 1;
         switch(scale) {
-            case JPEG_IMAGE_SCALE_1_2: scale_div = 2; break;
-            case JPEG_IMAGE_SCALE_1_4: scale_div = 4; break;
-            case JPEG_IMAGE_SCALE_1_8: scale_div = 8; break;
-            default: scale_div = 1;
+            case JPEG_IMAGE_SCALE_1_2: return 2;
+            case JPEG_IMAGE_SCALE_1_4: return 4;
+            case JPEG_IMAGE_SCALE_1_8: return 8;
+            default: return 1;
         }
+    }
 
+    inline void adjustDimensionsScale(ImageDimensions &dimensions, esp_jpeg_image_scale_t scale)
+    {
+        uint32_t scale_div = scaleDivisor(scale);
         dimensions.width  = ceil(dimensions.width / scale_div);
         dimensions.height = ceil(dimensions.height / scale_div);
     }
+
+    // Square crop in pixels of the image it applies to
+    struct CropRect
+    {
+        int x = 0;
+        int y = 0;
+        int size = 0;
+    };
+
+    inline CropRect centerSquareCrop(const ImageDimensions &dimensions)
+    {
+        CropRect crop{};
+        crop.size = dimensions.width < dimensions.height ? dimensions.width : dimensions.height;
+        crop.x = (dimensions.width - crop.size) / 2;
+        crop.y = (dimensions.height - crop.size) / 2;
+        return crop;
+    }
+
+    // Square crop of the given size centered as close as possible to (centerX, centerY) while staying inside the image
+    inline CropRect squareCropAround(const ImageDimensions &dimensions, int centerX, int centerY, int size)
+    {
+        CropRect crop{};
+        crop.size = std::min(size, std::min(dimensions.width, dimensions.height));
+        crop.x = std::max(0, std::min(centerX - crop.size / 2, dimensions.width - crop.size));
+        crop.y = std::max(0, std::min(centerY - crop.size / 2, dimensions.height - crop.size));
+        return crop;
+    }
+
+    inline CropRect scaleCrop(const CropRect &crop, esp_jpeg_image_scale_t scale)
+    {
+        int div = scaleDivisor(scale);
+        return {crop.x / div, crop.y / div, crop.size / div};
+    }
+
+    // Largest decoder (DCT domain) scale that still yields at least minWidth x minHeight pixels
+    inline esp_jpeg_image_scale_t selectDecodeScale(const ImageDimensions &dimensions, int minWidth, int minHeight)
+    {
+        constexpr esp_jpeg_image_scale_t scales[] = {JPEG_IMAGE_SCALE_1_8, JPEG_IMAGE_SCALE_1_4, JPEG_IMAGE_SCALE_1_2};
+        for (esp_jpeg_image_scale_t scale : scales)
+        {
+            ImageDimensions scaled = dimensions;
+            adjustDimensionsScale(scaled, scale);
+            if (scaled.width >= minWidth && scaled.height >= minHeight)
+            {
+                return scale;
+            }
+        }
+
+        return JPEG_IMAGE_SCALE_0;
+    }
 }
@@ -0,0 +1,197 @@
+#ifndef INFERENCE_SCHEDULER_H
+#define INFERENCE_SCHEDULER_H
+
+#include <general/util.h>
+
+#define SCHEDULER_MOTION_TICK_MS 500 // the motion gate checks a frame at least this often, idle or not
+#define SCHEDULER_BACKOFF 1.5f // period growth for every quiet frame
+#define SCHEDULER_MOTION_FACTOR 2 // motion without detections runs at this multiple of the burst period
+#define SCHEDULER_TEMPERATURE_INTERVAL_MS 5000
+#define SCHEDULER_WARM_C 65.0f // throttling starts here
+#define SCHEDULER_HOT_C 80.0f // and reaches the idle period here
+
+/*
+ * Picks how often the detector runs, between a burst ceiling and an idle floor.
+ *
+ * The inference task wakes every SCHEDULER_MOTION_TICK_MS, or faster while bursting, and always runs the cheap
+ * motion gate, so an approaching cat is noticed just as quickly whatever the period. The period only spaces out
+ * detector runs. A detection jumps straight to the burst period and motion to a multiple of it, every quiet frame
+ * after that stretches the period by SCHEDULER_BACKOFF until it settles on the idle one. Two floors are applied on
+ * top: the dark period replaces a quiet period while the flash is on, and a thermal one grows from the burst to
+ * the idle period as the chip goes from SCHEDULER_WARM_C to SCHEDULER_HOT_C.
+ *
+ * Only detector runs are saved, an idle camera doesn't get near zero CPU: every tick still takes a frame, decodes
+ * it at 1/8 scale for the motion gate and copies it into the EventRecorder pre roll.
+ */
+namespace InferenceScheduler
+{
+    enum Activity
+    {
+        QUIET,
+        MOTION,
+        DETECTION,
+    };
+
+    enum Reason
+    {
+        IDLE,
+        BACKOFF,
+        ACTIVE,
+        BURST,
+        DARK,
+        THERMAL,
+        REASON_COUNT,
+    };
+
+    constexpr const char* reasonNames[REASON_COUNT] = {
+        "idle",
+        "backoff",
+        "active",
+        "burst",
+        "dark",
+        "thermal",
+    };
+
+    struct Policy
+    {
+        uint32_t idleMs = 3000;
+        uint32_t burstMs = 250;
+        uint32_t darkMs = 10000; // quiet period while the flash is on
+    };
+
+    struct Stats
+    {
+        uint32_t periodMs = 0;
+        Reason reason = IDLE;
+        float temperatureC = 0;
+        uint32_t runs[REASON_COUNT]{}; // detector runs under each reason
+    };
+
+    inline Policy policy{};
+    inline Stats stats{};
+    inline float activityMs = 0; // period from activity alone, 0 until the first update
+    inline unsigned long temperatureReadAt = 0;
+    inline unsigned long lastRunMs = 0;
+    inline bool hasRun = false;
+
+    inline void reset()
+    {
+        activityMs = 0;
+        hasRun = false;
+    }
+
+    inline uint32_t periodMs()
+    {
+        return stats.periodMs > 0 ? stats.periodMs : policy.idleMs;
+    }
+
+    // How long the inference task sleeps between frames, the motion tick or the detector period if shorter
+    inline TickType_t tickInterval()
+    {
+        return pdMS_TO_TICKS(std::min<uint32_t>(SCHEDULER_MOTION_TICK_MS, periodMs()));
+    }
+
+    // Whether a period went by since the detector last ran
+    inline bool detectorDue()
+    {
+        return !hasRun || millis() - lastRunMs >= periodMs();
+    }
+
+    inline void markRun()
+    {
+        lastRunMs = millis();
+        hasRun = true;
+        stats.runs[stats.reason]++;
+    }
+
+    inline float temperature()
+    {
+        unsigned long now = millis();
+        if (temperatureReadAt == 0 || now - temperatureReadAt >= SCHEDULER_TEMPERATURE_INTERVAL_MS)
+        {
+            stats.temperatureC = temperatureRead();
+            temperatureReadAt = now;
+        }
+        return stats.temperatureC;
+    }
+
+    // Updates the detector period with the activity seen on the latest frame
+    inline void update(Activity activity, const Policy& newPolicy)
+    {
+        policy = newPolicy;
+        float burstMs = std::max<uint32_t>(policy.burstMs, 1);
+        float idleMs = std::max<float>(policy.idleMs, burstMs);
+
+        switch (activity)
+        {
+            case DETECTION:
+                activityMs = burstMs;
+                break;
+            case MOTION:
+                activityMs = activityMs > 0 ? std::min(activityMs, burstMs * SCHEDULER_MOTION_FACTOR) : burstMs * SCHEDULER_MOTION_FACTOR;
+                break;
+            case QUIET:
+                activityMs = activityMs > 0 ? activityMs * SCHEDULER_BACKOFF : idleMs;
+                break;
+        }
+        activityMs = std::min(std::max(activityMs, burstMs), idleMs);
+
+        float period = activityMs;
+        Reason reason = activity == DETECTION ? BURST : activity == MOTION ? ACTIVE : activityMs < idleMs ? BACKOFF : IDLE;
+
+        // The flash only turns on when the scene is too dark without it, motion or a detection keeps the rates
+        if (activity == QUIET && flashOn && policy.darkMs > period)
+        {
+            period = policy.darkMs;
+            reason = DARK;
+        }
+
+        float heat = (temperature() - SCHEDULER_WARM_C) / (SCHEDULER_HOT_C - SCHEDULER_WARM_C);
+        if (heat > 0)
+        {
+            float thermalMs = burstMs + (idleMs - burstMs) * std::min(heat, 1.0f);
+            if (thermalMs > period)
+            {
+                period = thermalMs;
+                reason = THERMAL;
+            }
+        }
+
+        stats.periodMs = period;
+        stats.reason = reason;
+    }
+
+    inline size_t toJson(char* buf, size_t len)
+    {
+        uint32_t period = periodMs();
+        size_t used = snprintf(buf, len,
+                               "{\"motionTickMs\":%lu,\"periodMs\":%lu,\"perMinute\":%.1f,\"reason\":\"%s\",\"temperatureC\":%.1f,"
+                               "\"luminosity\":%.3f,\"flash\":%s,\"policy\":{\"idleMs\":%lu,\"burstMs\":%lu,"
+                               "\"darkMs\":%lu,\"warmC\":%.1f,\"hotC\":%.1f},\"runs\":{",
+                               (unsigned long) SCHEDULER_MOTION_TICK_MS,
+                               (unsigned long) period,
+                               period > 0 ? 60000.0f / period : 0.0f,
+                               reasonNames[stats.reason],
+                               stats.temperatureC,
+                               IotProperties::currentLuminosity,
+                               flashOn ? "true" : "false",
+                               (unsigned long) policy.idleMs,
+                               (unsigned long) policy.burstMs,
+                               (unsigned long) policy.darkMs,
+                               SCHEDULER_WARM_C,
+                               SCHEDULER_HOT_C);
+
+        for (size_t i = 0; i < REASON_COUNT && used < len; i++)
+        {
+            used += snprintf(buf + used, len - used, "%s\"%s\":%lu", i > 0 ? "," : "", reasonNames[i], (unsigned long) stats.runs[i]);
+        }
+
+        if (used < len)
+        {
+            used += snprintf(buf + used, len - used, "}}");
+        }
+        return used;
+    }
+}
+
+#endif //INFERENCE_SCHEDULER_H
@@ -5,14 +5,32 @@
 #ifndef INFERENCE_UTIL_H
 #define INFERENCE_UTIL_H
 
-#include <general/cam_config.h>
+#include <general/log.h>
 #include <general/image_util.h>
-#include <general/jpeg_util.h>
+#include <general/jpegdec_util.h>
+#include <general/buffer_pool.h>
+#include <general/latency_stats.h>
 
 // #define MODEL_STATIC_TENSOR_ARENA
 #define MODEL_USE_PSRAM
+// #define MODEL_SPLIT_ARENA
+// No grayscale model ships yet: MODEL_IS_GRAYSCALE only builds once a single channel model is exported and
+// model_data_gray.h is generated from it the same way as model_data.h. It is then decoded from luma only.
+// #define MODEL_IS_GRAYSCALE
+// #define MODEL_ENABLE_GATE // presence classifier from gate_model_data.h run before the detector, see runCascadeFromImage
 #include "model_util.h"
 
+#ifdef ESP_PLATFORM
+#include <general/model_store.h>
+#endif
+
+// Written into model_data.h by model_fold_input when the input Quantize op of the embedded model was folded.
+// The model_data.h in the tree isn't folded, so the firmware still runs the op and the lookup table stays unused.
+#ifndef MODEL_DATA_INPUT_SCALE
+#define MODEL_DATA_INPUT_SCALE 0.0f
+#define MODEL_DATA_INPUT_ZERO_POINT 0
+#endif
+
 // #define INFERENCE_ENABLE_LOG
 
 #ifdef INFERENCE_ENABLE_LOG
@@ -20,10 +38,14 @@
 #define INFERENCE_ERROR_FN(error, errorNum, output) printError(error, errorNum, output)
 #else
 #define INFERENCE_LOG_FN(p...)
-#define INFERENCE_ERROR_FN(error, errorNum, output)
+#define INFERENCE_ERROR_FN(error, errorNum, output) (output).status = errorNum
 #endif
 
-// #define MODEL_IS_GRAYSCALE
+#ifdef MODEL_IS_GRAYSCALE
+#define MODEL_INPUT_CHANNELS 1
+#else
+#define MODEL_INPUT_CHANNELS 3
+#endif
 #define MODEL_INPUT_WIDTH 96
 #define MODEL_INPUT_HEIGHT 96
 #define MAX_BOXES 10
@@ -33,15 +55,47 @@
 #define MODEL_CLASS_COUNT 3
 #define MAX_LABEL_LENGTH 32
 #define MAX_INFERENCE_DECODE_LENGTH (1024 * 1000 * 4)
+#define INFERENCE_OVERLAY_BUFFERS 2
+#define INFERENCE_ROI_ZOOM 2 // ROI side is the smallest frame side divided by this
+#define INFERENCE_ROI_MAX_MISSES 3
+#define TRACKER_MAX_TRACKS 8
+#define TRACKER_MATCH_DISTANCE 0.2f // fraction of the smallest frame side
+#define TRACKER_SMOOTHING 0.6f // weight of the newest confidence
+#define TRACKER_CONFIRM_HITS 2
+#define TRACKER_MAX_MISSES 2
+
+static_assert(MODEL_DATA_INPUT_CHANNELS == MODEL_INPUT_CHANNELS, "model_data input channels don't match MODEL_IS_GRAYSCALE");
 
 namespace InferenceUtil
 {
-    constexpr char classes[MODEL_CLASS_COUNT][MAX_LABEL_LENGTH] = {"bg", "cat", "human"};
-    constexpr float thresholds[] = {1, 0.75, 0.5};
+    constexpr char defaultClasses[MODEL_CLASS_COUNT][MAX_LABEL_LENGTH] = {"bg", "cat", "human"};
+    constexpr float defaultThresholds[MODEL_CLASS_COUNT] = {1, 0.75, 0.5};
+
+    // Replaced by the class table of a stored model, positions keep their meaning: background, cat, human
+    inline char classes[MODEL_CLASS_COUNT][MAX_LABEL_LENGTH] = {"bg", "cat", "human"};
+    inline float thresholds[MODEL_CLASS_COUNT] = {1, 0.75, 0.5};
     constexpr uint8_t catIndex = 1;
     constexpr uint8_t humanIndex = 2;
+    constexpr auto autoDecodeScale = (esp_jpeg_image_scale_t) -1;
     inline unsigned long currentStartTimer = 0;
 
+    // Side of the largest square crop of an image within MAX_INFERENCE_DECODE_LENGTH
+    constexpr size_t maxCropSize()
+    {
+        size_t side = 0;
+        while ((side + 1) * (side + 1) * 3 <= MAX_INFERENCE_DECODE_LENGTH)
+        {
+            side++;
+        }
+        return side;
+    }
+
+    constexpr size_t decodeBufferSize = (STREAM_MAX_STRIP_ROWS + 1) * maxCropSize() * MODEL_INPUT_CHANNELS;
+    constexpr size_t inputSize = MODEL_DATA_INPUT_WIDTH * MODEL_DATA_INPUT_HEIGHT * MODEL_INPUT_CHANNELS;
+    constexpr size_t processedSize = MODEL_DATA_INPUT_WIDTH * MODEL_DATA_INPUT_HEIGHT * 3; // BGR888 overlay, whatever the model input
+    constexpr IMAGE_UTIL::ChannelOrder inputOrder = IMAGE_UTIL::ChannelOrder::RGB;
+    constexpr IMAGE_UTIL::ChannelOrder overlayOrder = IMAGE_UTIL::ChannelOrder::BGR; // what fmt2jpg reads as RGB888
+
     static const IMAGE_UTIL::BGR classColors[MAX_BOXES + 1] = {
         {  0,   0,   0 },   // 0 - unused
 
@@ -72,8 +126,10 @@ namespace InferenceUtil
         int classId = -1;
         char label[MAX_LABEL_LENGTH]{};
         float value = 0;
-        float x = 0;
+        float x = 0; // model input space
         float y = 0;
+        float frameX = 0; // pixels of the full resolution frame
+        float frameY = 0;
     };
 
     struct InferenceOutput
@@ -83,6 +139,9 @@ namespace InferenceUtil
         int status = 0; // 0 = OK, less than 0 = Error
         unsigned long totalLatency = 0;
         unsigned long inferenceLatency = 0;
+        int frameWidth = 0; // full resolution frame the detections were mapped to
+        int frameHeight = 0;
+        bool gated = false; // the presence gate found the frame empty and the detector didn't run
 
         bool add(const InferenceValues& val)
         {
@@ -165,82 +224,293 @@ namespace InferenceUtil
     }
 #endif
 
-    inline bool keep_cell(
-        const uint8_t* grid,
-        int rows,
-        int cols,
-        int r,
-        int c,
-        int class_idx,
-        float value
-    )
+    /*
+     * Region of interest mode: while a cat is being tracked, the model runs on a window around its last position
+     * instead of the whole frame, which gives it more pixels on the animal and allows a cheaper decoder scale.
+     * Falls back to the full frame after INFERENCE_ROI_MAX_MISSES frames without a cat.
+     */
+    struct RoiTracker
     {
-        constexpr int K = 3;
-        constexpr int R = K / 2;
-        constexpr float EPSS = 1e-6f;
+        bool active = false;
+        float centerX = 0;
+        float centerY = 0;
+        int misses = 0;
+        IMAGE_UTIL::ImageDimensions frameDimensions{};
 
-        // Global priority (lower = higher priority)
-        int my_prio = r * cols + c;
-
-        for (int dr = -R; dr <= R; dr++)
+        void reset()
         {
-            int rr = r + dr;
-            if (rr < 0 || rr >= rows) continue;
+            active = false;
+            misses = 0;
+        }
 
-            for (int dc = -R; dc <= R; dc++)
+        // Crop to run on in full resolution pixels
+        IMAGE_UTIL::CropRect crop(const IMAGE_UTIL::ImageDimensions& dimensions)
+        {
+            if (dimensions.width != frameDimensions.width || dimensions.height != frameDimensions.height)
             {
-                int cc = c + dc;
-                if (cc < 0 || cc >= cols) continue;
+                reset();
+                frameDimensions = dimensions;
+            }
 
-                if (rr == r && cc == c) continue;
+            IMAGE_UTIL::CropRect center = IMAGE_UTIL::centerSquareCrop(dimensions);
+            if (!active)
+            {
+                return center;
+            }
 
-                float other = ModelUtil::unquantizeValue(grid[(rr * cols + cc) * MODEL_CLASS_COUNT + class_idx]);
+            // Never smaller than what the center crop decodes at its own scale, a finer decode would cost more than
+            // the zoom saves. Small frames where that leaves nothing to zoom into just keep the center crop.
+            esp_jpeg_image_scale_t centerScale = IMAGE_UTIL::selectDecodeScale({center.size, center.size}, MODEL_DATA_INPUT_WIDTH, MODEL_DATA_INPUT_HEIGHT);
+            int minSize = std::max(MODEL_DATA_INPUT_WIDTH, MODEL_DATA_INPUT_HEIGHT) * IMAGE_UTIL::scaleDivisor(centerScale);
+            int size = std::max(center.size / INFERENCE_ROI_ZOOM, minSize);
+            if (size >= center.size)
+            {
+                return center;
+            }
+            return IMAGE_UTIL::squareCropAround(dimensions, centerX, centerY, size);
+        }
 
-                // 1) Stronger neighbor → suppress
-                if (other > value + EPSS)
+        void update(const InferenceOutput& output)
+        {
+            const InferenceValues* best = nullptr;
+            for (size_t i = 0; i < output.count; i++)
+            {
+                const InferenceValues& values = output.foundValues[i];
+                if (values.classId == catIndex && (best == nullptr || values.value > best->value))
                 {
-                    return false;
+                    best = &values;
                 }
+            }
+
+            if (best != nullptr)
+            {
+                active = true;
+                misses = 0;
+                centerX = best->frameX;
+                centerY = best->frameY;
+            }
+            else if (active && ++misses >= INFERENCE_ROI_MAX_MISSES)
+            {
+                reset();
+            }
+        }
+    };
+
+    // Class thresholds in the output tensor's quantized domain, 256 means the class never passes
+    inline uint16_t quantizedThresholds[MODEL_CLASS_COUNT]{};
+
+    // Pixel to int8 input value, used when the model's input Quantize op was folded into the decoder
+    inline uint8_t inputValueMap[256]{};
+    inline bool inputMapped = false;
+
+    /*
+     * Checks the loaded input tensor against the decoder output. A uint8 input takes the pixels as they are,
+     * an int8 one comes from a model stripped by model_fold_input: pixelScale and pixelZeroPoint are the
+     * quantization of the removed uint8 input, and the Quantize op it ran is turned into a lookup table.
+     */
+    inline int prepareInput(float pixelScale, int32_t pixelZeroPoint)
+    {
+        const TfLiteTensor* input = ModelUtil::currentInputTensor;
+        if (input->bytes != inputSize)
+        {
+            MLOGF("Input tensor has %zu bytes, expected %zu.\n", input->bytes, inputSize);
+            return ModelUtil::UNSUPPORTED_TENSOR_TYPE;
+        }
+
+        inputMapped = false;
+        if (input->type == kTfLiteUInt8)
+        {
+            return ModelUtil::OK;
+        }
+
+        if (input->type != kTfLiteInt8 || pixelScale <= 0)
+        {
+            MLOGF("Unsupported input tensor type %d, or a folded model without its pixel quantization.\n", input->type);
+            return ModelUtil::UNSUPPORTED_TENSOR_TYPE;
+        }
+
+        ModelUtil::fillRequantizeTable(pixelScale, pixelZeroPoint, input->params.scale, input->params.zero_point,
+                                       (int8_t*) inputValueMap);
+
+        inputMapped = true;
+        return ModelUtil::OK;
+    }
+
+    // Checks the loaded output tensor against the post processing and quantizes the class thresholds
+    inline int prepareOutput()
+    {
+        if (ModelUtil::currentOutputTensor->type != kTfLiteUInt8)
+        {
+            MLOGF("Unsupported output tensor type: %d\n", ModelUtil::currentOutputTensor->type);
+            return ModelUtil::UNSUPPORTED_TENSOR_TYPE;
+        }
+
+        if (ModelUtil::currentOutputTensor->bytes != MODEL_OUTPUT_ROWS * MODEL_OUTPUT_COLS * MODEL_CLASS_COUNT)
+        {
+            MLOGF("Output tensor has %zu bytes, expected %d.\n",
+                  ModelUtil::currentOutputTensor->bytes,
+                  MODEL_OUTPUT_ROWS * MODEL_OUTPUT_COLS * MODEL_CLASS_COUNT);
+            return ModelUtil::UNSUPPORTED_TENSOR_TYPE;
+        }
+
+        for (size_t ci = 0; ci < MODEL_CLASS_COUNT; ci++)
+        {
+            quantizedThresholds[ci] = ModelUtil::quantizeThreshold(thresholds[ci]);
+        }
+
+        return ModelUtil::OK;
+    }
+
+    // Labels filling their whole width don't need a terminator, as in the header of a stored model
+    template <size_t LabelLength>
+    inline void setClassTable(const char (*names)[LabelLength], const float* classThresholds)
+    {
+        constexpr int nameLength = LabelLength < MAX_LABEL_LENGTH ? LabelLength : MAX_LABEL_LENGTH - 1;
+        for (size_t ci = 0; ci < MODEL_CLASS_COUNT; ci++)
+        {
+            snprintf(classes[ci], MAX_LABEL_LENGTH, "%.*s", nameLength, names[ci]);
+            thresholds[ci] = classThresholds[ci];
+        }
+    }
+
+#ifdef ESP_PLATFORM
+    inline int loadStoredModel()
+    {
+        const ModelFormat::Header &header = ModelStore::current.header;
+        int res = ModelUtil::loadModel(ModelStore::current.data, ModelStore::arenaSizes());
+        if (res != ModelUtil::OK)
+        {
+            return res;
+        }
+
+        setClassTable(header.classNames, header.thresholds);
+        res = prepareInput(header.inputScale, header.inputZeroPoint);
+        return res == ModelUtil::OK ? prepareOutput() : res;
+    }
+#endif
+
+#ifdef MODEL_ENABLE_GATE
+    inline bool gateReady = false;
+
+    // Loads the presence classifier and checks its tensors: a uint8 image input and one or two output values
+    inline int loadGate()
+    {
+        int res = ModelUtil::loadGateModel();
+        if (res != ModelUtil::OK)
+        {
+            return res;
+        }
+
+        const TfLiteTensor* input = ModelUtil::gateInputTensor;
+        const TfLiteTensor* output = ModelUtil::gateOutputTensor;
+        if (input->type != kTfLiteUInt8 ||
+            input->bytes != GATE_MODEL_DATA_INPUT_WIDTH * GATE_MODEL_DATA_INPUT_HEIGHT * GATE_MODEL_DATA_INPUT_CHANNELS ||
+            (output->type != kTfLiteUInt8 && output->type != kTfLiteInt8) ||
+            output->bytes < 1 || output->bytes > 2)
+        {
+            MLOGF("Unsupported gate tensors, input type %d with %zu bytes, output type %d with %zu bytes.\n",
+                  input->type, input->bytes, output->type, output->bytes);
+            ModelUtil::unloadGateModel();
+            return ModelUtil::UNSUPPORTED_TENSOR_TYPE;
+        }
 
-                // 2) Equal value → global tie-break
-                if (fabsf(other - value) < EPSS)
+        gateReady = true;
+        return ModelUtil::OK;
+    }
+#endif
+
+    // Loads the stored model if there is a usable one, otherwise the one compiled into model_data.h
+    inline int loadModel()
+    {
+#ifdef MODEL_ENABLE_GATE
+        if (!gateReady)
+        {
+            int gateRes = loadGate();
+            if (gateRes != ModelUtil::OK)
+            {
+                MLOGF("Presence gate failed to load: %d, the detector runs on every frame.\n", gateRes);
+            }
+        }
+#endif
+
+#ifdef ESP_PLATFORM
+        // Every rejected slot is erased, so this ends once the stored models left all load or are used up
+        while (ModelStore::open(MODEL_CLASS_COUNT))
+        {
+            int res = loadStoredModel();
+            if (res == ModelUtil::OK)
+            {
+                return res;
+            }
+
+            bool partition = ModelStore::current.source == ModelStore::PARTITION;
+            MLOGF("Stored model failed to load: %d, dropping it.\n", res);
+            ModelUtil::unloadModel();
+            ModelStore::reject(res);
+            if (!partition)
+            {
+                break;
+            }
+        }
+#endif
+
+        setClassTable(defaultClasses, defaultThresholds);
+        int res = ModelUtil::loadModel();
+        if (res != ModelUtil::OK)
+        {
+            return res;
+        }
+
+        res = prepareInput(MODEL_DATA_INPUT_SCALE, MODEL_DATA_INPUT_ZERO_POINT);
+        return res == ModelUtil::OK ? prepareOutput() : res;
+    }
+
+    // 3x3 local maximum on raw quantized values, ties go to the cell that comes first in the grid
+    inline bool isLocalMaximum(const uint8_t* grid, int r, int c, int classIdx)
+    {
+        const uint8_t value = grid[(r * MODEL_OUTPUT_COLS + c) * MODEL_CLASS_COUNT + classIdx];
+
+        for (int rr = std::max(r - 1, 0); rr <= std::min(r + 1, MODEL_OUTPUT_ROWS - 1); rr++)
+        {
+            for (int cc = std::max(c - 1, 0); cc <= std::min(c + 1, MODEL_OUTPUT_COLS - 1); cc++)
+            {
+                uint8_t other = grid[(rr * MODEL_OUTPUT_COLS + cc) * MODEL_CLASS_COUNT + classIdx];
+                if (other > value || (other == value && (rr < r || (rr == r && cc < c))))
                 {
-                    int other_prio = rr * cols + cc;
-                    if (other_prio < my_prio)
-                    {
-                        return false;
-                    }
+                    return false;
                 }
             }
         }
+
         return true;
     }
 
-    inline int runClassifierAndExtractInfo(const uint8_t* imageBuffer, InferenceOutput& output)
+    inline int runClassifierAndExtractInfo(const ModelUtil::InputCallback& writeInput, InferenceOutput& output)
     {
         INFERENCE_LOG_FN("Running inference.");
 
         uint8_t* outputBuffer = nullptr;
-        int resultStatus = ModelUtil::runInference(&outputBuffer, [imageBuffer](uint8_t* dst)
+        unsigned long invokeStart = 0;
+        int resultStatus = ModelUtil::runInference(&outputBuffer, [&](uint8_t* dst)
         {
-            for (int i = 0; i < MODEL_DATA_INPUT_WIDTH * MODEL_DATA_INPUT_HEIGHT; i++)
-            {
-                uint8_t b = imageBuffer[3 * i + 0];
-                uint8_t g = imageBuffer[3 * i + 1];
-                uint8_t r = imageBuffer[3 * i + 2];
-
-                dst[3 * i + 0] = r; // BGR → RGB
-                dst[3 * i + 1] = g;
-                dst[3 * i + 2] = b;
-            }
+            bool written = writeInput(dst);
+            invokeStart = micros();
+            return written;
         });
 
         if (resultStatus != ModelUtil::OK)
         {
-            INFERENCE_ERROR_FN("Error running inference", resultStatus, output);
-            return resultStatus;
+            // Keeps an error writeInput already reported, like a failed decode, over the generic INPUT_WRITE_FAILED
+            if (output.status >= 0)
+            {
+                INFERENCE_ERROR_FN("Error running inference", resultStatus, output);
+            }
+            return output.status;
         }
 
+        LatencyStats::record(LatencyStats::INVOKE, micros() - invokeStart);
+        LatencyStats::ScopedTimer postProcessTimer(LatencyStats::POST_PROCESS);
+
         INFERENCE_LOG_FN("Extracting object positions.", true);
         for (size_t i = 0; i < MODEL_OUTPUT_ROWS; i++)
         {
@@ -249,18 +519,12 @@ namespace InferenceUtil
                 uint8_t* row = outputBuffer + (i * MODEL_OUTPUT_COLS + j) * MODEL_CLASS_COUNT;
                 for (size_t ci = 1; ci < MODEL_CLASS_COUNT; ci++)
                 {
-                    float threshold = thresholds[ci];
-                    float value = ModelUtil::unquantizeValue(row[ci]);
-                    if (value < threshold)
-                    {
-                        continue;
-                    }
-
-                    if (!keep_cell(outputBuffer, MODEL_OUTPUT_ROWS, MODEL_OUTPUT_COLS, i, j, ci, value))
+                    if (row[ci] < quantizedThresholds[ci] || !isLocalMaximum(outputBuffer, i, j, ci))
                     {
                         continue;
                     }
 
+                    float value = ModelUtil::unquantizeValue(row[ci]);
                     InferenceValues values{};
                     values.classId = ci;
                     values.value = value;
@@ -287,78 +551,455 @@ namespace InferenceUtil
         return ModelUtil::OK;
     }
 
+    // The decoder, resize state and interpreter are shared by the inference task and the web handlers, see setupBuffers
+    inline SemaphoreHandle_t inferenceMutex = nullptr;
+
+    struct InferenceLock
+    {
+        InferenceLock()
+        {
+            xSemaphoreTake(inferenceMutex, portMAX_DELAY);
+        }
+
+        ~InferenceLock()
+        {
+            xSemaphoreGive(inferenceMutex);
+        }
+    };
+
+    // Swaps in the currently stored model, waiting for any inference in progress to finish
+    inline int reloadModel()
+    {
+        InferenceLock lock;
+        ModelUtil::unloadModel();
+#ifdef ESP_PLATFORM
+        ModelStore::close();
+#endif
+        return loadModel();
+    }
+
+    /*
+     * Reloads the model once per arena placement and times runs invokes on a blank input under each, one text row
+     * per placement. A split arena that can't be allocated falls back to a single one, the row names the placement
+     * that was actually used. The build's placement is loaded again at the end.
+     */
+    inline size_t benchPlacements(char* buf, size_t len, int runs)
+    {
+        InferenceLock lock;
+        runs = std::max(runs, 1);
+        size_t used = snprintf(buf, len, "placement, arena bytes, invoke us avg / min / max\n");
+        uint8_t* output = nullptr;
+        auto blankInput = [](uint8_t* dst)
+        {
+            memset(dst, 0, inputSize);
+            return true;
+        };
+
+        for (int p = 0; p <= ModelUtil::PLACEMENT_COUNT; p++)
+        {
+            ModelUtil::unloadModel();
+#ifdef ESP_PLATFORM
+            ModelStore::close();
+#endif
+            ModelUtil::placement = p < ModelUtil::PLACEMENT_COUNT ? (ModelUtil::Placement) p : ModelUtil::defaultPlacement;
+            int res = loadModel();
+            if (p == ModelUtil::PLACEMENT_COUNT || used >= len)
+            {
+                continue;
+            }
+
+            if (res != ModelUtil::OK)
+            {
+                used += snprintf(buf + used, len - used, "%s, load failed: %d\n", ModelUtil::placementName(ModelUtil::placement), res);
+                continue;
+            }
+
+            // The first invoke is left out, it pays for cold caches
+            res = ModelUtil::runInference(&output, blankInput);
+            unsigned long total = 0;
+            unsigned long fastest = 0;
+            unsigned long slowest = 0;
+            for (int i = 0; i < runs && res == ModelUtil::OK; i++)
+            {
+                unsigned long start = micros();
+                res = ModelUtil::runInference(&output, blankInput);
+                unsigned long elapsed = micros() - start;
+                total += elapsed;
+                fastest = i == 0 ? elapsed : std::min(fastest, elapsed);
+                slowest = std::max(slowest, elapsed);
+            }
+
+            if (res != ModelUtil::OK)
+            {
+                used += snprintf(buf + used, len - used, "%s, invoke failed: %d\n", ModelUtil::arenaPlacement, res);
+                continue;
+            }
+
+            used += snprintf(buf + used, len - used, "%s, %u, %lu / %lu / %lu\n",
+                             ModelUtil::arenaPlacement,
+                             (unsigned) ModelUtil::arenaUsedBytes,
+                             total / runs,
+                             fastest,
+                             slowest);
+        }
+
+        return std::min(used, len);
+    }
+
+    // Creates the inference lock and reserves every buffer used by runInferenceFromImage and the overlay encoding,
+    // call once at startup before anything takes an InferenceLock
+    inline bool setupBuffers()
+    {
+        if (inferenceMutex == nullptr)
+        {
+            inferenceMutex = xSemaphoreCreateMutex();
+            if (inferenceMutex == nullptr)
+            {
+                MLOGN("Could not create the inference mutex.");
+                return false;
+            }
+        }
+
+        return BufferPool::reserve(BufferPool::DECODE, decodeBufferSize) &&
+            BufferPool::reserve(BufferPool::OVERLAY, processedSize, INFERENCE_OVERLAY_BUFFERS) &&
+            BufferPool::reserve(BufferPool::ENCODE, processedSize, INFERENCE_OVERLAY_BUFFERS);
+    }
+
+    /*
+     * Decodes, crops and resizes the image into the model input layout, RGB888 or luma for grayscale models.
+     * overlay, when given, also receives the resized image as BGR888 for drawMarkers and the JPEG encoder.
+     * For a folded model the input quantization is applied to every row as it is resized.
+     */
+    inline IMAGE_UTIL::Status decodeToInput(
+        uint8_t* image,
+        size_t imageLen,
+        uint8_t* dst,
+        uint8_t* rowCache,
+        size_t rowCacheLen,
+        esp_jpeg_image_scale_t scale,
+        const IMAGE_UTIL::CropRect* crop = nullptr,
+        uint8_t* overlay = nullptr)
+    {
+        const uint8_t* valueMap = inputMapped ? inputValueMap : nullptr;
+#ifdef MODEL_IS_GRAYSCALE
+        return JPEG_DEC_UTIL::jpegToResizedLuma(
+            image, imageLen, dst, MODEL_DATA_INPUT_WIDTH, MODEL_DATA_INPUT_HEIGHT, rowCache, rowCacheLen, scale, crop, overlay, valueMap);
+#else
+        return JPEG_DEC_UTIL::jpegToResizedRgb888(
+            image, imageLen, dst, MODEL_DATA_INPUT_WIDTH, MODEL_DATA_INPUT_HEIGHT, rowCache, rowCacheLen, scale, crop, inputOrder, overlay, overlayOrder, valueMap);
+#endif
+    }
+
+    /*
+     * Runs the model over a JPEG image.
+     * If outProcessed is given it receives the resized BGR888 image borrowed from BufferPool::OVERLAY,
+     * which should be returned with BufferPool::giveBack.
+     * If roi is given the model runs on its crop and the tracker is updated with the result.
+     */
     inline void runInferenceFromImage(
         InferenceOutput& output,
         uint8_t* image,
         size_t imageLen,
         uint8_t** outProcessed = nullptr,
         size_t* outSize = nullptr,
-        esp_jpeg_image_scale_t jpegScale = JPEG_IMAGE_SCALE_0)
+        esp_jpeg_image_scale_t jpegScale = autoDecodeScale,
+        RoiTracker* roi = nullptr)
     {
+        InferenceLock lock;
         initOutputStr();
+        unsigned long pipelineStart = micros();
 
         INFERENCE_LOG_FN("Converting picture");
         IMAGE_UTIL::ImageDimensions dimensions;
         bool imageDimensionsResult = IMAGE_UTIL::jpegGetSize(image, imageLen, dimensions);
         if (!imageDimensionsResult)
         {
-            INFERENCE_ERROR_FN("Error opening image", -imageDimensionsResult, output);
+            INFERENCE_ERROR_FN("Error opening image", -IMAGE_UTIL::OPEN_JPEG_ERROR, output);
             return;
         }
 
         INFERENCE_LOG_FN("Extracted input dimensions are (w/h): %d / %d", true, dimensions.width, dimensions.height);
+        output.frameWidth = dimensions.width;
+        output.frameHeight = dimensions.height;
+        IMAGE_UTIL::CropRect frameCrop = roi != nullptr ? roi->crop(dimensions) : IMAGE_UTIL::centerSquareCrop(dimensions);
+        if (jpegScale == autoDecodeScale)
+        {
+            jpegScale = IMAGE_UTIL::selectDecodeScale({frameCrop.size, frameCrop.size}, MODEL_DATA_INPUT_WIDTH, MODEL_DATA_INPUT_HEIGHT);
+        }
+
         IMAGE_UTIL::adjustDimensionsScale(dimensions, jpegScale);
-        INFERENCE_LOG_FN("Adjusted dims are (w/h): %d / %d", true, dimensions.width, dimensions.height);
+        IMAGE_UTIL::CropRect crop = IMAGE_UTIL::scaleCrop(frameCrop, jpegScale);
+        int scaleDiv = IMAGE_UTIL::scaleDivisor(jpegScale);
+        INFERENCE_LOG_FN("Adjusted dims for scale %d are (w/h): %d / %d, crop x/y/size: %d / %d / %d",
+            true, jpegScale, dimensions.width, dimensions.height, crop.x, crop.y, crop.size);
 
-        size_t decodeBufferSize = dimensions.width * dimensions.height * 3;
-        if (decodeBufferSize > MAX_INFERENCE_DECODE_LENGTH)
+        if ((size_t) dimensions.width * dimensions.height * 3 > MAX_INFERENCE_DECODE_LENGTH)
         {
             INFERENCE_ERROR_FN("Image too large.", -66, output);
             return;
         }
+        LatencyStats::record(LatencyStats::HEADER, micros() - pipelineStart);
 
-        auto decodeBuffer = (uint8_t*) ps_malloc(decodeBufferSize);
+        uint8_t* decodeBuffer = BufferPool::borrow(BufferPool::DECODE, JPEG_DEC_UTIL::rowCacheSize(crop.size, MODEL_INPUT_CHANNELS));
         if (decodeBuffer == nullptr)
         {
-            INFERENCE_ERROR_FN("Failed to allocate decode buffer.", -55, output);
+            INFERENCE_ERROR_FN("No decode buffer available.", -55, output);
             return;
         }
 
-        memset(decodeBuffer, 0, decodeBufferSize);
-        bool decodeResult = JPEG_UTIL::jpg2rgb888(image, imageLen, decodeBuffer, jpegScale);
-        if (!decodeResult)
+        uint8_t* processed = nullptr;
+        if (outProcessed != nullptr && outSize != nullptr)
         {
-            INFERENCE_ERROR_FN("Error decoding image", -1, output);
+            processed = BufferPool::borrow(BufferPool::OVERLAY, processedSize);
+            if (processed == nullptr)
+            {
+                BufferPool::giveBack(decodeBuffer);
+                INFERENCE_ERROR_FN("No processed image buffer available.", -55, output);
+                return;
+            }
+        }
+
+        // Decode, crop and resize straight into the input tensor
+        unsigned long inferenceTimer = 0;
+        int resultStatus = runClassifierAndExtractInfo([&](uint8_t* dst)
+        {
+            unsigned long decodeStart = micros();
+            // The arena may reuse the input tensor after Invoke, the decoder fills the caller's overlay copy as it goes
+            IMAGE_UTIL::Status decodeStatus = decodeToInput(image, imageLen, dst, decodeBuffer, decodeBufferSize, jpegScale, &crop, processed);
+
+            if (decodeStatus != IMAGE_UTIL::OK)
+            {
+                INFERENCE_ERROR_FN("Error decoding image", -decodeStatus, output);
+                return false;
+            }
+
+            LatencyStats::record(LatencyStats::DECODE_RESIZE, micros() - decodeStart);
+            inferenceTimer = millis();
+            return true;
+        }, output);
+
+        BufferPool::giveBack(decodeBuffer);
+        if (resultStatus != ModelUtil::OK)
+        {
+            BufferPool::giveBack(processed);
             return;
         }
 
-        if (dimensions.width > MODEL_DATA_INPUT_WIDTH || dimensions.height > MODEL_DATA_INPUT_HEIGHT)
+        // Map detections back to the full resolution frame
+        for (size_t i = 0; i < output.count; i++)
         {
-            IMAGE_UTIL::cropResizeInPlace(
-                decodeBuffer,
-                dimensions.width,
-                dimensions.height,
-                MODEL_DATA_INPUT_WIDTH,
-                MODEL_DATA_INPUT_HEIGHT);
+            InferenceValues& values = output.foundValues[i];
+            values.frameX = (crop.x + values.x * crop.size / MODEL_DATA_INPUT_WIDTH) * scaleDiv;
+            values.frameY = (crop.y + values.y * crop.size / MODEL_DATA_INPUT_HEIGHT) * scaleDiv;
         }
 
-        unsigned long inferenceTimer = millis();
-        runClassifierAndExtractInfo(decodeBuffer, output);
+        if (roi != nullptr)
+        {
+            roi->update(output);
+        }
 
+        LatencyStats::record(LatencyStats::TOTAL, micros() - pipelineStart);
         output.inferenceLatency = millis() - inferenceTimer;
         output.totalLatency = millis() - currentStartTimer;
         INFERENCE_LOG_FN("Total time taken: %lu", true, output.totalLatency);
         INFERENCE_LOG_FN("Inference time taken: %lu", true, output.inferenceLatency);
 
-        if (outProcessed != nullptr && outSize != nullptr)
+        if (processed != nullptr)
         {
-            *outProcessed = decodeBuffer;
-            *outSize = decodeBufferSize;
+            *outProcessed = processed;
+            *outSize = processedSize;
         }
-        else
+    }
+
+    struct CascadePolicy
+    {
+        float gateThreshold = 0.3f; // presence probability needed to run the detector
+        uint32_t auditInterval = 50; // every Nth rejected frame still runs the detector to count gate misses, 0 never
+    };
+
+    struct CascadeStats
+    {
+        uint32_t frames = 0;
+        uint32_t gateRuns = 0;
+        uint32_t gatePassed = 0;
+        uint32_t gateRejected = 0;
+        uint32_t gateErrors = 0;
+        uint32_t bypassed = 0; // detector ran without asking the gate
+        uint32_t detectorRuns = 0;
+        uint32_t audits = 0;
+        uint32_t auditMisses = 0; // audited rejections where the detector found something
+        uint64_t gateUs = 0;
+        uint64_t detectorUs = 0;
+        float lastPresence = -1;
+    };
+
+    inline CascadeStats cascadeStats{};
+
+#ifdef MODEL_ENABLE_GATE
+    // Probability of the last output value, a single sigmoid or the "present" side of a two class softmax
+    inline float gatePresence(const uint8_t* output)
+    {
+        const TfLiteTensor* tensor = ModelUtil::gateOutputTensor;
+        uint8_t raw = output[tensor->bytes - 1];
+        int value = tensor->type == kTfLiteInt8 ? (int8_t) raw : raw;
+        return tensor->params.scale * (value - tensor->params.zero_point);
+    }
+
+    // Decodes the center crop at the smallest scale that still covers the gate input and runs the classifier
+    inline int runGateFromImage(uint8_t* image, size_t imageLen, float* presence)
+    {
+        InferenceLock lock;
+        LatencyStats::ScopedTimer timer(LatencyStats::GATE);
+
+        IMAGE_UTIL::ImageDimensions dimensions;
+        if (!IMAGE_UTIL::jpegGetSize(image, imageLen, dimensions))
+        {
+            return -IMAGE_UTIL::OPEN_JPEG_ERROR;
+        }
+
+        IMAGE_UTIL::CropRect frameCrop = IMAGE_UTIL::centerSquareCrop(dimensions);
+        esp_jpeg_image_scale_t scale = IMAGE_UTIL::selectDecodeScale(
+            {frameCrop.size, frameCrop.size}, GATE_MODEL_DATA_INPUT_WIDTH, GATE_MODEL_DATA_INPUT_HEIGHT);
+        IMAGE_UTIL::CropRect crop = IMAGE_UTIL::scaleCrop(frameCrop, scale);
+
+        size_t rowCacheLen = JPEG_DEC_UTIL::rowCacheSize(crop.size, GATE_MODEL_DATA_INPUT_CHANNELS);
+        uint8_t* rowCache = BufferPool::borrow(BufferPool::DECODE, rowCacheLen);
+        if (rowCache == nullptr)
+        {
+            return -55;
+        }
+
+        uint8_t* output = nullptr;
+        IMAGE_UTIL::Status decodeStatus = IMAGE_UTIL::OK;
+        int res = ModelUtil::runGate(&output, [&](uint8_t* dst)
+        {
+#if GATE_MODEL_DATA_INPUT_CHANNELS == 1
+            decodeStatus = JPEG_DEC_UTIL::jpegToResizedLuma(
+                image, imageLen, dst, GATE_MODEL_DATA_INPUT_WIDTH, GATE_MODEL_DATA_INPUT_HEIGHT, rowCache, rowCacheLen, scale, &crop);
+#else
+            decodeStatus = JPEG_DEC_UTIL::jpegToResizedRgb888(
+                image, imageLen, dst, GATE_MODEL_DATA_INPUT_WIDTH, GATE_MODEL_DATA_INPUT_HEIGHT, rowCache, rowCacheLen, scale, &crop, inputOrder);
+#endif
+            return decodeStatus == IMAGE_UTIL::OK;
+        });
+        BufferPool::giveBack(rowCache);
+
+        if (res != ModelUtil::OK)
         {
-            free(decodeBuffer);
+            return decodeStatus != IMAGE_UTIL::OK ? -decodeStatus : res;
         }
+
+        *presence = gatePresence(output);
+        return ModelUtil::OK;
+    }
+#endif
+
+    /*
+     * Live inference entry point: runs the presence gate first and the detector only when it fires. A gated frame
+     * comes back OK with no detections and gated set. The gate is skipped, and the detector always runs, when
+     * bypassGate is set, while the ROI tracker follows a cat, or when MODEL_ENABLE_GATE is off or the gate didn't
+     * load. Every policy.auditInterval-th rejection runs the detector anyway so gate misses can be counted.
+     */
+    inline void runCascadeFromImage(
+        InferenceOutput& output,
+        uint8_t* image,
+        size_t imageLen,
+        const CascadePolicy& policy,
+        bool bypassGate,
+        RoiTracker* roi = nullptr)
+    {
+        cascadeStats.frames++;
+        bool audit = false;
+
+#ifdef MODEL_ENABLE_GATE
+        bypassGate |= !gateReady || (roi != nullptr && roi->active);
+        if (!bypassGate)
+        {
+            unsigned long start = micros();
+            float presence = 0;
+            int res = runGateFromImage(image, imageLen, &presence);
+            cascadeStats.gateRuns++;
+            cascadeStats.gateUs += micros() - start;
+
+            if (res != ModelUtil::OK)
+            {
+                // Better to pay for the detector than to miss a cat
+                cascadeStats.gateErrors++;
+            }
+            else if (presence >= policy.gateThreshold)
+            {
+                cascadeStats.lastPresence = presence;
+                cascadeStats.gatePassed++;
+            }
+            else
+            {
+                cascadeStats.lastPresence = presence;
+                cascadeStats.gateRejected++;
+                audit = policy.auditInterval > 0 && cascadeStats.gateRejected % policy.auditInterval == 0;
+                if (!audit)
+                {
+                    output.status = ModelUtil::OK;
+                    output.gated = true;
+                    return;
+                }
+                cascadeStats.audits++;
+            }
+        }
+#endif
+
+        if (bypassGate)
+        {
+            cascadeStats.bypassed++;
+        }
+
+        unsigned long detectorStart = micros();
+        runInferenceFromImage(output, image, imageLen, nullptr, nullptr, autoDecodeScale, roi);
+        cascadeStats.detectorRuns++;
+        cascadeStats.detectorUs += micros() - detectorStart;
+
+        if (audit && output.status == ModelUtil::OK && output.count > 0)
+        {
+            cascadeStats.auditMisses++;
+        }
+    }
+
+    inline size_t cascadeToJson(char* buf, size_t len)
+    {
+        const CascadeStats& s = cascadeStats;
+        uint32_t frameUs = s.frames > 0 ? (s.gateUs + s.detectorUs) / s.frames : 0;
+        uint32_t detectorUs = s.detectorRuns > 0 ? s.detectorUs / s.detectorRuns : 0;
+#ifdef MODEL_ENABLE_GATE
+        bool enabled = gateReady;
+        size_t gateArenaUsed = ModelUtil::gateArenaUsedBytes;
+        const char* gatePlacement = ModelUtil::gateArenaPlacement;
+#else
+        bool enabled = false;
+        size_t gateArenaUsed = 0;
+        const char* gatePlacement = "none";
+#endif
+
+        return snprintf(buf, len,
+                        "{\"gate\":%s,\"gateArena\":\"%s\",\"gateArenaUsed\":%u,\"frames\":%lu,\"gateRuns\":%lu,"
+                        "\"gatePassed\":%lu,\"gateRejected\":%lu,\"gateErrors\":%lu,\"bypassed\":%lu,\"detectorRuns\":%lu,"
+                        "\"audits\":%lu,\"auditMisses\":%lu,\"lastPresence\":%.3f,\"gateMeanUs\":%lu,"
+                        "\"detectorMeanUs\":%lu,\"frameMeanUs\":%lu,\"speedup\":%.2f}",
+                        enabled ? "true" : "false",
+                        gatePlacement,
+                        (unsigned) gateArenaUsed,
+                        (unsigned long) s.frames,
+                        (unsigned long) s.gateRuns,
+                        (unsigned long) s.gatePassed,
+                        (unsigned long) s.gateRejected,
+                        (unsigned long) s.gateErrors,
+                        (unsigned long) s.bypassed,
+                        (unsigned long) s.detectorRuns,
+                        (unsigned long) s.audits,
+                        (unsigned long) s.auditMisses,
+                        s.lastPresence,
+                        (unsigned long) (s.gateRuns > 0 ? s.gateUs / s.gateRuns : 0),
+                        (unsigned long) detectorUs,
+                        (unsigned long) frameUs,
+                        frameUs > 0 ? (float) detectorUs / frameUs : 0.0f);
     }
 
     inline float triggerCertainty(const InferenceOutput& output)
@@ -393,6 +1034,153 @@ namespace InferenceUtil
         return maxCatConfidence * (1.0f - maxHumanConfidence); // [0.0, 1.0]
     }
 
+    /*
+     * Associates detections across consecutive inferences so triggering doesn't depend on repeating them.
+     *
+     * Detections are matched greedily, strongest first, to the nearest track of the same class within
+     * TRACKER_MATCH_DISTANCE in full resolution frame coordinates, which stay put when the ROI crop moves. Each
+     * track keeps an exponentially smoothed confidence that decays on frames it isn't seen, and is dropped after
+     * TRACKER_MAX_MISSES of them. Only tracks seen TRACKER_CONFIRM_HITS times can trigger, so a single spurious
+     * detection never does, while humans weigh in as soon as they are seen.
+     */
+    struct DetectionTracker
+    {
+        struct Track
+        {
+            int classId = -1;
+            float frameX = 0;
+            float frameY = 0;
+            float confidence = 0;
+            uint32_t age = 0; // inferences since the track was created
+            uint32_t hits = 0;
+            uint32_t misses = 0;
+
+            bool confirmed() const
+            {
+                return hits >= TRACKER_CONFIRM_HITS;
+            }
+        };
+
+        Track tracks[TRACKER_MAX_TRACKS]{};
+        size_t count = 0;
+        int64_t lastFrameId = -1;
+
+        void reset()
+        {
+            count = 0;
+            lastFrameId = -1;
+        }
+
+        bool isLastFrame(int64_t frameId) const
+        {
+            return frameId == lastFrameId;
+        }
+
+        // Returns false if the frame was already used, so the same framebuffer never counts twice
+        bool update(const InferenceOutput& output, int64_t frameId)
+        {
+            if (isLastFrame(frameId))
+            {
+                return false;
+            }
+            lastFrameId = frameId;
+
+            float maxDistance = TRACKER_MATCH_DISTANCE * std::min(output.frameWidth, output.frameHeight);
+            bool matched[TRACKER_MAX_TRACKS]{};
+            bool used[MAX_BOXES]{};
+
+            for (size_t n = 0; n < output.count; n++)
+            {
+                // Strongest detection not placed yet
+                int best = -1;
+                for (size_t i = 0; i < output.count; i++)
+                {
+                    if (!used[i] && (best < 0 || output.foundValues[i].value > output.foundValues[best].value))
+                    {
+                        best = i;
+                    }
+                }
+                used[best] = true;
+                const InferenceValues& values = output.foundValues[best];
+
+                int nearest = -1;
+                float nearestDistance = maxDistance;
+                for (size_t t = 0; t < count; t++)
+                {
+                    float distance = hypotf(tracks[t].frameX - values.frameX, tracks[t].frameY - values.frameY);
+                    if (!matched[t] && tracks[t].classId == values.classId && distance <= nearestDistance)
+                    {
+                        nearest = t;
+                        nearestDistance = distance;
+                    }
+                }
+
+                if (nearest < 0)
+                {
+                    if (count == TRACKER_MAX_TRACKS)
+                    {
+                        continue;
+                    }
+
+                    nearest = count++;
+                    tracks[nearest] = Track{values.classId, values.frameX, values.frameY, values.value};
+                }
+                else
+                {
+                    Track& track = tracks[nearest];
+                    track.confidence += TRACKER_SMOOTHING * (values.value - track.confidence);
+                    track.frameX = values.frameX;
+                    track.frameY = values.frameY;
+                }
+
+                tracks[nearest].hits++;
+                tracks[nearest].misses = 0;
+                matched[nearest] = true;
+            }
+
+            // Tracks not seen this time decay, then drop out keeping the array packed
+            size_t kept = 0;
+            for (size_t t = 0; t < count; t++)
+            {
+                Track track = tracks[t];
+                track.age++;
+                if (!matched[t])
+                {
+                    track.confidence *= 1.0f - TRACKER_SMOOTHING;
+                    if (++track.misses > TRACKER_MAX_MISSES)
+                    {
+                        continue;
+                    }
+                }
+                tracks[kept++] = track;
+            }
+            count = kept;
+            return true;
+        }
+
+        // Same rule as triggerCertainty over the smoothed confidences, cats only count once confirmed
+        float triggerCertainty() const
+        {
+            float maxCatConfidence = 0.0f;
+            float maxHumanConfidence = 0.0f;
+
+            for (size_t t = 0; t < count; t++)
+            {
+                const Track& track = tracks[t];
+                if (track.classId == catIndex && track.confirmed())
+                {
+                    maxCatConfidence = std::max(maxCatConfidence, track.confidence);
+                }
+                else if (track.classId == humanIndex)
+                {
+                    maxHumanConfidence = std::max(maxHumanConfidence, track.confidence);
+                }
+            }
+
+            return maxCatConfidence * (1.0f - maxHumanConfidence);
+        }
+    };
+
     inline void drawMarkers(const InferenceOutput &output, uint8_t *img)
     {
         for (size_t i = 0; i < output.count; i++)
@@ -401,8 +1189,8 @@ namespace InferenceUtil
             if (values.classId > 0 && values.value >= thresholds[values.classId])
             {
                 IMAGE_UTIL::BGR c = classColors[values.classId];
-                IMAGE_UTIL::drawCross(img, MODEL_INPUT_WIDTH, MODEL_INPUT_HEIGHT, values.x, values.y, c, 6);
-                IMAGE_UTIL::drawCircle(img, MODEL_INPUT_WIDTH, MODEL_INPUT_HEIGHT, values.x, values.y, c, 3);
+                IMAGE_UTIL::drawCross(img, MODEL_INPUT_WIDTH, MODEL_INPUT_HEIGHT, values.x, values.y, c, 6, 1, overlayOrder);
+                IMAGE_UTIL::drawCircle(img, MODEL_INPUT_WIDTH, MODEL_INPUT_HEIGHT, values.x, values.y, c, 3, 1, overlayOrder);
             }
         }
     }
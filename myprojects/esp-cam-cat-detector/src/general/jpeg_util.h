@@ -5,6 +5,8 @@
 #ifndef JPEG_UTIL_H
 #define JPEG_UTIL_H
 
+#include <general/image_util.h>
+
 /*
 * This code is derived from esp32-camera
 * https://github.com/espressif/esp32-camera
@@ -20,15 +22,16 @@
 *
 * Modifications:
 *   - Copied into this project
-*   - Changed swap color bytes order
+*   - Changed swap color bytes order, selectable per call
 *   - Added into namespace JPEG_UTIL
 */
 namespace JPEG_UTIL
 {
      static uint8_t work[3100];
 
-     // OUTPUTS BGR
-     inline bool jpg2rgb888(const uint8_t *src, size_t src_len, uint8_t *out, esp_jpeg_image_scale_t scale)
+     // BGR by default, the order fmt2jpg and the esp32-camera converters use
+     inline bool jpg2rgb888(const uint8_t *src, size_t src_len, uint8_t *out, esp_jpeg_image_scale_t scale,
+                            IMAGE_UTIL::ChannelOrder order = IMAGE_UTIL::ChannelOrder::BGR)
      {
           esp_jpeg_image_cfg_t jpeg_cfg = {
                .indata = (uint8_t*) src,
@@ -37,7 +40,7 @@ namespace JPEG_UTIL
                .outbuf_size = UINT32_MAX,
                .out_format = JPEG_IMAGE_FORMAT_RGB888,
                .out_scale = scale,
-               .flags = { .swap_color_bytes = 1 },
+               .flags = { .swap_color_bytes = order == IMAGE_UTIL::ChannelOrder::BGR },
                .advanced = {
                     .working_buffer = work,
                     .working_buffer_size = sizeof(work)
@@ -52,6 +55,39 @@ namespace JPEG_UTIL
 
           return true;
      }
+
+     struct JpegOutput
+     {
+          uint8_t *buf;
+          size_t capacity;
+          size_t len;
+     };
+
+     inline size_t jpegOutputFn(void *arg, size_t index, const void *data, size_t len)
+     {
+          auto *out = (JpegOutput*) arg;
+          if (index + len > out->capacity)
+          {
+               return 0;
+          }
+
+          memcpy(out->buf + index, data, len);
+          out->len = index + len;
+          return len;
+     }
+
+     // Encodes a BGR888 image into a caller provided buffer instead of letting fmt2jpg allocate one
+     inline bool rgb888ToJpeg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, uint8_t quality, uint8_t *out, size_t out_capacity, size_t *out_len)
+     {
+          JpegOutput output = {out, out_capacity, 0};
+          if (!fmt2jpg_cb(src, src_len, width, height, PIXFORMAT_RGB888, quality, jpegOutputFn, &output))
+          {
+               return false;
+          }
+
+          *out_len = output.len;
+          return true;
+     }
 }
 
 #endif //JPEG_UTIL_H
@@ -8,9 +8,11 @@
 #include <JPEGDEC.h>
 #include <general/image_util.h>
 
+#define STREAM_MAX_STRIP_ROWS 16
+
 namespace JPEG_DEC_UTIL
 {
-    JPEGDEC jpegdec;
+    inline JPEGDEC jpegdec;
 
     using namespace IMAGE_UTIL;
 
@@ -19,7 +21,7 @@ namespace JPEG_DEC_UTIL
         uint8_t* buf = nullptr;
         size_t bufLen = 0;
         size_t imageWidth = 0;
-        bool outputBGR = false;
+        ChannelOrder order = ChannelOrder::RGB;
     };
 
     inline int decodeFn(JPEGDRAW* pDraw)
@@ -56,26 +58,7 @@ namespace JPEG_DEC_UTIL
 
                 for (int col = 0; col < copyWidth; ++col)
                 {
-                    if (context->outputBGR)
-                    {
-                        uint8_t r = src[col * 4 + 0];
-                        uint8_t g = src[col * 4 + 1];
-                        uint8_t b = src[col * 4 + 2];
-
-                        dst[col * 3 + 0] = b;
-                        dst[col * 3 + 1] = g;
-                        dst[col * 3 + 2] = r;
-                    }
-                    else
-                    {
-                        uint8_t r = src[col * 4 + 0];
-                        uint8_t g = src[col * 4 + 1];
-                        uint8_t b = src[col * 4 + 2];
-
-                        dst[col * 3 + 0] = r;
-                        dst[col * 3 + 1] = g;
-                        dst[col * 3 + 2] = b;
-                    }
+                    storePixel(dst + col * 3, src[col * 4 + 0], src[col * 4 + 1], src[col * 4 + 2], context->order);
                 }
             }
             else
@@ -97,8 +80,18 @@ namespace JPEG_DEC_UTIL
         return 1;
     }
 
+    inline int toJpegdecScale(esp_jpeg_image_scale_t scale)
+    {
+        switch(scale) {
+            case JPEG_IMAGE_SCALE_1_2: return JPEG_SCALE_HALF;
+            case JPEG_IMAGE_SCALE_1_4: return JPEG_SCALE_QUARTER;
+            case JPEG_IMAGE_SCALE_1_8: return JPEG_SCALE_EIGHTH;
+            default: return 0;
+        }
+    }
+
     // out buffer should always be width * height * 3 of length
-    inline Status jpegToRgb888(uint8_t* image, size_t imageLen, uint8_t* out, bool outputBGR = false, esp_jpeg_image_scale_t scale = JPEG_IMAGE_SCALE_0)
+    inline Status jpegToRgb888(uint8_t* image, size_t imageLen, uint8_t* out, ChannelOrder order = ChannelOrder::RGB, esp_jpeg_image_scale_t scale = JPEG_IMAGE_SCALE_0)
     {
         ImageDimensions dimensions{};
         bool res = jpegGetSize(image, imageLen, dimensions);
@@ -112,7 +105,7 @@ namespace JPEG_DEC_UTIL
         context.buf = out;
         context.bufLen = bufSize;
         context.imageWidth = dimensions.width;
-        context.outputBGR = outputBGR;
+        context.order = order;
 
         if (!jpegdec.openRAM(image, imageLen, decodeFn))
         {
@@ -122,21 +115,314 @@ namespace JPEG_DEC_UTIL
         jpegdec.setUserPointer(&context);
         jpegdec.setPixelType(RGB8888);
 
-        int actualScale = 0;
-        switch(scale) {
-            case JPEG_IMAGE_SCALE_1_2: actualScale = JPEG_SCALE_HALF; break;
-            case JPEG_IMAGE_SCALE_1_4: actualScale = JPEG_SCALE_QUARTER; break;
-            case JPEG_IMAGE_SCALE_1_8: actualScale = JPEG_SCALE_EIGHTH; break;
-            default: actualScale = 0;
+        if (!jpegdec.decode(0, 0, toJpegdecScale(scale)))
+        {
+            return DECODE_ERROR;
         }
 
-        if (!jpegdec.decode(0, 0, actualScale))
+        return Status::OK;
+    }
+
+    // Decodes only the luma channel, out should hold at least width * height bytes of the scaled image
+    inline Status jpegToLuma(uint8_t* image, size_t imageLen, uint8_t* out, size_t outLen, ImageDimensions& dimensions, esp_jpeg_image_scale_t scale = JPEG_IMAGE_SCALE_0)
+    {
+        if (!jpegGetSize(image, imageLen, dimensions))
+        {
+            return OPEN_JPEG_ERROR;
+        }
+        adjustDimensionsScale(dimensions, scale);
+
+        if ((size_t)dimensions.width * dimensions.height > outLen)
+        {
+            return BUFFER_TOO_SMALL;
+        }
+
+        DecodeContext context{};
+        context.buf = out;
+        context.bufLen = outLen;
+        context.imageWidth = dimensions.width;
+
+        if (!jpegdec.openRAM(image, imageLen, decodeFn))
+        {
+            return OPEN_JPEG_ERROR;
+        }
+
+        jpegdec.setUserPointer(&context);
+        jpegdec.setPixelType(EIGHT_BIT_GRAYSCALE);
+
+        bool decoded = jpegdec.decode(0, 0, toJpegdecScale(scale));
+        jpegdec.close();
+
+        return decoded ? Status::OK : DECODE_ERROR;
+    }
+
+    /*
+     * Streaming decode -> center crop -> bilinear resize.
+     *
+     * Instead of decoding the whole frame into a buffer and resizing it afterwards, each strip of MCU rows
+     * given by the decoder is cropped into a small ring of source rows, and every output row whose two source
+     * rows are available is written to the destination right away. Only STREAM_MAX_STRIP_ROWS + 1 cropped rows
+     * are ever held in memory.
+     *
+     * With a single channel the decoder only outputs luma, which skips its color conversion, and the row cache,
+     * resize and destination are a third of the RGB size.
+     *
+     * Pixels are stored in the order dst needs while they are copied out of the decoder. When an overlay buffer
+     * is given, every finished output row is also copied into it in its own order, which saves a pass over the
+     * whole image afterwards. A value map, e.g. the input quantization of the model, is applied to each row while
+     * it is still in cache.
+     */
+    struct StreamResizeContext
+    {
+        uint8_t* dst = nullptr; // dstWidth * dstHeight * channels
+        int dstWidth = 0;
+        int dstHeight = 0;
+        int channels = 3; // 3 for RGB888, 1 for luma
+        ChannelOrder order = ChannelOrder::RGB;
+
+        uint8_t* overlay = nullptr; // optional dstWidth * dstHeight * 3 copy
+        ChannelOrder overlayOrder = ChannelOrder::BGR;
+        const uint8_t* valueMap = nullptr; // optional 256 entry table applied to dst after the overlay copy
+
+        int cropX = 0;
+        int cropY = 0;
+        int cropSize = 0;
+
+        ResizeTap xTaps[RESIZE_MAX_DST_SIZE]{};
+        ResizeTap yTaps[RESIZE_MAX_DST_SIZE]{};
+        ResizeRowCache horizontalRows;
+
+        uint8_t* rows = nullptr;
+        int lastCompleteRow = -1;
+        int nextDstRow = 0;
+        bool error = false;
+    };
+
+    inline StreamResizeContext resizeContext;
+
+    inline uint8_t* cachedRow(StreamResizeContext& context, int srcRow)
+    {
+        return context.rows + (size_t)(srcRow % (STREAM_MAX_STRIP_ROWS + 1)) * context.cropSize * context.channels;
+    }
+
+    inline void emitResizedRows(StreamResizeContext& context)
+    {
+        while (context.nextDstRow < context.dstHeight && context.yTaps[context.nextDstRow].i1 <= context.lastCompleteRow)
+        {
+            const ResizeTap& tap = context.yTaps[context.nextDstRow];
+            const uint8_t* top = context.horizontalRows.get(tap.i0, tap.i1, cachedRow(context, tap.i0), context.xTaps, context.dstWidth, context.channels);
+            const uint8_t* bottom = context.horizontalRows.get(tap.i1, tap.i0, cachedRow(context, tap.i1), context.xTaps, context.dstWidth, context.channels);
+
+            size_t rowLen = (size_t)context.dstWidth * context.channels;
+            uint8_t* row = context.dst + context.nextDstRow * rowLen;
+            blendRows(top, bottom, tap.weight, rowLen, row);
+
+            if (context.overlay != nullptr)
+            {
+                uint8_t* overlayRow = context.overlay + (size_t)context.nextDstRow * context.dstWidth * 3;
+                if (context.channels == 1)
+                {
+                    grayToBgr(row, context.dstWidth, overlayRow);
+                }
+                else
+                {
+                    copyPixels(row, context.order, overlayRow, context.overlayOrder, context.dstWidth);
+                }
+            }
+
+            if (context.valueMap != nullptr)
+            {
+                for (size_t i = 0; i < rowLen; i++)
+                {
+                    row[i] = context.valueMap[row[i]];
+                }
+            }
+
+            context.nextDstRow++;
+        }
+    }
+
+    inline int streamResizeFn(JPEGDRAW* pDraw)
+    {
+        auto& context = *(StreamResizeContext*)pDraw->pUser;
+
+        if (pDraw->iHeight > STREAM_MAX_STRIP_ROWS)
+        {
+            context.error = true;
+            return 0;
+        }
+
+        int copyWidth = (pDraw->iWidthUsed > 0) ? pDraw->iWidthUsed : pDraw->iWidth;
+        int startX = std::max(pDraw->x, context.cropX);
+        int endX = std::min(pDraw->x + copyWidth, context.cropX + context.cropSize);
+
+        int lastRowInStrip = -1;
+        for (int row = 0; row < pDraw->iHeight; row++)
+        {
+            int srcRow = pDraw->y + row - context.cropY;
+            if (srcRow < 0 || srcRow >= context.cropSize)
+            {
+                continue;
+            }
+
+            lastRowInStrip = srcRow;
+            if (startX >= endX)
+            {
+                continue;
+            }
+
+            if (context.channels == 1)
+            {
+                const uint8_t* src = (const uint8_t*)pDraw->pPixels + (size_t)row * pDraw->iWidth + (startX - pDraw->x);
+                memcpy(cachedRow(context, srcRow) + (startX - context.cropX), src, endX - startX);
+                continue;
+            }
+
+            const uint8_t* src = (const uint8_t*)pDraw->pPixels + ((size_t)row * pDraw->iWidth + (startX - pDraw->x)) * 4;
+            uint8_t* dst = cachedRow(context, srcRow) + (size_t)(startX - context.cropX) * 3;
+            for (int col = 0; col < endX - startX; col++)
+            {
+                storePixel(dst + col * 3, src[col * 4 + 0], src[col * 4 + 1], src[col * 4 + 2], context.order);
+            }
+        }
+
+        // Strips arrive left to right, the strip is complete once the right edge of the crop was drawn
+        if (lastRowInStrip >= 0 && pDraw->x + copyWidth >= context.cropX + context.cropSize)
+        {
+            context.lastCompleteRow = lastRowInStrip;
+            emitResizedRows(context);
+        }
+
+        // Every output row was written, no need to decode the rest of the image
+        return context.nextDstRow < context.dstHeight;
+    }
+
+    inline size_t rowCacheSize(int cropSize, int channels = 3)
+    {
+        return (size_t)(STREAM_MAX_STRIP_ROWS + 1) * cropSize * channels;
+    }
+
+    inline Status jpegToResized(
+        uint8_t* image,
+        size_t imageLen,
+        uint8_t* dst,
+        int dstWidth,
+        int dstHeight,
+        int channels,
+        ChannelOrder order,
+        uint8_t* overlay,
+        ChannelOrder overlayOrder,
+        const uint8_t* valueMap,
+        uint8_t* rowCache,
+        size_t rowCacheLen,
+        esp_jpeg_image_scale_t scale,
+        const CropRect* crop)
+    {
+        if (dstWidth > RESIZE_MAX_DST_SIZE || dstHeight > RESIZE_MAX_DST_SIZE)
+        {
+            return BUFFER_TOO_SMALL;
+        }
+
+        ImageDimensions dimensions{};
+        if (!jpegGetSize(image, imageLen, dimensions))
+        {
+            return OPEN_JPEG_ERROR;
+        }
+        adjustDimensionsScale(dimensions, scale);
+
+        StreamResizeContext& context = resizeContext;
+        context.dst = dst;
+        context.dstWidth = dstWidth;
+        context.dstHeight = dstHeight;
+        context.channels = channels;
+        context.order = order;
+        context.overlay = overlay;
+        context.overlayOrder = overlayOrder;
+        context.valueMap = valueMap;
+        CropRect rect = crop != nullptr ? *crop : centerSquareCrop(dimensions);
+        if (rect.size <= 0 || rect.x < 0 || rect.y < 0 ||
+            rect.x + rect.size > dimensions.width || rect.y + rect.size > dimensions.height)
+        {
+            return COORDINATES_OUT_OF_BOUND;
+        }
+
+        context.cropSize = rect.size;
+        context.cropX = rect.x;
+        context.cropY = rect.y;
+        context.lastCompleteRow = -1;
+        context.nextDstRow = 0;
+        context.horizontalRows.clear();
+        context.error = false;
+
+        if (rowCache == nullptr || rowCacheSize(context.cropSize, channels) > rowCacheLen)
+        {
+            return BUFFER_TOO_SMALL;
+        }
+        context.rows = rowCache;
+
+        computeResizeTaps(context.cropSize, dstWidth, context.xTaps);
+        computeResizeTaps(context.cropSize, dstHeight, context.yTaps);
+
+        if (!jpegdec.openRAM(image, imageLen, streamResizeFn))
+        {
+            return OPEN_JPEG_ERROR;
+        }
+
+        jpegdec.setUserPointer(&context);
+        jpegdec.setPixelType(channels == 1 ? EIGHT_BIT_GRAYSCALE : RGB8888);
+
+        // decode() also returns 0 when the draw callback stops it early after the last output row
+        jpegdec.decode(0, 0, toJpegdecScale(scale));
+        jpegdec.close();
+
+        if (context.error || context.nextDstRow < context.dstHeight)
         {
             return DECODE_ERROR;
         }
 
         return Status::OK;
     }
+
+    /*
+     * Decodes the image, crops it to a square and resizes it to dstWidth x dstHeight RGB888 directly into dst, in
+     * the given channel order. crop is in pixels of the scaled image, the largest centered square is used when it
+     * is null. rowCache must hold at least rowCacheSize(crop size) bytes.
+     * overlay, when given, receives a copy of the result in overlayOrder, valueMap then remaps every byte of dst.
+     */
+    inline Status jpegToResizedRgb888(
+        uint8_t* image,
+        size_t imageLen,
+        uint8_t* dst,
+        int dstWidth,
+        int dstHeight,
+        uint8_t* rowCache,
+        size_t rowCacheLen,
+        esp_jpeg_image_scale_t scale = JPEG_IMAGE_SCALE_0,
+        const CropRect* crop = nullptr,
+        ChannelOrder order = ChannelOrder::RGB,
+        uint8_t* overlay = nullptr,
+        ChannelOrder overlayOrder = ChannelOrder::BGR,
+        const uint8_t* valueMap = nullptr)
+    {
+        return jpegToResized(image, imageLen, dst, dstWidth, dstHeight, 3, order, overlay, overlayOrder, valueMap, rowCache, rowCacheLen, scale, crop);
+    }
+
+    // Same as jpegToResizedRgb888 with only the luma channel, rowCache must hold rowCacheSize(crop size, 1) bytes
+    inline Status jpegToResizedLuma(
+        uint8_t* image,
+        size_t imageLen,
+        uint8_t* dst,
+        int dstWidth,
+        int dstHeight,
+        uint8_t* rowCache,
+        size_t rowCacheLen,
+        esp_jpeg_image_scale_t scale = JPEG_IMAGE_SCALE_0,
+        const CropRect* crop = nullptr,
+        uint8_t* overlay = nullptr,
+        const uint8_t* valueMap = nullptr)
+    {
+        return jpegToResized(image, imageLen, dst, dstWidth, dstHeight, 1, ChannelOrder::RGB, overlay, ChannelOrder::BGR, valueMap, rowCache, rowCacheLen, scale, crop);
+    }
 }
 
 #endif //JPEGDEC_UTIL_H
@@ -0,0 +1,199 @@
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+#define LATENCY_STATS_BUCKETS 100 // up to 2^26 us, about 67 seconds
+
+/*
+ * Microsecond latency histograms for each stage of the inference pipeline.
+ *
+ * Buckets split every power of two in four, so any percentile is within 25% of the real value while the whole
+ * set stays a few KB of RAM and recording a sample is constant time.
+ */
+namespace LatencyStats
+{
+    enum Stage
+    {
+        HEADER,
+        DECODE_RESIZE, // decodes straight into the input tensor, so this includes the tensor fill
+        INVOKE,
+        POST_PROCESS,
+        GATE, // presence classifier decode and invoke, see InferenceUtil::runCascadeFromImage
+        TOTAL,
+        SD_SAVE,
+        ACTUATION,
+        STAGE_COUNT,
+    };
+
+    constexpr const char* stageNames[STAGE_COUNT] = {
+        "header",
+        "decodeResize",
+        "invoke",
+        "postProcess",
+        "gate",
+        "total",
+        "sdSave",
+        "actuation",
+    };
+
+    struct Histogram
+    {
+        uint32_t buckets[LATENCY_STATS_BUCKETS]{};
+        uint32_t count = 0;
+        uint64_t sum = 0;
+        uint32_t max = 0;
+    };
+
+    struct Summary
+    {
+        uint32_t count = 0;
+        uint32_t mean = 0;
+        uint32_t p50 = 0;
+        uint32_t p95 = 0;
+        uint32_t p99 = 0;
+        uint32_t max = 0;
+    };
+
+    inline Histogram histograms[STAGE_COUNT]{};
+    inline portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+    inline size_t bucketFor(uint32_t us)
+    {
+        if (us < 4)
+        {
+            return us;
+        }
+
+        int msb = 31 - __builtin_clz(us);
+        size_t bucket = (msb - 1) * 4 + ((us >> (msb - 2)) & 3);
+        return bucket < LATENCY_STATS_BUCKETS ? bucket : LATENCY_STATS_BUCKETS - 1;
+    }
+
+    // Largest value that falls into the bucket
+    inline uint32_t bucketUpperBound(size_t bucket)
+    {
+        if (bucket < 4)
+        {
+            return bucket;
+        }
+
+        int msb = bucket / 4 + 1;
+        uint32_t lower = (4 + bucket % 4) << (msb - 2);
+        return lower + (1u << (msb - 2)) - 1;
+    }
+
+    inline void add(Histogram& histogram, uint32_t us)
+    {
+        histogram.buckets[bucketFor(us)]++;
+        histogram.count++;
+        histogram.sum += us;
+        histogram.max = us > histogram.max ? us : histogram.max;
+    }
+
+    inline void record(Stage stage, uint32_t us)
+    {
+        portENTER_CRITICAL(&lock);
+        add(histograms[stage], us);
+        portEXIT_CRITICAL(&lock);
+    }
+
+    inline void reset()
+    {
+        portENTER_CRITICAL(&lock);
+        for (Histogram& histogram : histograms)
+        {
+            histogram = Histogram{};
+        }
+        portEXIT_CRITICAL(&lock);
+    }
+
+    inline uint32_t percentile(const Histogram& histogram, float p)
+    {
+        uint32_t target = histogram.count * p;
+        uint32_t seen = 0;
+        for (size_t i = 0; i < LATENCY_STATS_BUCKETS; i++)
+        {
+            seen += histogram.buckets[i];
+            if (seen > target)
+            {
+                uint32_t bound = bucketUpperBound(i);
+                return bound < histogram.max ? bound : histogram.max;
+            }
+        }
+
+        return histogram.max;
+    }
+
+    inline Summary summarize(const Histogram& histogram)
+    {
+        Summary summary{};
+        if (histogram.count == 0)
+        {
+            return summary;
+        }
+
+        summary.count = histogram.count;
+        summary.mean = histogram.sum / histogram.count;
+        summary.p50 = percentile(histogram, 0.5f);
+        summary.p95 = percentile(histogram, 0.95f);
+        summary.p99 = percentile(histogram, 0.99f);
+        summary.max = histogram.max;
+        return summary;
+    }
+
+    inline Summary summarize(Stage stage)
+    {
+        Histogram copy;
+
+        portENTER_CRITICAL(&lock);
+        copy = histograms[stage];
+        portEXIT_CRITICAL(&lock);
+
+        return summarize(copy);
+    }
+
+    // Writes {"stage":{"count":..,"mean":..,"p50":..,"p95":..,"p99":..,"max":..},...} with values in us
+    inline size_t toJson(char* buf, size_t len)
+    {
+        size_t offset = snprintf(buf, len, "{");
+        for (size_t i = 0; i < STAGE_COUNT && offset < len; i++)
+        {
+            Summary s = summarize((Stage) i);
+            offset += snprintf(buf + offset,
+                               len - offset,
+                               "%s\"%s\":{\"count\":%lu,\"mean\":%lu,\"p50\":%lu,\"p95\":%lu,\"p99\":%lu,\"max\":%lu}",
+                               i == 0 ? "" : ",",
+                               stageNames[i],
+                               (unsigned long) s.count,
+                               (unsigned long) s.mean,
+                               (unsigned long) s.p50,
+                               (unsigned long) s.p95,
+                               (unsigned long) s.p99,
+                               (unsigned long) s.max);
+        }
+
+        if (offset < len)
+        {
+            offset += snprintf(buf + offset, len - offset, "}");
+        }
+
+        return offset;
+    }
+
+    // Records the time between construction and destruction
+    struct ScopedTimer
+    {
+        Stage stage;
+        unsigned long start;
+
+        explicit ScopedTimer(Stage stage) : stage(stage), start(micros())
+        {
+        }
+
+        ~ScopedTimer()
+        {
+            record(stage, micros() - start);
+        }
+    };
+}
+
+#endif //LATENCY_STATS_H
@@ -0,0 +1,16 @@
+#ifndef LOG_H
+#define LOG_H
+
+#ifdef ENABLE_LOGGING
+#define MLOG(str) Serial.print(str)
+#define MLOGN(str) Serial.println(str)
+#define MLOGF(str, p...) Serial.printf(str, p)
+#define MVLOGF(str, p...) Serial.vprintf(str, p)
+#else
+#define MLOG(str)
+#define MLOGN(str)
+#define MLOGF(str, p...)
+#define MVLOGF(str, p...)
+#endif
+
+#endif //LOG_H
@@ -0,0 +1,158 @@
+#ifndef MODEL_FORMAT_H
+#define MODEL_FORMAT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "tensorflow/lite/schema/schema_generated.h"
+
+#define MODEL_FORMAT_MAGIC 0x4D544143 // "CATM"
+#define MODEL_FORMAT_VERSION 1
+#define MODEL_FORMAT_DATA_OFFSET 4096 // the header gets a flash sector of its own so it can be rewritten alone
+#define MODEL_FORMAT_MAX_CLASSES 8
+#define MODEL_FORMAT_LABEL_LENGTH 16
+
+/*
+ * File format of a model stored outside the firmware, on a model partition or on the SD card.
+ *
+ * A fixed header is followed, at MODEL_FORMAT_DATA_OFFSET, by the unmodified .tflite flatbuffer. The same bytes
+ * are used on the SD card and on the partitions, see src/native/model_pack.cpp for building them.
+ */
+namespace ModelFormat
+{
+    struct Header
+    {
+        uint32_t magic;
+        uint16_t formatVersion;
+        uint16_t headerSize;
+        uint32_t dataOffset;
+        uint32_t modelSize;
+        uint32_t modelCrc;
+        uint32_t modelVersion; // free form, shown on /model-info
+        uint32_t sequence; // the valid partition slot with the highest sequence is the active one
+        uint16_t inputWidth;
+        uint16_t inputHeight;
+        uint16_t inputChannels;
+        uint16_t classCount;
+        uint32_t arenaSize; // 0 for the device to guess it from the model size
+        uint32_t persistentArenaSize;
+        uint32_t nonPersistentArenaSize;
+        float thresholds[MODEL_FORMAT_MAX_CLASSES];
+        char classNames[MODEL_FORMAT_MAX_CLASSES][MODEL_FORMAT_LABEL_LENGTH];
+        float inputScale; // pixel quantization of a model whose input Quantize op was folded, 0 when it wasn't
+        int32_t inputZeroPoint;
+        uint8_t reserved[36];
+        uint32_t headerCrc; // crc32 of every field above
+    };
+
+    static_assert(sizeof(Header) == 256, "model header layout changed");
+
+    enum Status
+    {
+        OK,
+        BAD_MAGIC = -1,
+        BAD_VERSION = -2,
+        BAD_HEADER_CRC = -3,
+        BAD_SIZE = -4,
+        BAD_MODEL_CRC = -5,
+        BAD_SCHEMA = -6,
+        INPUT_MISMATCH = -7,
+        CLASS_MISMATCH = -8,
+    };
+
+    inline const char* statusName(Status status)
+    {
+        switch (status)
+        {
+            case OK: return "ok";
+            case BAD_MAGIC: return "bad magic";
+            case BAD_VERSION: return "unsupported format version";
+            case BAD_HEADER_CRC: return "bad header crc";
+            case BAD_SIZE: return "bad size";
+            case BAD_MODEL_CRC: return "bad model crc";
+            case BAD_SCHEMA: return "invalid flatbuffer";
+            case INPUT_MISMATCH: return "input dimensions differ from the firmware";
+            case CLASS_MISMATCH: return "class count differs from the firmware";
+        }
+        return "unknown";
+    }
+
+    // Standard crc32 (zlib), a nibble at a time to keep the table small
+    inline uint32_t crc32(const uint8_t* data, size_t len, uint32_t crc = 0)
+    {
+        static constexpr uint32_t table[16] = {
+            0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+            0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+        };
+
+        crc = ~crc;
+        for (size_t i = 0; i < len; i++)
+        {
+            crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+            crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+        }
+        return ~crc;
+    }
+
+    inline uint32_t headerCrc(const Header& header)
+    {
+        return crc32((const uint8_t*) &header, offsetof(Header, headerCrc));
+    }
+
+    // Checks the header alone, available is how many bytes the file or partition holds
+    inline Status validateHeader(const Header& header, size_t available)
+    {
+        if (header.magic != MODEL_FORMAT_MAGIC)
+        {
+            return BAD_MAGIC;
+        }
+
+        if (header.formatVersion != MODEL_FORMAT_VERSION || header.headerSize != sizeof(Header))
+        {
+            return BAD_VERSION;
+        }
+
+        if (header.headerCrc != headerCrc(header))
+        {
+            return BAD_HEADER_CRC;
+        }
+
+        if (header.dataOffset < sizeof(Header) ||
+            header.dataOffset % 16 != 0 ||
+            header.modelSize == 0 ||
+            header.dataOffset + (size_t) header.modelSize > available ||
+            header.classCount == 0 ||
+            header.classCount > MODEL_FORMAT_MAX_CLASSES)
+        {
+            return BAD_SIZE;
+        }
+
+        return OK;
+    }
+
+    // Checks that the header describes a model the firmware's pre and post processing was built for
+    inline Status matchesBuild(const Header& header, uint16_t width, uint16_t height, uint16_t channels, uint16_t classCount)
+    {
+        if (header.inputWidth != width || header.inputHeight != height || header.inputChannels != channels)
+        {
+            return INPUT_MISMATCH;
+        }
+
+        return header.classCount == classCount ? OK : CLASS_MISMATCH;
+    }
+
+    // Checks the model bytes against the header crc and runs the flatbuffer verifier over them
+    inline Status validateModel(const Header& header, const uint8_t* model)
+    {
+        if (crc32(model, header.modelSize) != header.modelCrc)
+        {
+            return BAD_MODEL_CRC;
+        }
+
+        flatbuffers::Verifier verifier(model, header.modelSize);
+        return tflite::VerifyModelBuffer(verifier) ? OK : BAD_SCHEMA;
+    }
+}
+
+#endif //MODEL_FORMAT_H
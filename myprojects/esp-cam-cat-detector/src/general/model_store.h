@@ -0,0 +1,509 @@
+#ifndef MODEL_STORE_H
+#define MODEL_STORE_H
+
+#include <esp_partition.h>
+#include <esp_heap_caps.h>
+#include <SD_MMC.h>
+
+#include <general/log.h>
+#include <general/model_format.h>
+#include <general/model_util.h>
+
+#define MODEL_STORE_SLOT_COUNT 2
+#define MODEL_STORE_PARTITION_SUBTYPE ((esp_partition_subtype_t) 0x40)
+#define MODEL_STORE_SD_PATH "/models/model.bin"
+#define MODEL_STORE_SECTOR_SIZE 4096 // flash erase unit
+#define MODEL_STORE_COPY_CHUNK 4096
+
+/*
+ * Models kept outside the firmware so they can be updated without a full flash.
+ *
+ * Two data partitions, model_a and model_b, hold one model each. The slot with a valid header and the highest
+ * sequence is loaded, memory mapped so the flatbuffer is used in place. A new model is always written to the
+ * slot not in use with its header written last, so a partial write leaves a slot without a valid header and the
+ * previous model keeps loading. A model that passes every check but still fails to load, an op this build doesn't
+ * register or a wrong output shape, gets its header erased by reject so the other slot is loaded instead, now and
+ * on every later boot. Boards without the partitions can load MODEL_STORE_SD_PATH into PSRAM instead. When
+ * nothing valid is found the model compiled into model_data.h is used.
+ *
+ * The partitions come out of the two app slots in default_16MB.csv, spiffs is left where it was. A board still on
+ * the stock table needs one serial upload of the esp32s3cam env: it writes the bootloader, the new table, otadata
+ * (booting app0 again) and the firmware, but nothing at the spiffs offset, so LittleFS and /env are kept. OTA
+ * updates only write an app slot and can't do this migration.
+ */
+namespace ModelStore
+{
+    enum Source
+    {
+        EMBEDDED,
+        PARTITION,
+        SD_CARD,
+    };
+
+    constexpr const char* sourceNames[] = {"embedded", "partition", "sd"};
+    constexpr const char* slotNames[MODEL_STORE_SLOT_COUNT] = {"model_a", "model_b"};
+
+    struct LoadedModel
+    {
+        Source source = EMBEDDED;
+        int slot = -1;
+        ModelFormat::Header header{};
+        const uint8_t* data = nullptr;
+    };
+
+    // Last stored model that failed to load, status is the ModelUtil error and 0 while nothing failed
+    struct LoadFailure
+    {
+        Source source = EMBEDDED;
+        int slot = -1;
+        uint32_t version = 0;
+        int status = 0;
+    };
+
+    inline LoadedModel current{};
+    inline LoadFailure lastFailure{};
+    inline const esp_partition_t* slots[MODEL_STORE_SLOT_COUNT]{};
+    inline esp_partition_mmap_handle_t mapHandle{};
+    inline bool mapped = false;
+    inline uint8_t* sdModel = nullptr;
+
+    inline void setup()
+    {
+        for (size_t i = 0; i < MODEL_STORE_SLOT_COUNT; i++)
+        {
+            slots[i] = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, MODEL_STORE_PARTITION_SUBTYPE, slotNames[i]);
+        }
+    }
+
+    inline ModelFormat::Status checkBuild(const ModelFormat::Header& header, uint16_t classCount)
+    {
+        return ModelFormat::matchesBuild(header,
+                                         MODEL_DATA_INPUT_WIDTH,
+                                         MODEL_DATA_INPUT_HEIGHT,
+                                         MODEL_DATA_INPUT_CHANNELS,
+                                         classCount);
+    }
+
+    inline ModelFormat::Status readSlotHeader(size_t slot, ModelFormat::Header& header)
+    {
+        if (slots[slot] == nullptr || esp_partition_read(slots[slot], 0, &header, sizeof(header)) != ESP_OK)
+        {
+            return ModelFormat::BAD_SIZE;
+        }
+
+        return ModelFormat::validateHeader(header, slots[slot]->size);
+    }
+
+    // Highest sequence of any valid slot, 0 if there is none
+    inline uint32_t maxSequence()
+    {
+        uint32_t sequence = 0;
+        for (size_t i = 0; i < MODEL_STORE_SLOT_COUNT; i++)
+        {
+            ModelFormat::Header header{};
+            if (readSlotHeader(i, header) == ModelFormat::OK)
+            {
+                sequence = std::max(sequence, header.sequence);
+            }
+        }
+        return sequence;
+    }
+
+    inline void close()
+    {
+        if (mapped)
+        {
+            esp_partition_munmap(mapHandle);
+            mapped = false;
+        }
+
+        if (sdModel != nullptr)
+        {
+            heap_caps_free(sdModel);
+            sdModel = nullptr;
+        }
+
+        current = LoadedModel{};
+    }
+
+    inline ModelFormat::Status openSlot(size_t slot, uint16_t classCount)
+    {
+        ModelFormat::Header header{};
+        ModelFormat::Status status = readSlotHeader(slot, header);
+        if (status == ModelFormat::OK)
+        {
+            status = checkBuild(header, classCount);
+        }
+
+        if (status != ModelFormat::OK)
+        {
+            return status;
+        }
+
+        const void* data = nullptr;
+        esp_partition_mmap_handle_t handle{};
+        if (esp_partition_mmap(slots[slot], header.dataOffset, header.modelSize, ESP_PARTITION_MMAP_DATA, &data, &handle) != ESP_OK)
+        {
+            return ModelFormat::BAD_SIZE;
+        }
+
+        status = ModelFormat::validateModel(header, (const uint8_t*) data);
+        if (status != ModelFormat::OK)
+        {
+            esp_partition_munmap(handle);
+            return status;
+        }
+
+        mapHandle = handle;
+        mapped = true;
+        current.source = PARTITION;
+        current.slot = slot;
+        current.header = header;
+        current.data = (const uint8_t*) data;
+        return ModelFormat::OK;
+    }
+
+    inline ModelFormat::Status openFile(const char* path, uint16_t classCount)
+    {
+        File file = SD_MMC.open(path, FILE_READ);
+        if (!file)
+        {
+            return ModelFormat::BAD_SIZE;
+        }
+
+        ModelFormat::Header header{};
+        ModelFormat::Status status = ModelFormat::BAD_SIZE;
+        if (file.read((uint8_t*) &header, sizeof(header)) == sizeof(header))
+        {
+            status = ModelFormat::validateHeader(header, file.size());
+        }
+
+        if (status == ModelFormat::OK)
+        {
+            status = checkBuild(header, classCount);
+        }
+
+        if (status != ModelFormat::OK)
+        {
+            file.close();
+            return status;
+        }
+
+        auto data = (uint8_t*) heap_caps_aligned_alloc(16, header.modelSize, MALLOC_CAP_SPIRAM);
+        if (data == nullptr)
+        {
+            file.close();
+            return ModelFormat::BAD_SIZE;
+        }
+
+        bool read = file.seek(header.dataOffset) && file.read(data, header.modelSize) == header.modelSize;
+        file.close();
+
+        status = read ? ModelFormat::validateModel(header, data) : ModelFormat::BAD_SIZE;
+        if (status != ModelFormat::OK)
+        {
+            heap_caps_free(data);
+            return status;
+        }
+
+        sdModel = data;
+        current.source = SD_CARD;
+        current.slot = -1;
+        current.header = header;
+        current.data = data;
+        return ModelFormat::OK;
+    }
+
+    /*
+     * Opens the best stored model: the newest valid slot, the other slot if the newest one is corrupt, then the
+     * SD card. Returns false when the embedded model should be used.
+     */
+    inline bool open(uint16_t classCount)
+    {
+        close();
+
+        ModelFormat::Header headers[MODEL_STORE_SLOT_COUNT]{};
+        bool valid[MODEL_STORE_SLOT_COUNT]{};
+        for (size_t i = 0; i < MODEL_STORE_SLOT_COUNT; i++)
+        {
+            valid[i] = readSlotHeader(i, headers[i]) == ModelFormat::OK;
+        }
+
+        size_t newest = valid[1] && (!valid[0] || headers[1].sequence > headers[0].sequence) ? 1 : 0;
+        size_t order[MODEL_STORE_SLOT_COUNT] = {newest, 1 - newest};
+        for (size_t slot : order)
+        {
+            if (!valid[slot])
+            {
+                continue;
+            }
+
+            ModelFormat::Status status = openSlot(slot, classCount);
+            if (status == ModelFormat::OK)
+            {
+                MLOGF("Using model version %lu from %s.\n", (unsigned long) current.header.modelVersion, slotNames[slot]);
+                return true;
+            }
+
+            MLOGF("Model in %s is unusable: %s\n", slotNames[slot], ModelFormat::statusName(status));
+        }
+
+        if (SD_MMC.exists(MODEL_STORE_SD_PATH))
+        {
+            ModelFormat::Status status = openFile(MODEL_STORE_SD_PATH, classCount);
+            if (status == ModelFormat::OK)
+            {
+                MLOGF("Using model version %lu from %s.\n", (unsigned long) current.header.modelVersion, MODEL_STORE_SD_PATH);
+                return true;
+            }
+
+            MLOGF("Model in %s is unusable: %s\n", MODEL_STORE_SD_PATH, ModelFormat::statusName(status));
+        }
+
+        return false;
+    }
+
+    /*
+     * Records that the model just opened failed to load and closes it. A partition slot also gets its header sector
+     * erased, so open skips it from now on, the model has to be installed again once fixed.
+     */
+    inline void reject(int loadStatus)
+    {
+        LoadedModel failed = current;
+        lastFailure = {failed.source, failed.slot, failed.header.modelVersion, loadStatus};
+        close();
+
+        if (failed.source == PARTITION && esp_partition_erase_range(slots[failed.slot], 0, MODEL_FORMAT_DATA_OFFSET) != ESP_OK)
+        {
+            MLOGF("Could not erase the header of %s.\n", slotNames[failed.slot]);
+        }
+    }
+
+    // Which model is running, for responses: "model_a version 3", "sd version 2" or "embedded"
+    inline int describeCurrent(char* buf, size_t len)
+    {
+        if (current.source == EMBEDDED)
+        {
+            return snprintf(buf, len, "embedded");
+        }
+
+        return snprintf(buf, len, "%s version %lu",
+                        current.source == PARTITION ? slotNames[current.slot] : sourceNames[current.source],
+                        (unsigned long) current.header.modelVersion);
+    }
+
+    inline ModelUtil::ArenaSizes arenaSizes()
+    {
+        const ModelFormat::Header& header = current.header;
+        ModelUtil::ArenaSizes sizes{};
+        sizes.total = header.arenaSize != 0 ? header.arenaSize : header.modelSize * 1.3;
+        sizes.persistent = header.persistentArenaSize != 0 ? header.persistentArenaSize : sizes.total;
+        sizes.nonPersistent = header.nonPersistentArenaSize != 0 ? header.nonPersistentArenaSize : MODEL_SPLIT_ARENA_DRAM_SIZE;
+        return sizes;
+    }
+
+    inline ModelFormat::Status writeHeader(size_t slot, ModelFormat::Header header, uint32_t sequence)
+    {
+        header.sequence = sequence;
+        header.headerCrc = ModelFormat::headerCrc(header);
+
+        if (esp_partition_erase_range(slots[slot], 0, MODEL_FORMAT_DATA_OFFSET) != ESP_OK ||
+            esp_partition_write(slots[slot], 0, &header, sizeof(header)) != ESP_OK)
+        {
+            return ModelFormat::BAD_SIZE;
+        }
+
+        return ModelFormat::OK;
+    }
+
+    // Re-checks the model bytes of a slot through a temporary mapping
+    inline ModelFormat::Status verifySlot(size_t slot, const ModelFormat::Header& header)
+    {
+        const void* data = nullptr;
+        esp_partition_mmap_handle_t handle{};
+        if (esp_partition_mmap(slots[slot], header.dataOffset, header.modelSize, ESP_PARTITION_MMAP_DATA, &data, &handle) != ESP_OK)
+        {
+            return ModelFormat::BAD_SIZE;
+        }
+
+        ModelFormat::Status status = ModelFormat::validateModel(header, (const uint8_t*) data);
+        esp_partition_munmap(handle);
+        return status;
+    }
+
+    // Slot a new model goes to, never the one currently loaded
+    inline int installSlot()
+    {
+        if (current.source == PARTITION)
+        {
+            return 1 - current.slot;
+        }
+
+        ModelFormat::Header headers[MODEL_STORE_SLOT_COUNT]{};
+        bool valid0 = readSlotHeader(0, headers[0]) == ModelFormat::OK;
+        bool valid1 = readSlotHeader(1, headers[1]) == ModelFormat::OK;
+        return valid0 && (!valid1 || headers[0].sequence > headers[1].sequence) ? 1 : 0;
+    }
+
+    /*
+     * Copies a packed model file from the SD card into the slot not in use and makes it the active one.
+     * The running model is left alone, reload it to switch.
+     */
+    inline ModelFormat::Status installFromFile(const char* path, uint16_t classCount, int* installedSlot = nullptr)
+    {
+        int slot = installSlot();
+        if (slots[slot] == nullptr)
+        {
+            MLOGF("No %s partition to install the model to.\n", slotNames[slot]);
+            return ModelFormat::BAD_SIZE;
+        }
+
+        File file = SD_MMC.open(path, FILE_READ);
+        if (!file)
+        {
+            return ModelFormat::BAD_SIZE;
+        }
+
+        ModelFormat::Header header{};
+        ModelFormat::Status status = ModelFormat::BAD_SIZE;
+        if (file.read((uint8_t*) &header, sizeof(header)) == sizeof(header))
+        {
+            status = ModelFormat::validateHeader(header, std::min<size_t>(file.size(), slots[slot]->size));
+        }
+
+        if (status == ModelFormat::OK)
+        {
+            status = checkBuild(header, classCount);
+        }
+
+        uint8_t* chunk = status == ModelFormat::OK ? (uint8_t*) malloc(MODEL_STORE_COPY_CHUNK) : nullptr;
+        if (chunk == nullptr)
+        {
+            file.close();
+            return status != ModelFormat::OK ? status : ModelFormat::BAD_SIZE;
+        }
+
+        // Erasing the header sector first invalidates the slot until the copy is complete
+        size_t end = header.dataOffset + header.modelSize;
+        size_t eraseSize = (end + MODEL_STORE_SECTOR_SIZE - 1) / MODEL_STORE_SECTOR_SIZE * MODEL_STORE_SECTOR_SIZE;
+        bool ok = esp_partition_erase_range(slots[slot], 0, eraseSize) == ESP_OK && file.seek(header.dataOffset);
+
+        for (size_t offset = header.dataOffset; ok && offset < end; offset += MODEL_STORE_COPY_CHUNK)
+        {
+            size_t len = std::min<size_t>(MODEL_STORE_COPY_CHUNK, end - offset);
+            ok = file.read(chunk, len) == len && esp_partition_write(slots[slot], offset, chunk, len) == ESP_OK;
+        }
+
+        free(chunk);
+        file.close();
+
+        if (!ok)
+        {
+            return ModelFormat::BAD_SIZE;
+        }
+
+        status = verifySlot(slot, header);
+        if (status != ModelFormat::OK)
+        {
+            return status;
+        }
+
+        status = writeHeader(slot, header, maxSequence() + 1);
+        if (status == ModelFormat::OK && installedSlot != nullptr)
+        {
+            *installedSlot = slot;
+        }
+
+        MLOGF("Installed model version %lu from %s into %s: %s\n",
+              (unsigned long) header.modelVersion,
+              path,
+              slotNames[slot],
+              ModelFormat::statusName(status));
+        return status;
+    }
+
+    // Makes a slot holding a valid model the active one, e.g. to roll back to the previous model
+    inline ModelFormat::Status activate(size_t slot)
+    {
+        ModelFormat::Header header{};
+        ModelFormat::Status status = readSlotHeader(slot, header);
+        if (status == ModelFormat::OK)
+        {
+            status = verifySlot(slot, header);
+        }
+
+        if (status != ModelFormat::OK)
+        {
+            return status;
+        }
+
+        uint32_t sequence = maxSequence();
+        return header.sequence == sequence ? ModelFormat::OK : writeHeader(slot, header, sequence + 1);
+    }
+
+    inline size_t toJson(char* buf, size_t len)
+    {
+        const ModelFormat::Header& header = current.header;
+        size_t offset = snprintf(buf, len, "{\"source\":\"%s\",\"slot\":\"%s\"",
+                                 sourceNames[current.source],
+                                 current.slot >= 0 ? slotNames[current.slot] : "");
+
+        if (current.source != EMBEDDED && offset < len)
+        {
+            offset += snprintf(buf + offset, len - offset, ",\"version\":%lu,\"size\":%lu,\"arenaSize\":%lu,\"classes\":[",
+                               (unsigned long) header.modelVersion,
+                               (unsigned long) header.modelSize,
+                               (unsigned long) header.arenaSize);
+
+            for (size_t i = 0; i < header.classCount && offset < len; i++)
+            {
+                offset += snprintf(buf + offset, len - offset, "%s{\"name\":\"%.*s\",\"threshold\":%.2f}",
+                                   i == 0 ? "" : ",",
+                                   MODEL_FORMAT_LABEL_LENGTH,
+                                   header.classNames[i],
+                                   header.thresholds[i]);
+            }
+
+            if (offset < len)
+            {
+                offset += snprintf(buf + offset, len - offset, "]");
+            }
+        }
+
+        if (lastFailure.status != 0 && offset < len)
+        {
+            offset += snprintf(buf + offset, len - offset, ",\"lastFailure\":{\"source\":\"%s\",\"slot\":\"%s\",\"version\":%lu,\"status\":%d}",
+                               sourceNames[lastFailure.source],
+                               lastFailure.slot >= 0 ? slotNames[lastFailure.slot] : "",
+                               (unsigned long) lastFailure.version,
+                               lastFailure.status);
+        }
+
+        if (offset < len)
+        {
+            offset += snprintf(buf + offset, len - offset, ",\"slots\":[");
+        }
+
+        for (size_t i = 0; i < MODEL_STORE_SLOT_COUNT && offset < len; i++)
+        {
+            ModelFormat::Header slotHeader{};
+            ModelFormat::Status status = slots[i] != nullptr ? readSlotHeader(i, slotHeader) : ModelFormat::BAD_SIZE;
+            offset += snprintf(buf + offset, len - offset, "%s{\"name\":\"%s\",\"present\":%s,\"status\":\"%s\",\"version\":%lu,\"sequence\":%lu}",
+                               i == 0 ? "" : ",",
+                               slotNames[i],
+                               slots[i] != nullptr ? "true" : "false",
+                               ModelFormat::statusName(status),
+                               status == ModelFormat::OK ? (unsigned long) slotHeader.modelVersion : 0ul,
+                               status == ModelFormat::OK ? (unsigned long) slotHeader.sequence : 0ul);
+        }
+
+        if (offset < len)
+        {
+            offset += snprintf(buf + offset, len - offset, "]}");
+        }
+
+        return offset;
+    }
+}
+
+#endif //MODEL_STORE_H
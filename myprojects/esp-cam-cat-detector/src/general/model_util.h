@@ -8,25 +8,144 @@
 #include "tensorflow/lite/micro/micro_log.h"
 #include "tensorflow/lite/micro/micro_mutable_op_resolver.h"
 #include "tensorflow/lite/schema/schema_generated.h"
+#include "tensorflow/lite/kernels/internal/quantization_util.h"
+#include "tensorflow/lite/kernels/internal/reference/requantize.h"
+#ifdef MODEL_IS_GRAYSCALE
+#if !__has_include("model_data_gray.h")
+#error "MODEL_IS_GRAYSCALE needs model_data_gray.h, generated like model_data.h from a single channel model, none is in the tree yet"
+#endif
+#include "model_data_gray.h"
+#else
 #include "model_data.h"
+#endif
+#ifdef MODEL_ENABLE_GATE
+#if !__has_include("gate_model_data.h")
+#error "MODEL_ENABLE_GATE needs gate_model_data.h, generated like model_data.h from a presence classifier with the GATE_MODEL_DATA prefix and namespace gate_model_data, none is in the tree yet"
+#endif
+#include "gate_model_data.h"
+#endif
 
 // #define MODEL_STATIC_TENSOR_ARENA
 // #define MODEL_USE_PSRAM
+// #define MODEL_SPLIT_ARENA // persistent data in PSRAM, activations and scratch in internal DRAM
 // #define MODEL_DEBUG_RAM
 
+// #define MODEL_ENABLE_PROFILER
+
 #ifdef MODEL_DEBUG_RAM
 #include "tensorflow/lite/micro/recording_micro_interpreter.h"
 #else
 #include "tensorflow/lite/micro/micro_interpreter.h"
 #endif
 
+#ifndef MODEL_DEBUG_RAM
+#include "tensorflow/lite/micro/micro_allocator.h"
+#endif
+
+#ifdef ESP_PLATFORM
+#include <esp_heap_caps.h>
+#endif
+
+#ifndef MODEL_SPLIT_ARENA_DRAM_SIZE
+#define MODEL_SPLIT_ARENA_DRAM_SIZE (128 * 1024)
+#endif
+
+#ifdef MODEL_ENABLE_PROFILER
+#include "tensorflow/lite/micro/micro_profiler_interface.h"
+#ifdef ESP_PLATFORM
+#include <esp_cpu.h>
+#endif
+
+#define MODEL_PROFILER_MAX_OPS 64
+#define MODEL_PROFILER_MAX_OP_TYPES 16
+#endif
+
 namespace ModelUtil
 {
+#ifdef MODEL_DATA_ARENA_SIZE
+    // Measured on the host by src/native/arena_size.cpp
+    constexpr size_t arenaSize = MODEL_DATA_ARENA_SIZE;
+#else
+    // The model_data.h in the tree hasn't been measured yet: run native_arena on it (see arena_size.cpp) after
+    // generating it, until then this guess sizes the arena and the split one below is derived from it
     constexpr size_t arenaSize = MODEL_DATA_MODEL_SIZE * 1.3;
-    using InputCallback = std::function<void(uint8_t *inputBuffer)>;
+#endif
+
+#ifdef MODEL_DATA_NONPERSISTENT_ARENA_SIZE
+    constexpr size_t persistentArenaSize = MODEL_DATA_PERSISTENT_ARENA_SIZE;
+    constexpr size_t nonPersistentArenaSize = MODEL_DATA_NONPERSISTENT_ARENA_SIZE;
+#else
+    // Not measured yet, the PSRAM side of a split arena gets the whole heuristic size
+    constexpr size_t persistentArenaSize = arenaSize;
+    constexpr size_t nonPersistentArenaSize = MODEL_SPLIT_ARENA_DRAM_SIZE;
+#endif
+
+    // Arena sizes of one model, the persistent and non-persistent sizes are only used by the split placement
+    struct ArenaSizes
+    {
+        size_t total;
+        size_t persistent;
+        size_t nonPersistent;
+    };
+
+    constexpr ArenaSizes embeddedArenaSizes = {arenaSize, persistentArenaSize, nonPersistentArenaSize};
+
+    using InputCallback = std::function<bool(uint8_t *inputBuffer)>;
 
     inline const tflite::Model *currentModel = nullptr;
     inline TfLiteTensor* currentInputTensor = nullptr;
+    inline TfLiteTensor* currentOutputTensor = nullptr;
+    inline size_t arenaUsedBytes = 0;
+    inline ArenaSizes currentArenaSizes = embeddedArenaSizes;
+    inline const char* arenaPlacement = "none";
+
+    // Where loadModel puts the tensor arena, the build flags pick the default and benchmarks switch it at runtime
+    enum Placement
+    {
+        PLACEMENT_HEAP,
+        PLACEMENT_PSRAM,
+        PLACEMENT_INTERNAL,
+#ifndef MODEL_DEBUG_RAM
+        PLACEMENT_SPLIT,
+#endif
+#ifdef MODEL_STATIC_TENSOR_ARENA
+        PLACEMENT_STATIC,
+#endif
+        PLACEMENT_COUNT,
+    };
+
+#if defined(MODEL_STATIC_TENSOR_ARENA)
+    constexpr Placement singleArenaPlacement = PLACEMENT_STATIC;
+#elif defined(MODEL_USE_PSRAM)
+    constexpr Placement singleArenaPlacement = PLACEMENT_PSRAM;
+#else
+    constexpr Placement singleArenaPlacement = PLACEMENT_HEAP;
+#endif
+
+#if defined(MODEL_SPLIT_ARENA) && !defined(MODEL_DEBUG_RAM)
+    constexpr Placement defaultPlacement = PLACEMENT_SPLIT;
+#else
+    constexpr Placement defaultPlacement = singleArenaPlacement;
+#endif
+
+    inline Placement placement = defaultPlacement;
+    inline Placement currentArenaPlacement = defaultPlacement; // of arena, while it is allocated
+
+    inline const char* placementName(Placement where)
+    {
+        switch (where)
+        {
+            case PLACEMENT_PSRAM: return "psram";
+            case PLACEMENT_INTERNAL: return "internal";
+#ifndef MODEL_DEBUG_RAM
+            case PLACEMENT_SPLIT: return "split psram/dram";
+#endif
+#ifdef MODEL_STATIC_TENSOR_ARENA
+            case PLACEMENT_STATIC: return "internal static";
+#endif
+            default: return "heap";
+        }
+    }
 
 #ifdef MODEL_DEBUG_RAM
     inline tflite::RecordingMicroInterpreter *currentInterpreter = nullptr;
@@ -35,9 +154,191 @@ namespace ModelUtil
 #endif
 
 #ifdef MODEL_STATIC_TENSOR_ARENA
-    inline uint8_t IRAM_ATTR arena[arenaSize];
-#else
+    inline uint8_t IRAM_ATTR staticArena[arenaSize];
+#endif
     inline uint8_t *arena = nullptr;
+
+    inline void freeArena()
+    {
+#ifdef MODEL_STATIC_TENSOR_ARENA
+        if (arena != staticArena)
+#endif
+        {
+            free(arena);
+        }
+        arena = nullptr;
+    }
+
+    inline uint8_t *allocateArena(Placement where, size_t size)
+    {
+        switch (where)
+        {
+#ifdef MODEL_STATIC_TENSOR_ARENA
+            case PLACEMENT_STATIC:
+                if (size > arenaSize)
+                {
+                    MicroPrintf("Model needs a %u byte arena, the static arena has %u bytes.", (unsigned) size, (unsigned) arenaSize);
+                    return nullptr;
+                }
+                return staticArena;
+#endif
+            case PLACEMENT_PSRAM:
+                return (uint8_t *) ps_malloc(size);
+            case PLACEMENT_INTERNAL:
+                return (uint8_t *) heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+            default:
+                return (uint8_t *) malloc(size);
+        }
+    }
+
+#ifdef MODEL_ENABLE_PROFILER
+    struct OpCycles
+    {
+        const char* tag = nullptr;
+        uint64_t cycles = 0;
+        uint32_t count = 0;
+    };
+
+    /*
+     * Sums the CPU cycles of every operator across invocations, both per operator position in the graph and per
+     * operator type. Events are only counted between startInvoke and endInvoke so allocation is left out.
+     */
+    class AggregatingProfiler : public tflite::MicroProfilerInterface
+    {
+    public:
+        uint32_t BeginEvent(const char* tag) override
+        {
+            if (!invoking || nextOp >= MODEL_PROFILER_MAX_OPS)
+            {
+                return MODEL_PROFILER_MAX_OPS;
+            }
+
+            uint32_t handle = nextOp++;
+            byIndex[handle].tag = tag;
+            starts[handle] = esp_cpu_get_cycle_count();
+            return handle;
+        }
+
+        void EndEvent(uint32_t handle) override
+        {
+            if (handle >= MODEL_PROFILER_MAX_OPS)
+            {
+                return;
+            }
+
+            uint32_t cycles = esp_cpu_get_cycle_count() - starts[handle];
+            byIndex[handle].cycles += cycles;
+            byIndex[handle].count++;
+
+            OpCycles* type = findType(byIndex[handle].tag);
+            if (type != nullptr)
+            {
+                type->cycles += cycles;
+                type->count++;
+            }
+        }
+
+        void startInvoke()
+        {
+            invoking = true;
+            nextOp = 0;
+        }
+
+        void endInvoke()
+        {
+            invoking = false;
+            opCount = std::max(opCount, nextOp);
+            invokes++;
+        }
+
+        void reset()
+        {
+            for (OpCycles& op : byIndex)
+            {
+                op = OpCycles{};
+            }
+
+            for (OpCycles& type : byType)
+            {
+                type = OpCycles{};
+            }
+
+            typeCount = 0;
+            opCount = 0;
+            invokes = 0;
+        }
+
+        uint32_t invokes = 0;
+        uint32_t opCount = 0;
+        uint32_t typeCount = 0;
+        OpCycles byIndex[MODEL_PROFILER_MAX_OPS]{};
+        OpCycles byType[MODEL_PROFILER_MAX_OP_TYPES]{};
+
+    private:
+        OpCycles* findType(const char* tag)
+        {
+            for (uint32_t i = 0; i < typeCount; i++)
+            {
+                if (byType[i].tag == tag || strcmp(byType[i].tag, tag) == 0)
+                {
+                    return &byType[i];
+                }
+            }
+
+            if (typeCount >= MODEL_PROFILER_MAX_OP_TYPES)
+            {
+                return nullptr;
+            }
+
+            byType[typeCount].tag = tag;
+            return &byType[typeCount++];
+        }
+
+        bool invoking = false;
+        uint32_t nextOp = 0;
+        uint32_t starts[MODEL_PROFILER_MAX_OPS]{};
+    };
+
+    inline AggregatingProfiler profiler;
+
+    // Writes the average cycles per invocation of each operator type and graph position as JSON
+    inline size_t profilerToJson(char* buf, size_t len)
+    {
+        uint32_t invokes = std::max<uint32_t>(profiler.invokes, 1);
+        size_t offset = snprintf(buf, len, "{\"invokes\":%lu,\"types\":[", (unsigned long) profiler.invokes);
+
+        for (uint32_t i = 0; i < profiler.typeCount && offset < len; i++)
+        {
+            const OpCycles& type = profiler.byType[i];
+            offset += snprintf(buf + offset, len - offset, "%s{\"op\":\"%s\",\"calls\":%lu,\"cyclesPerInvoke\":%llu}",
+                i == 0 ? "" : ",",
+                type.tag,
+                (unsigned long) (type.count / invokes),
+                (unsigned long long) (type.cycles / invokes));
+        }
+
+        if (offset < len)
+        {
+            offset += snprintf(buf + offset, len - offset, "],\"ops\":[");
+        }
+
+        for (uint32_t i = 0; i < profiler.opCount && offset < len; i++)
+        {
+            const OpCycles& op = profiler.byIndex[i];
+            offset += snprintf(buf + offset, len - offset, "%s{\"index\":%lu,\"op\":\"%s\",\"cyclesPerInvoke\":%llu}",
+                i == 0 ? "" : ",",
+                (unsigned long) i,
+                op.tag != nullptr ? op.tag : "",
+                (unsigned long long) (op.cycles / invokes));
+        }
+
+        if (offset < len)
+        {
+            offset += snprintf(buf + offset, len - offset, "]}");
+        }
+
+        return offset;
+    }
 #endif
 
     enum Status
@@ -48,57 +349,96 @@ namespace ModelUtil
         TENSOR_ALLOCATION_FAILED = -3,
         MODEL_NOT_INITIALIZED = -4,
         INFERENCE_ERROR = -5,
+        INPUT_WRITE_FAILED = -6,
+        UNSUPPORTED_TENSOR_TYPE = -7,
     };
 
+    // Converts a raw output tensor value to float
     inline float unquantizeValue(uint8_t val)
     {
-        return currentInputTensor->params.scale * (val - currentInputTensor->params.zero_point);
+        return currentOutputTensor->params.scale * (val - currentOutputTensor->params.zero_point);
     }
 
-    inline int loadModel()
+    // Smallest raw output value whose unquantized value is >= threshold, 256 if none is
+    inline uint16_t quantizeThreshold(float threshold)
     {
-        currentModel = tflite::GetModel(model_data::tflite);
-        if (currentModel->version() != TFLITE_SCHEMA_VERSION)
+        float raw = ceilf(threshold / currentOutputTensor->params.scale + currentOutputTensor->params.zero_point);
+        if (raw <= 0)
         {
-            MicroPrintf("Model provided is schema version %d not equal to supported version %d.", currentModel->version(), TFLITE_SCHEMA_VERSION);
-            return INVALID_SCHEMA_VER;
+            return 0;
         }
 
-#ifndef MODEL_STATIC_TENSOR_ARENA
-        if (arena == nullptr)
+        return raw > 255 ? 256 : (uint16_t) raw;
+    }
+
+#ifndef MODEL_DEBUG_RAM
+    inline uint8_t *persistentArena = nullptr;
+    inline uint8_t *nonPersistentArena = nullptr;
+
+    inline void freeSplitArena()
+    {
+        free(persistentArena);
+        free(nonPersistentArena);
+        persistentArena = nullptr;
+        nonPersistentArena = nullptr;
+    }
+
+    /*
+     * Tensors, node data and other allocations that live as long as the interpreter go to PSRAM, while the
+     * activations and kernel scratch buffers that are read and written on every Invoke go to internal DRAM.
+     */
+    inline int loadSplitArena(const tflite::MicroOpResolver &opResolver, const ArenaSizes &sizes)
+    {
+        persistentArena = (uint8_t *) ps_malloc(sizes.persistent);
+        nonPersistentArena = (uint8_t *) heap_caps_malloc(sizes.nonPersistent, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        if (persistentArena == nullptr || nonPersistentArena == nullptr)
         {
-#ifdef MODEL_USE_PSRAM
-            arena = (uint8_t *) ps_malloc(arenaSize);
-#else
-            arena = (uint8_t *) malloc(arenaSize);
-#endif
+            MicroPrintf("Could not allocate split arena of %u + %u bytes.", (unsigned) sizes.persistent, (unsigned) sizes.nonPersistent);
+            freeSplitArena();
+            return ARENA_ALLOCATION_FAILED;
         }
-#endif
 
-        static tflite::MicroMutableOpResolver<MODEL_DATA_DISTINCT_OPS_COUNT> opResolver;
-        model_data::RegisterOps(opResolver);
+        tflite::MicroAllocator *allocator = tflite::MicroAllocator::Create(
+            persistentArena,
+            sizes.persistent,
+            nonPersistentArena,
+            sizes.nonPersistent);
+        if (allocator == nullptr)
+        {
+            freeSplitArena();
+            return ARENA_ALLOCATION_FAILED;
+        }
 
-#ifdef MODEL_DEBUG_RAM
-        currentInterpreter = new tflite::RecordingMicroInterpreter(
-            currentModel,
-            opResolver,
-            arena,
-            arenaSize);
-#else
         currentInterpreter = new tflite::MicroInterpreter(
             currentModel,
             opResolver,
-            arena,
-            arenaSize);
+            allocator
+#ifdef MODEL_ENABLE_PROFILER
+            , nullptr,
+            &profiler
 #endif
+            );
 
         TfLiteStatus allocationStatus = currentInterpreter->AllocateTensors();
         if (allocationStatus != kTfLiteOk)
         {
-            MicroPrintf("AllocateTensors() failed: %d", allocationStatus);
+            MicroPrintf("AllocateTensors() failed on split arena of %u + %u bytes.", (unsigned) sizes.persistent, (unsigned) sizes.nonPersistent);
+            delete currentInterpreter;
+            currentInterpreter = nullptr;
+            freeSplitArena();
             return TENSOR_ALLOCATION_FAILED;
         }
 
+        arenaPlacement = placementName(PLACEMENT_SPLIT);
+        return OK;
+    }
+#endif
+
+    inline int acquireTensors()
+    {
+        arenaUsedBytes = currentInterpreter->arena_used_bytes();
+        MicroPrintf("Tensor arena (%s) uses %u bytes.", arenaPlacement, (unsigned) arenaUsedBytes);
+
 #ifdef MODEL_DEBUG_RAM
         currentInterpreter->GetMicroAllocator().PrintAllocations();
 #endif
@@ -110,20 +450,126 @@ namespace ModelUtil
             return TENSOR_ALLOCATION_FAILED;
         }
 
+        currentOutputTensor = currentInterpreter->output(0);
+        if (currentOutputTensor == nullptr)
+        {
+            MicroPrintf("Could not acquire output tensor.");
+            return TENSOR_ALLOCATION_FAILED;
+        }
+
         return OK;
     }
 
+    /*
+     * Loads a flatbuffer model, by default the one compiled into model_data.h. Other models must use the same
+     * input dimensions and only the ops model_data::RegisterOps registers, and their buffer has to outlive the
+     * interpreter, until unloadModel.
+     */
+    inline int loadModel(const uint8_t *modelData = model_data::tflite, const ArenaSizes &sizes = embeddedArenaSizes)
+    {
+        currentModel = tflite::GetModel(modelData);
+        if (currentModel->version() != TFLITE_SCHEMA_VERSION)
+        {
+            MicroPrintf("Model provided is schema version %d not equal to supported version %d.", currentModel->version(), TFLITE_SCHEMA_VERSION);
+            return INVALID_SCHEMA_VER;
+        }
+
+        static tflite::MicroMutableOpResolver<MODEL_DATA_DISTINCT_OPS_COUNT> opResolver;
+        static bool opsRegistered = false;
+        if (!opsRegistered)
+        {
+            model_data::RegisterOps(opResolver);
+            opsRegistered = true;
+        }
+
+        Placement single = placement;
+#ifndef MODEL_DEBUG_RAM
+        if (placement == PLACEMENT_SPLIT)
+        {
+            if (loadSplitArena(opResolver, sizes) == OK)
+            {
+                currentArenaSizes = sizes;
+                return acquireTensors();
+            }
+            MicroPrintf("Falling back to a single tensor arena.");
+            single = singleArenaPlacement;
+        }
+#endif
+
+        if (arena != nullptr && (currentArenaSizes.total != sizes.total || currentArenaPlacement != single))
+        {
+            freeArena();
+        }
+
+        if (arena == nullptr)
+        {
+            arena = allocateArena(single, sizes.total);
+            currentArenaPlacement = single;
+        }
+
+        if (arena == nullptr)
+        {
+            MicroPrintf("Could not allocate %s tensor arena of %u bytes.", placementName(single), (unsigned) sizes.total);
+            return ARENA_ALLOCATION_FAILED;
+        }
+        currentArenaSizes = sizes;
+
+#ifdef MODEL_DEBUG_RAM
+        currentInterpreter = new tflite::RecordingMicroInterpreter(
+            currentModel,
+            opResolver,
+            arena,
+            sizes.total
+#ifdef MODEL_ENABLE_PROFILER
+            , nullptr,
+            &profiler
+#endif
+            );
+#else
+        currentInterpreter = new tflite::MicroInterpreter(
+            currentModel,
+            opResolver,
+            arena,
+            sizes.total
+#ifdef MODEL_ENABLE_PROFILER
+            , nullptr,
+            &profiler
+#endif
+            );
+#endif
+
+        TfLiteStatus allocationStatus = currentInterpreter->AllocateTensors();
+        if (allocationStatus != kTfLiteOk)
+        {
+            MicroPrintf("AllocateTensors() failed: %d, arena of %u bytes may be too small.", allocationStatus, (unsigned) sizes.total);
+            return TENSOR_ALLOCATION_FAILED;
+        }
+
+        arenaPlacement = placementName(single);
+        return acquireTensors();
+    }
+
     inline int runInference(uint8_t **output, const InputCallback &writeDataCallback)
     {
-        if (currentInterpreter == nullptr || currentModel == nullptr || currentInputTensor == nullptr)
+        if (currentInterpreter == nullptr || currentModel == nullptr || currentInputTensor == nullptr || currentOutputTensor == nullptr)
         {
             MicroPrintf("Model or interpreter is not initialized.");
             return MODEL_NOT_INITIALIZED;
         }
 
-        writeDataCallback((uint8_t*) currentInputTensor->data.data);
+        if (!writeDataCallback((uint8_t*) currentInputTensor->data.data))
+        {
+            MicroPrintf("Failed to write input data.");
+            return INPUT_WRITE_FAILED;
+        }
 
+#ifdef MODEL_ENABLE_PROFILER
+        profiler.startInvoke();
+#endif
         TfLiteStatus infStatus = currentInterpreter->Invoke();
+#ifdef MODEL_ENABLE_PROFILER
+        profiler.endInvoke();
+#endif
         if (infStatus != kTfLiteOk)
         {
             MicroPrintf("Failed to run inference: %d", infStatus);
@@ -134,15 +580,28 @@ namespace ModelUtil
         currentInterpreter->GetMicroAllocator().PrintAllocations();
 #endif
 
-        TfLiteTensor* outputTensor = currentInterpreter->output(0);
-        if (outputTensor == nullptr)
+        *output = (uint8_t*) currentOutputTensor->data.data;
+        return OK;
+    }
+
+    /*
+     * Fills a uint8 to int8 lookup table with what TFLM's Quantize kernel outputs for every input value. It
+     * prepares the same fixed-point multiplier from the scale ratio and runs the same Requantize, so the table is
+     * bit-exact with the op, checked against the kernel by src/native/quantize_check.cpp.
+     */
+    inline void fillRequantizeTable(float fromScale, int32_t fromZeroPoint, float toScale, int32_t toZeroPoint,
+                                    int8_t* table)
+    {
+        int32_t multiplier = 0;
+        int shift = 0;
+        tflite::QuantizeMultiplier((double) fromScale / (double) toScale, &multiplier, &shift);
+
+        uint8_t values[256];
+        for (int value = 0; value < 256; value++)
         {
-            MicroPrintf("Failed to get output tensor.");
-            return TENSOR_ALLOCATION_FAILED;
+            values[value] = value;
         }
-
-        *output = (uint8_t*) outputTensor->data.data;
-        return OK;
+        tflite::reference_ops::Requantize(values, 256, multiplier, shift, fromZeroPoint, toZeroPoint, table);
     }
 
     inline void unloadModel()
@@ -152,17 +611,129 @@ namespace ModelUtil
             currentInterpreter = nullptr;
         }
 
-#ifndef MODEL_STATIC_TENSOR_ARENA
-        if (arena != nullptr) {
-            free(arena);
-            arena = nullptr;
-        }
+        freeArena();
+
+#ifndef MODEL_DEBUG_RAM
+        freeSplitArena();
 #endif
 
         currentModel = nullptr;
         currentInputTensor = nullptr;
+        currentOutputTensor = nullptr;
+        arenaPlacement = "none";
         MicroPrintf("Model unloaded successfully.");
     }
+
+#ifdef MODEL_ENABLE_GATE
+#ifdef GATE_MODEL_DATA_ARENA_SIZE
+    constexpr size_t gateArenaSize = GATE_MODEL_DATA_ARENA_SIZE;
+#else
+    // The activations of a tiny model outweigh its weights, so the size heuristic gets a fixed allowance for them
+    constexpr size_t gateArenaSize = GATE_MODEL_DATA_MODEL_SIZE * 1.3 + 32 * 1024;
+#endif
+
+    /*
+     * Presence classifier from gate_model_data.h, run before the detector to skip empty frames. It has its own
+     * interpreter and arena so both models stay loaded side by side, and reloading the detector leaves it alone.
+     * The arena goes to internal DRAM when it fits, PSRAM otherwise. The profiler only follows the detector.
+     */
+    inline const tflite::Model *gateModel = nullptr;
+    inline tflite::MicroInterpreter *gateInterpreter = nullptr;
+    inline TfLiteTensor* gateInputTensor = nullptr;
+    inline TfLiteTensor* gateOutputTensor = nullptr;
+    inline uint8_t *gateArena = nullptr;
+    inline size_t gateArenaUsedBytes = 0;
+    inline const char* gateArenaPlacement = "none";
+
+    inline void unloadGateModel()
+    {
+        delete gateInterpreter;
+        gateInterpreter = nullptr;
+        free(gateArena);
+        gateArena = nullptr;
+        gateModel = nullptr;
+        gateInputTensor = nullptr;
+        gateOutputTensor = nullptr;
+        gateArenaPlacement = "none";
+    }
+
+    inline int loadGateModel()
+    {
+        gateModel = tflite::GetModel(gate_model_data::tflite);
+        if (gateModel->version() != TFLITE_SCHEMA_VERSION)
+        {
+            MicroPrintf("Gate model is schema version %d not equal to supported version %d.", gateModel->version(), TFLITE_SCHEMA_VERSION);
+            gateModel = nullptr;
+            return INVALID_SCHEMA_VER;
+        }
+
+        static tflite::MicroMutableOpResolver<GATE_MODEL_DATA_DISTINCT_OPS_COUNT> opResolver;
+        static bool opsRegistered = false;
+        if (!opsRegistered)
+        {
+            gate_model_data::RegisterOps(opResolver);
+            opsRegistered = true;
+        }
+
+        gateArena = (uint8_t *) heap_caps_malloc(gateArenaSize, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        gateArenaPlacement = "dram";
+        if (gateArena == nullptr)
+        {
+            gateArena = (uint8_t *) ps_malloc(gateArenaSize);
+            gateArenaPlacement = "psram";
+        }
+
+        if (gateArena == nullptr)
+        {
+            MicroPrintf("Could not allocate gate arena of %u bytes.", (unsigned) gateArenaSize);
+            unloadGateModel();
+            return ARENA_ALLOCATION_FAILED;
+        }
+
+        gateInterpreter = new tflite::MicroInterpreter(gateModel, opResolver, gateArena, gateArenaSize);
+        if (gateInterpreter->AllocateTensors() != kTfLiteOk)
+        {
+            MicroPrintf("AllocateTensors() failed for the gate, arena of %u bytes may be too small.", (unsigned) gateArenaSize);
+            unloadGateModel();
+            return TENSOR_ALLOCATION_FAILED;
+        }
+
+        gateArenaUsedBytes = gateInterpreter->arena_used_bytes();
+        gateInputTensor = gateInterpreter->input(0);
+        gateOutputTensor = gateInterpreter->output(0);
+        if (gateInputTensor == nullptr || gateOutputTensor == nullptr)
+        {
+            MicroPrintf("Could not acquire gate tensors.");
+            unloadGateModel();
+            return TENSOR_ALLOCATION_FAILED;
+        }
+
+        MicroPrintf("Gate arena (%s) uses %u bytes.", gateArenaPlacement, (unsigned) gateArenaUsedBytes);
+        return OK;
+    }
+
+    inline int runGate(uint8_t **output, const InputCallback &writeDataCallback)
+    {
+        if (gateInterpreter == nullptr)
+        {
+            return MODEL_NOT_INITIALIZED;
+        }
+
+        if (!writeDataCallback((uint8_t*) gateInputTensor->data.data))
+        {
+            return INPUT_WRITE_FAILED;
+        }
+
+        if (gateInterpreter->Invoke() != kTfLiteOk)
+        {
+            MicroPrintf("Failed to run the gate model.");
+            return INFERENCE_ERROR;
+        }
+
+        *output = (uint8_t*) gateOutputTensor->data.data;
+        return OK;
+    }
+#endif
 }
 
 #endif //MODEL_UTIL_H
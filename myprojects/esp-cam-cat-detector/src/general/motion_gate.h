@@ -0,0 +1,158 @@
+#ifndef MOTION_GATE_H
+#define MOTION_GATE_H
+
+#include <general/inference_util.h>
+
+#define MOTION_GATE_MAX_PIXELS (160 * 128) // SXGA at 1/8 scale
+#define MOTION_GATE_PIXEL_DELTA 12 // luma difference for a pixel to count as changed
+#define MOTION_GATE_BACKGROUND_SHIFT 3 // background follows the frame with a 1/8 weight
+#define MOTION_GATE_HOLD_MS (30 * 1000)
+#define MOTION_GATE_FORCE_INTERVAL_MS (60 * 1000)
+
+/*
+ * Cheap change detector run before the model.
+ *
+ * Each frame is decoded at 1/8 scale as luma only and compared against a running average of previous frames.
+ * Inference only runs when enough pixels changed, while a recent detection is being held or when a periodic
+ * forced run is due, so slow scene changes are still checked from time to time.
+ */
+namespace MotionGate
+{
+    enum Decision
+    {
+        SKIP,
+        MOTION,
+        HOLD,
+        FORCED,
+        ERROR,
+    };
+
+    struct Stats
+    {
+        uint32_t motion = 0;
+        uint32_t held = 0;
+        uint32_t forced = 0;
+        uint32_t skipped = 0;
+        uint32_t errors = 0;
+        float lastChangedPercent = 0;
+    };
+
+    inline uint8_t* luma = nullptr;
+    inline uint16_t* background = nullptr; // luma << 8
+    inline IMAGE_UTIL::ImageDimensions backgroundDimensions{};
+    inline bool backgroundValid = false;
+
+    inline Stats stats{};
+    inline unsigned long lastActive = 0;
+    inline unsigned long lastForced = 0;
+
+    inline bool setup()
+    {
+        luma = (uint8_t*) ps_malloc(MOTION_GATE_MAX_PIXELS);
+        background = (uint16_t*) ps_malloc(MOTION_GATE_MAX_PIXELS * sizeof(uint16_t));
+        return luma != nullptr && background != nullptr;
+    }
+
+    inline void reset()
+    {
+        backgroundValid = false;
+    }
+
+    // Call when the model found something, keeps inference running for a while even if the scene stops moving
+    inline void markActive()
+    {
+        lastActive = millis();
+    }
+
+    // Percentage of pixels that differ from the background, updates the background. Negative on error
+    inline float changedPercent(uint8_t* image, size_t imageLen)
+    {
+        IMAGE_UTIL::ImageDimensions dimensions{};
+        IMAGE_UTIL::Status status;
+        {
+            InferenceUtil::InferenceLock lock;
+            status = JPEG_DEC_UTIL::jpegToLuma(image, imageLen, luma, MOTION_GATE_MAX_PIXELS, dimensions, JPEG_IMAGE_SCALE_1_8);
+        }
+
+        if (status != IMAGE_UTIL::OK)
+        {
+            return -1;
+        }
+
+        size_t pixels = (size_t) dimensions.width * dimensions.height;
+        if (!backgroundValid ||
+            dimensions.width != backgroundDimensions.width ||
+            dimensions.height != backgroundDimensions.height)
+        {
+            for (size_t i = 0; i < pixels; i++)
+            {
+                background[i] = luma[i] << 8;
+            }
+
+            backgroundDimensions = dimensions;
+            backgroundValid = true;
+            return 100;
+        }
+
+        size_t changed = 0;
+        for (size_t i = 0; i < pixels; i++)
+        {
+            int current = luma[i] << 8;
+            int diff = current - background[i];
+            if (abs(diff) > (MOTION_GATE_PIXEL_DELTA << 8))
+            {
+                changed++;
+            }
+
+            background[i] += diff >> MOTION_GATE_BACKGROUND_SHIFT;
+        }
+
+        return changed * 100.0f / pixels;
+    }
+
+    /*
+     * Decides whether the frame is worth running the model on.
+     * thresholdPercent is the share of changed pixels needed to count as motion, 0 or less disables the gate.
+     */
+    inline Decision check(uint8_t* image, size_t imageLen, float thresholdPercent)
+    {
+        if (thresholdPercent <= 0 || luma == nullptr || background == nullptr)
+        {
+            stats.motion++;
+            return MOTION;
+        }
+
+        float changed = changedPercent(image, imageLen);
+        if (changed < 0)
+        {
+            stats.errors++;
+            return ERROR;
+        }
+        stats.lastChangedPercent = changed;
+
+        unsigned long now = millis();
+        if (changed >= thresholdPercent)
+        {
+            stats.motion++;
+            return MOTION;
+        }
+
+        if (lastActive != 0 && now - lastActive < MOTION_GATE_HOLD_MS)
+        {
+            stats.held++;
+            return HOLD;
+        }
+
+        if (now - lastForced >= MOTION_GATE_FORCE_INTERVAL_MS)
+        {
+            lastForced = now;
+            stats.forced++;
+            return FORCED;
+        }
+
+        stats.skipped++;
+        return SKIP;
+    }
+}
+
+#endif //MOTION_GATE_H
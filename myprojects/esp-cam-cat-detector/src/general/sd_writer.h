@@ -0,0 +1,320 @@
+#ifndef SD_WRITER_H
+#define SD_WRITER_H
+
+#include <SD_MMC.h>
+#include <esp_random.h>
+
+#include <general/log.h>
+#include <general/latency_stats.h>
+
+#define SD_WRITER_QUEUE_DEPTH 3 // also the largest batch, SD_MMC keeps 5 files open by default and FTP needs some
+#define SD_WRITER_MAX_FILE (256 * 1024) // an SXGA JPEG with room to spare
+#define SD_WRITER_MAX_PATH 128
+#define SD_WRITER_MAX_FOLDERS 8
+#define SD_WRITER_SPACE_REFRESH_MS (5 * 60 * 1000)
+#define SD_WRITER_SPACE_MARGIN (1024 * 1024)
+
+/*
+ * Background writer for the SD card, so slow card operations never run on the inference task.
+ *
+ * Files are copied into one of SD_WRITER_QUEUE_DEPTH PSRAM buffers and queued, a writer task on core 0 drains the
+ * queue. Whatever is waiting when it wakes is written as one batch: the files are written back to back and only
+ * closed once all of them are, so their directory and FAT updates are flushed together. Free space is queried
+ * once and then tracked from the bytes written, with a periodic refresh, and folders that exist are remembered.
+ * When every buffer is in use the file is dropped, unless the caller chose to wait. Stats are updated from the
+ * calling tasks and the writer, always under statsLock.
+ */
+namespace SdWriter
+{
+    struct Job
+    {
+        char path[SD_WRITER_MAX_PATH];
+        uint8_t* buf;
+        size_t len;
+    };
+
+    struct Stats
+    {
+        uint32_t queued = 0;
+        uint32_t written = 0;
+        uint32_t dropped = 0; // no free buffer or too large
+        uint32_t failed = 0;
+        uint32_t noSpace = 0;
+        uint32_t depth = 0;
+        uint32_t maxDepth = 0;
+        uint64_t bytes = 0;
+        uint32_t batches = 0;
+        uint32_t maxBatch = 0; // most files written in one batch
+        uint32_t lastWriteMs = 0; // of the whole batch
+        uint32_t maxWriteMs = 0;
+        uint64_t freeBytes = 0;
+    };
+
+    inline Stats stats{};
+    inline portMUX_TYPE statsLock = portMUX_INITIALIZER_UNLOCKED;
+    inline uint64_t freeBytes = 0; // the writer's own figure, copied into stats
+    inline QueueHandle_t jobs = nullptr;
+    inline QueueHandle_t freeBuffers = nullptr;
+    inline TaskHandle_t taskHandle = nullptr;
+
+    inline char folders[SD_WRITER_MAX_FOLDERS][SD_WRITER_MAX_PATH]{};
+    inline size_t folderCount = 0;
+    inline unsigned long spaceCheckedAt = 0;
+
+    /*
+     * Capture time for file and folder names, with millis() appended so names within the same second don't collide.
+     * Until NTP has set the clock the date is replaced by a random id drawn once per boot, as millis() restarts.
+     */
+    inline int timestamp(char* buf, size_t len)
+    {
+        tm info{};
+        if (!getLocalTime(&info, 0))
+        {
+            static uint32_t bootId = esp_random();
+            return snprintf(buf, len, "boot_%08lx__%lu", (unsigned long) bootId, millis());
+        }
+
+        return snprintf(buf,
+            len,
+            "%d_%d_%d__%d_%d_%d__%lu",
+            info.tm_year + 1900,
+            info.tm_mon + 1,
+            info.tm_mday,
+            info.tm_hour,
+            info.tm_min,
+            info.tm_sec,
+            millis());
+    }
+
+    inline void refreshFreeSpace()
+    {
+        freeBytes = SD_MMC.totalBytes() - SD_MMC.usedBytes();
+        spaceCheckedAt = millis();
+    }
+
+    // Whether len bytes fit, refreshing the free space when it is stale or looks too low
+    inline bool hasSpace(size_t len)
+    {
+        if (millis() - spaceCheckedAt > SD_WRITER_SPACE_REFRESH_MS || freeBytes < len + SD_WRITER_SPACE_MARGIN)
+        {
+            refreshFreeSpace();
+        }
+        return freeBytes >= len + SD_WRITER_SPACE_MARGIN;
+    }
+
+    // Creates the folder of path if it isn't known to exist yet, it is only remembered once it does
+    inline void ensureFolder(const char* path)
+    {
+        const char* slash = strrchr(path, '/');
+        if (slash == nullptr || slash == path)
+        {
+            return;
+        }
+
+        char folder[SD_WRITER_MAX_PATH]{};
+        memcpy(folder, path, slash - path);
+
+        for (size_t i = 0; i < folderCount; i++)
+        {
+            if (strcmp(folders[i], folder) == 0)
+            {
+                return;
+            }
+        }
+
+        if (!SD_MMC.exists(folder) && !SD_MMC.mkdir(folder))
+        {
+            MLOGF("Could not create folder %s.\n", folder);
+            return;
+        }
+
+        if (folderCount < SD_WRITER_MAX_FOLDERS)
+        {
+            snprintf(folders[folderCount++], SD_WRITER_MAX_PATH, "%s", folder);
+        }
+    }
+
+    inline void writeBatch(const Job* batch, size_t count)
+    {
+        LatencyStats::ScopedTimer timer(LatencyStats::SD_SAVE);
+        unsigned long start = millis();
+
+        File files[SD_WRITER_QUEUE_DEPTH];
+        size_t written[SD_WRITER_QUEUE_DEPTH]{};
+        bool attempted[SD_WRITER_QUEUE_DEPTH]{};
+        uint32_t noSpace = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            const Job& job = batch[i];
+            if (!hasSpace(job.len))
+            {
+                noSpace++;
+                MLOGN("Can't save file, sd card has no free space.");
+                continue;
+            }
+
+            ensureFolder(job.path);
+            files[i] = SD_MMC.open(job.path, FILE_WRITE);
+            written[i] = files[i] ? files[i].write(job.buf, job.len) : 0;
+            attempted[i] = true;
+            freeBytes -= std::min<uint64_t>(freeBytes, written[i]);
+        }
+
+        uint32_t done = 0;
+        uint32_t failed = 0;
+        uint64_t bytes = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (files[i])
+            {
+                files[i].close();
+            }
+
+            if (!attempted[i])
+            {
+                continue;
+            }
+
+            if (written[i] != batch[i].len)
+            {
+                failed++;
+                MLOGF("Failed to write %s.\n", batch[i].path);
+                continue;
+            }
+
+            done++;
+            bytes += written[i];
+        }
+
+        uint32_t elapsed = millis() - start;
+        portENTER_CRITICAL(&statsLock);
+        stats.written += done;
+        stats.failed += failed;
+        stats.noSpace += noSpace;
+        stats.bytes += bytes;
+        stats.batches++;
+        stats.maxBatch = std::max<uint32_t>(stats.maxBatch, count);
+        stats.lastWriteMs = elapsed;
+        stats.maxWriteMs = std::max(stats.maxWriteMs, elapsed);
+        stats.freeBytes = freeBytes;
+        portEXIT_CRITICAL(&statsLock);
+    }
+
+    inline void writerTask(void* args)
+    {
+        Job batch[SD_WRITER_QUEUE_DEPTH]{};
+        while (true)
+        {
+            if (xQueueReceive(jobs, &batch[0], portMAX_DELAY) != pdTRUE)
+            {
+                continue;
+            }
+
+            // Never waits for more, a batch is only what piled up while the card was busy
+            size_t count = 1;
+            while (count < SD_WRITER_QUEUE_DEPTH && xQueueReceive(jobs, &batch[count], 0) == pdTRUE)
+            {
+                count++;
+            }
+
+            writeBatch(batch, count);
+            for (size_t i = 0; i < count; i++)
+            {
+                xQueueSend(freeBuffers, &batch[i].buf, 0);
+            }
+
+            uint32_t depth = uxQueueMessagesWaiting(jobs);
+            portENTER_CRITICAL(&statsLock);
+            stats.depth = depth;
+            portEXIT_CRITICAL(&statsLock);
+        }
+    }
+
+    // Call once the card is mounted
+    inline bool setup()
+    {
+        if (taskHandle != nullptr)
+        {
+            return true;
+        }
+
+        jobs = xQueueCreate(SD_WRITER_QUEUE_DEPTH, sizeof(Job));
+        freeBuffers = xQueueCreate(SD_WRITER_QUEUE_DEPTH, sizeof(uint8_t*));
+        if (jobs == nullptr || freeBuffers == nullptr)
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < SD_WRITER_QUEUE_DEPTH; i++)
+        {
+            auto buf = (uint8_t*) ps_malloc(SD_WRITER_MAX_FILE);
+            if (buf == nullptr)
+            {
+                MLOGN("Could not allocate sd writer buffers.");
+                return false;
+            }
+            xQueueSend(freeBuffers, &buf, 0);
+        }
+
+        refreshFreeSpace();
+        stats.freeBytes = freeBytes;
+        return xTaskCreatePinnedToCore(writerTask, "sdwritertask", 4096, nullptr, 1, &taskHandle, 0) == pdPASS;
+    }
+
+    // Copies data and queues it to be written to path, waiting up to wait for a free buffer. False if it was dropped
+    inline bool enqueue(const char* path, const uint8_t* data, size_t len, TickType_t wait = 0)
+    {
+        uint8_t* buf = nullptr;
+        if (taskHandle == nullptr || len > SD_WRITER_MAX_FILE || xQueueReceive(freeBuffers, &buf, wait) != pdTRUE)
+        {
+            portENTER_CRITICAL(&statsLock);
+            stats.dropped++;
+            portEXIT_CRITICAL(&statsLock);
+            return false;
+        }
+
+        Job job{};
+        snprintf(job.path, sizeof(job.path), "%s", path);
+        memcpy(buf, data, len);
+        job.buf = buf;
+        job.len = len;
+
+        // Can't fail, there are as many queue slots as buffers
+        xQueueSend(jobs, &job, 0);
+
+        uint32_t depth = uxQueueMessagesWaiting(jobs);
+        portENTER_CRITICAL(&statsLock);
+        stats.queued++;
+        stats.depth = depth;
+        stats.maxDepth = std::max(stats.maxDepth, depth);
+        portEXIT_CRITICAL(&statsLock);
+        return true;
+    }
+
+    inline size_t toJson(char* buf, size_t len)
+    {
+        portENTER_CRITICAL(&statsLock);
+        Stats copy = stats;
+        portEXIT_CRITICAL(&statsLock);
+
+        return snprintf(buf, len,
+                        "{\"queued\":%lu,\"written\":%lu,\"dropped\":%lu,\"failed\":%lu,\"noSpace\":%lu,\"depth\":%lu,"
+                        "\"maxDepth\":%lu,\"bytes\":%llu,\"batches\":%lu,\"maxBatch\":%lu,\"lastWriteMs\":%lu,"
+                        "\"maxWriteMs\":%lu,\"freeBytes\":%llu}",
+                        (unsigned long) copy.queued,
+                        (unsigned long) copy.written,
+                        (unsigned long) copy.dropped,
+                        (unsigned long) copy.failed,
+                        (unsigned long) copy.noSpace,
+                        (unsigned long) copy.depth,
+                        (unsigned long) copy.maxDepth,
+                        (unsigned long long) copy.bytes,
+                        (unsigned long) copy.batches,
+                        (unsigned long) copy.maxBatch,
+                        (unsigned long) copy.lastWriteMs,
+                        (unsigned long) copy.maxWriteMs,
+                        (unsigned long long) copy.freeBytes);
+    }
+}
+
+#endif //SD_WRITER_H
@@ -0,0 +1,443 @@
+#ifndef STREAM_BROADCASTER_H
+#define STREAM_BROADCASTER_H
+
+#include <esp_http_server.h>
+
+#include <general/cam_config.h>
+#include <general/inference_util.h>
+#include <general/jpeg_util.h>
+
+#define STREAM_MAX_CLIENTS 4
+#define STREAM_FRAME_BUFFERS (STREAM_MAX_CLIENTS * 2 + 2) // one being sent and one waiting per client, two being published
+#define STREAM_FRAME_CAPACITY (128 * 1024) // a VGA JPEG at the sensor quality
+#define STREAM_CLIENT_STACK 6144
+#define STREAM_CLIENT_TIMEOUT_MS 5000
+#define STREAM_OVERLAY_QUALITY 90
+
+/*
+ * MJPEG stream shared by every viewer.
+ *
+ * A single task captures each frame and, when an annotated viewer is subscribed, runs the model and encodes the
+ * overlay, once per frame whatever the viewer count. Frames are published as reference counted PSRAM buffers to
+ * every subscribed client. Each client has its own sender task holding a single waiting frame, so a slow client
+ * only drops its own frames: a new frame replaces the one it hasn't started sending yet.
+ *
+ * Clients are detached from the HTTP server with the async request API, the handler returns right away and the
+ * server keeps serving other requests. This needs the raw esp_http_server request, so it only builds against an
+ * ESP_CONFIG_PAGE whose REQUEST_T is httpd_req_t*, config_page_setup.h asserts that. The first viewer picks the
+ * camera resolution and frame rate, the broadcast task is the only one applying them, so a viewer joining while
+ * the last one leaves can't have its resolution reset to the idle one.
+ */
+namespace StreamBroadcaster
+{
+    struct Frame
+    {
+        uint8_t* data = nullptr;
+        size_t len = 0;
+        int refs = 0;
+    };
+
+    struct Client
+    {
+        bool used = false;
+        bool annotated = false;
+        bool sending = false; // has a sender task, set once it is created
+        httpd_req_t* req = nullptr;
+        SemaphoreHandle_t frameReady = nullptr; // created once per slot, outlives the sender tasks
+        Frame* pending = nullptr;
+        uint32_t sent = 0;
+        uint32_t dropped = 0;
+    };
+
+    struct Stats
+    {
+        uint32_t published = 0;
+        uint32_t encoded = 0;
+        uint32_t sent = 0;
+        uint32_t dropped = 0; // replaced before a client got to send them
+        uint32_t noBuffer = 0;
+        uint32_t oversize = 0; // camera frames larger than STREAM_FRAME_CAPACITY
+    };
+
+    inline Frame frames[STREAM_FRAME_BUFFERS]{};
+    inline Client clients[STREAM_MAX_CLIENTS]{};
+    inline Stats stats{};
+    inline portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+    inline TaskHandle_t broadcastHandle = nullptr;
+    inline volatile int clientCount = 0;
+    inline int frameIntervalMs = 1000;
+    inline framesize_t idleFramesize = FRAMESIZE_SXGA;
+    inline framesize_t streamFramesize = FRAMESIZE_VGA; // picked by the first viewer
+    inline bool reconfigure = false; // streamFramesize changed, applied by the broadcast task
+
+    inline bool active()
+    {
+        return clientCount > 0;
+    }
+
+    inline bool setup(framesize_t restoreFramesize)
+    {
+        idleFramesize = restoreFramesize;
+        for (Client& client : clients)
+        {
+            client.frameReady = xSemaphoreCreateBinary();
+            if (client.frameReady == nullptr)
+            {
+                return false;
+            }
+        }
+
+        for (Frame& frame : frames)
+        {
+            frame.data = (uint8_t*) ps_malloc(STREAM_FRAME_CAPACITY);
+            if (frame.data == nullptr)
+            {
+                MLOGN("Could not allocate stream frame buffers.");
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Free buffer with a single reference owned by the caller, nullptr when every buffer is still being sent
+    inline Frame* takeFreeFrame()
+    {
+        Frame* free = nullptr;
+        portENTER_CRITICAL(&lock);
+        for (Frame& frame : frames)
+        {
+            if (frame.data != nullptr && frame.refs == 0)
+            {
+                frame.refs = 1;
+                frame.len = 0;
+                free = &frame;
+                break;
+            }
+        }
+        portEXIT_CRITICAL(&lock);
+        return free;
+    }
+
+    inline void release(Frame* frame)
+    {
+        if (frame == nullptr)
+        {
+            return;
+        }
+
+        portENTER_CRITICAL(&lock);
+        frame->refs--;
+        portEXIT_CRITICAL(&lock);
+    }
+
+    // Hands the frame to every client of the given kind and drops the caller's reference
+    inline void publish(Frame* frame, bool annotated)
+    {
+        for (Client& client : clients)
+        {
+            Frame* replaced = nullptr;
+
+            portENTER_CRITICAL(&lock);
+            bool matches = client.used && client.sending && client.annotated == annotated;
+            if (matches)
+            {
+                replaced = client.pending;
+                client.pending = frame;
+                frame->refs++;
+                if (replaced != nullptr)
+                {
+                    client.dropped++;
+                    stats.dropped++;
+                }
+            }
+            portEXIT_CRITICAL(&lock);
+
+            release(replaced);
+            if (matches)
+            {
+                xSemaphoreGive(client.frameReady);
+            }
+        }
+
+        stats.published++;
+        release(frame);
+    }
+
+    inline bool hasClients(bool annotated)
+    {
+        bool found = false;
+        portENTER_CRITICAL(&lock);
+        for (const Client& client : clients)
+        {
+            found |= client.used && client.annotated == annotated;
+        }
+        portEXIT_CRITICAL(&lock);
+        return found;
+    }
+
+    inline void publishRaw(const camera_fb_t* fb)
+    {
+        if (fb->len > STREAM_FRAME_CAPACITY)
+        {
+            if (stats.oversize++ == 0)
+            {
+                MLOGF("Stream frame of %zu bytes is over the %d byte buffers, dropping oversize frames.\n", fb->len, STREAM_FRAME_CAPACITY);
+            }
+            return;
+        }
+
+        Frame* frame = takeFreeFrame();
+        if (frame == nullptr)
+        {
+            stats.noBuffer++;
+            return;
+        }
+
+        memcpy(frame->data, fb->buf, fb->len);
+        frame->len = fb->len;
+        publish(frame, false);
+    }
+
+    inline void publishAnnotated(const camera_fb_t* fb)
+    {
+        Frame* frame = takeFreeFrame();
+        if (frame == nullptr)
+        {
+            stats.noBuffer++;
+            return;
+        }
+
+        uint8_t* processed = nullptr;
+        size_t processedLen = 0;
+        InferenceUtil::InferenceOutput output{};
+        InferenceUtil::runInferenceFromImage(output, fb->buf, fb->len, &processed, &processedLen);
+
+        bool encoded = false;
+        if (processed != nullptr)
+        {
+            InferenceUtil::drawMarkers(output, processed);
+            encoded = JPEG_UTIL::rgb888ToJpeg(processed,
+                                              processedLen,
+                                              MODEL_INPUT_WIDTH,
+                                              MODEL_INPUT_HEIGHT,
+                                              STREAM_OVERLAY_QUALITY,
+                                              frame->data,
+                                              STREAM_FRAME_CAPACITY,
+                                              &frame->len);
+            BufferPool::giveBack(processed);
+        }
+
+        if (!encoded)
+        {
+            release(frame);
+            return;
+        }
+
+        stats.encoded++;
+        publish(frame, true);
+    }
+
+    inline void broadcastTask(void* args)
+    {
+        TickType_t lastWake = xTaskGetTickCount();
+        bool streaming = false;
+
+        while (true)
+        {
+            portENTER_CRITICAL(&lock);
+            bool watched = clientCount > 0;
+            bool changed = reconfigure;
+            reconfigure = false;
+            framesize_t framesize = streamFramesize;
+            int intervalMs = frameIntervalMs;
+            portEXIT_CRITICAL(&lock);
+
+            if (!watched)
+            {
+                if (streaming)
+                {
+                    CamConfig::setRes(idleFramesize);
+                    streaming = false;
+                }
+
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                lastWake = xTaskGetTickCount();
+                continue;
+            }
+
+            if (changed || !streaming)
+            {
+                CamConfig::setRes(framesize);
+                streaming = true;
+            }
+
+            camera_fb_t* fb = esp_camera_fb_get();
+            if (fb != nullptr)
+            {
+                if (hasClients(false))
+                {
+                    publishRaw(fb);
+                }
+
+                if (hasClients(true))
+                {
+                    publishAnnotated(fb);
+                }
+
+                esp_camera_fb_return(fb);
+            }
+
+            vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(intervalMs));
+        }
+    }
+
+    inline void clientTask(void* args)
+    {
+        auto client = (Client*) args;
+        httpd_req_t* req = client->req;
+
+        httpd_resp_set_type(req, "multipart/x-mixed-replace; boundary=frame");
+        httpd_resp_set_hdr(req, "cache-control", "no-cache");
+
+        bool first = true;
+        char headerBuf[128]{};
+        while (true)
+        {
+            if (xSemaphoreTake(client->frameReady, pdMS_TO_TICKS(STREAM_CLIENT_TIMEOUT_MS)) != pdTRUE)
+            {
+                MLOGN("Stream client got no frame in time, closing.");
+                break;
+            }
+
+            portENTER_CRITICAL(&lock);
+            Frame* frame = client->pending;
+            client->pending = nullptr;
+            portEXIT_CRITICAL(&lock);
+
+            if (frame == nullptr)
+            {
+                continue;
+            }
+
+            snprintf(headerBuf,
+                     sizeof(headerBuf),
+                     "%s--frame\r\n"
+                     "Content-Type: image/jpeg\r\n"
+                     "Content-Length: %u\r\n\r\n",
+                     first ? "" : "\r\n",
+                     frame->len);
+
+            bool ok = httpd_resp_send_chunk(req, headerBuf, strlen(headerBuf)) == ESP_OK &&
+                httpd_resp_send_chunk(req, (const char*) frame->data, frame->len) == ESP_OK;
+            release(frame);
+
+            if (!ok)
+            {
+                break;
+            }
+
+            first = false;
+            client->sent++;
+            stats.sent++;
+        }
+
+        portENTER_CRITICAL(&lock);
+        Frame* pending = client->pending;
+        client->pending = nullptr;
+        client->used = false;
+        client->sending = false;
+        clientCount--;
+        portEXIT_CRITICAL(&lock);
+
+        release(pending);
+        httpd_resp_send_chunk(req, nullptr, 0);
+        httpd_req_async_handler_complete(req);
+        MLOGN("Stream client left.");
+        vTaskDelete(nullptr);
+    }
+
+    inline bool start()
+    {
+        if (broadcastHandle != nullptr)
+        {
+            return true;
+        }
+
+        // Below the inference task, an annotated stream runs the model itself while live inference is paused
+        return xTaskCreatePinnedToCore(broadcastTask, "streamtask", 8192, nullptr, 2, &broadcastHandle, 1) == pdPASS;
+    }
+
+    /*
+     * Detaches the request from the server and starts streaming to it. framesize and intervalMs only apply when
+     * this is the first viewer. Returns false when every client slot is taken.
+     */
+    inline bool subscribe(httpd_req_t* req, bool annotated, framesize_t framesize, int intervalMs)
+    {
+        Client* client = nullptr;
+
+        portENTER_CRITICAL(&lock);
+        for (Client& c : clients)
+        {
+            if (!c.used)
+            {
+                bool first = clientCount == 0;
+                client = &c;
+                client->used = true;
+                client->sending = false;
+                client->pending = nullptr;
+                client->sent = 0;
+                client->dropped = 0;
+                client->annotated = annotated;
+                if (first)
+                {
+                    streamFramesize = framesize;
+                    frameIntervalMs = intervalMs;
+                    reconfigure = true;
+                }
+                clientCount++;
+                break;
+            }
+        }
+        portEXIT_CRITICAL(&lock);
+
+        if (client == nullptr)
+        {
+            return false;
+        }
+
+        httpd_req_t* detached = nullptr;
+        if (httpd_req_async_handler_begin(req, &detached) != ESP_OK)
+        {
+            portENTER_CRITICAL(&lock);
+            client->used = false;
+            clientCount--;
+            portEXIT_CRITICAL(&lock);
+            return false;
+        }
+
+        client->req = detached;
+
+        xSemaphoreTake(client->frameReady, 0);
+        if (xTaskCreatePinnedToCore(clientTask, "streamclient", STREAM_CLIENT_STACK, client, 1, nullptr, 0) != pdPASS)
+        {
+            portENTER_CRITICAL(&lock);
+            client->used = false;
+            clientCount--;
+            portEXIT_CRITICAL(&lock);
+            httpd_req_async_handler_complete(detached);
+            return false;
+        }
+
+        portENTER_CRITICAL(&lock);
+        client->sending = true;
+        portEXIT_CRITICAL(&lock);
+
+        xTaskNotifyGive(broadcastHandle);
+        MLOGF("Stream client joined, %d watching.\n", clientCount);
+        return true;
+    }
+}
+
+#endif //STREAM_BROADCASTER_H
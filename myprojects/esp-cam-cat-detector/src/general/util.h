@@ -5,17 +5,7 @@
 #ifndef UTIL_H
 #define UTIL_H
 
-#ifdef ENABLE_LOGGING
-#define MLOG(str) Serial.print(str)
-#define MLOGN(str) Serial.println(str)
-#define MLOGF(str, p...) Serial.printf(str, p)
-#define MVLOGF(str, p...) Serial.vprintf(str, p)
-#else
-#define MLOG(str)
-#define MLOGN(str)
-#define MLOGF(str, p...)
-#define MVLOGF(str, p...)
-#endif
+#include <general/log.h>
 
 #define CAM_FLASH_PIN 21
 #define ACTION_PIN 47
@@ -23,12 +13,14 @@
 // #define LUM_AFFECTS_WIFI
 #include <esp_camera.h>
 #include <SD_MMC.h>
+#include <general/sd_writer.h>
 
 #include "iot_setup.h"
 
 constexpr uint32_t LUM_FLOOR = 128;
 constexpr uint32_t LUM_CEIL  = 2200;
 inline volatile bool sdInit = false;
+inline volatile bool flashOn = false;
 
 inline float normalizeLum(uint32_t raw)
 {
@@ -73,6 +65,7 @@ inline void toggleFlash(bool on)
 {
     Serial.printf("FLASH: %s\n", on ? "ON" : "OFF");
     digitalWrite(CAM_FLASH_PIN, on ? HIGH : LOW);
+    flashOn = on;
 }
 
 inline void setupPins()
@@ -93,47 +86,30 @@ inline void testRun()
     toggleFlash(false);
 }
 
+// Queues the frame for the sd writer task, named after the capture time and trigger certainty
 inline void saveImg(camera_fb_t *fb, float average, const char *folder)
 {
-    vTaskDelay(1);
-
     if (!IotProperties::isSavingOn())
     {
         return;
     }
 
-    if (sdInit && (SD_MMC.totalBytes() - SD_MMC.usedBytes() + 32) > fb->len)
+    if (!sdInit)
     {
-        tm info{};
-        getLocalTime(&info);
-
-        char nameBuf[150]{};
-        snprintf(nameBuf,
-            sizeof(nameBuf),
-            "%s/%d_%d_%d__%d_%d_%d__a_%d.jpg",
-            folder,
-            info.tm_year + 1900,
-            info.tm_mon + 1,
-            info.tm_mday,
-            info.tm_hour,
-            info.tm_min,
-            info.tm_sec,
-            (int) (average * 100));
-
-        if (!SD_MMC.exists(folder))
-        {
-            SD_MMC.mkdir(folder);
-        }
+        MLOGN("Can't save image, sd card not mounted.");
+        return;
+    }
 
-        MLOGF("Saving image to: %s\n", nameBuf);
+    char stamp[48]{};
+    SdWriter::timestamp(stamp, sizeof(stamp));
 
-        File file = SD_MMC.open(nameBuf, FILE_WRITE);
-        file.write(fb->buf, fb->len);
-        file.close();
-    }
-    else
+    char nameBuf[150]{};
+    snprintf(nameBuf, sizeof(nameBuf), "%s/%s__a_%d.jpg", folder, stamp, (int) (average * 100));
+
+    MLOGF("Saving image to: %s\n", nameBuf);
+    if (!SdWriter::enqueue(nameBuf, fb->buf, fb->len))
     {
-        MLOGN("Can't save image, sd card not mounted or has no free space.");
+        MLOGN("Sd writer is busy, image dropped.");
     }
 }
 
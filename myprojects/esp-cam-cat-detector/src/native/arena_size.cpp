@@ -0,0 +1,175 @@
+/*
+ * Measures the tensor arena the embedded model really needs and writes it into model_data.h.
+ *
+ * The model is allocated and invoked once with RecordingMicroInterpreter on an oversized arena, then the used
+ * bytes plus a margin are written as MODEL_DATA_ARENA_SIZE, which ModelUtil::arenaSize picks up over its
+ * size heuristic. Persistent allocations hold pointers, so a 64 bit host measures slightly more than the
+ * ESP32 needs, while the optimized device kernels may ask for scratch buffers the reference kernels don't,
+ * which is what the margin is for. The device logs the real usage on every load.
+ *
+ * The persistent and non-persistent parts are also written separately as MODEL_DATA_PERSISTENT_ARENA_SIZE and
+ * MODEL_DATA_NONPERSISTENT_ARENA_SIZE, which size the two arenas when ModelUtil is built with MODEL_SPLIT_ARENA.
+ *
+ * This is a required step after generating model_data.h, the one in the tree has no measured sizes yet, so the
+ * device still sizes its arenas from the heuristic. TFLM is linked the same way as pipeline_bench.cpp. Build and
+ * run with:
+ *   pio run -e native_arena
+ *   .pio/build/native_arena/program src/general/model_data.h [margin percent, default 10]
+ * Add -DMODEL_IS_GRAYSCALE to the build flags to measure model_data_gray.h instead, once one has been generated,
+ * no grayscale model is in the tree yet.
+ */
+
+#include "host_shim.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tensorflow/lite/micro/recording_micro_interpreter.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+#ifdef MODEL_IS_GRAYSCALE
+#include "../general/model_data_gray.h"
+#else
+#include "../general/model_data.h"
+#endif
+
+constexpr size_t probeArenaSize = 8 * 1024 * 1024;
+constexpr size_t arenaRounding = 1024;
+constexpr const char* arenaDefine = "#define MODEL_DATA_ARENA_SIZE";
+constexpr const char* persistentDefine = "#define MODEL_DATA_PERSISTENT_ARENA_SIZE";
+constexpr const char* nonPersistentDefine = "#define MODEL_DATA_NONPERSISTENT_ARENA_SIZE";
+constexpr const char* insertAfter = "#define MODEL_DATA_DISTINCT_OPS_COUNT";
+
+alignas(16) static uint8_t arena[probeArenaSize];
+
+typedef std::vector<std::pair<const char*, size_t>> Defines;
+
+size_t withMargin(size_t used, int margin)
+{
+    size_t size = used * (100 + margin) / 100;
+    return (size + arenaRounding - 1) / arenaRounding * arenaRounding;
+}
+
+bool isDefine(const std::string& line, const Defines& defines)
+{
+    for (const auto& define : defines)
+    {
+        // Match the whole name so MODEL_DATA_ARENA_SIZE doesn't catch longer names and the other way round
+        if (line.rfind(std::string(define.first) + " ", 0) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool writeArenaSizes(const std::string& path, const Defines& defines)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        return false;
+    }
+
+    std::stringstream out;
+    std::string line;
+    bool written = false;
+    while (std::getline(in, line))
+    {
+        if (isDefine(line, defines))
+        {
+            continue;
+        }
+
+        out << line << "\n";
+        if (!written && line.rfind(insertAfter, 0) == 0)
+        {
+            for (const auto& define : defines)
+            {
+                out << define.first << " " << define.second << "\n";
+            }
+            written = true;
+        }
+    }
+    in.close();
+
+    if (!written)
+    {
+        return false;
+    }
+
+    std::ofstream file(path);
+    file << out.str();
+    return (bool) file;
+}
+
+int main(int argc, char** argv)
+{
+    int margin = argc > 2 ? atoi(argv[2]) : 10;
+
+    const tflite::Model* model = tflite::GetModel(model_data::tflite);
+    if (model->version() != TFLITE_SCHEMA_VERSION)
+    {
+        printf("Model schema version %lu is not supported.\n", (unsigned long) model->version());
+        return 1;
+    }
+
+    static tflite::MicroMutableOpResolver<MODEL_DATA_DISTINCT_OPS_COUNT> opResolver;
+    model_data::RegisterOps(opResolver);
+
+    tflite::RecordingMicroInterpreter interpreter(model, opResolver, arena, probeArenaSize);
+    if (interpreter.AllocateTensors() != kTfLiteOk)
+    {
+        printf("AllocateTensors() failed with a %zu byte arena.\n", probeArenaSize);
+        return 1;
+    }
+
+    // Kernels may still request scratch memory on their first run
+    if (interpreter.Invoke() != kTfLiteOk)
+    {
+        printf("Invoke() failed.\n");
+        return 1;
+    }
+
+    interpreter.GetMicroAllocator().PrintAllocations();
+
+    size_t used = interpreter.arena_used_bytes();
+    size_t arenaSize = withMargin(used, margin);
+
+    const auto* bufferAllocator = interpreter.GetMicroAllocator().GetSimpleMemoryAllocator();
+    size_t persistentUsed = bufferAllocator->GetPersistentUsedBytes();
+    size_t nonPersistentUsed = bufferAllocator->GetNonPersistentUsedBytes();
+
+    printf("\nArena used: %zu bytes, with %d%% margin: %zu bytes (size heuristic: %zu bytes)\n",
+           used,
+           margin,
+           arenaSize,
+           (size_t) (MODEL_DATA_MODEL_SIZE * 1.3));
+    printf("  persistent: %zu bytes, non-persistent (activations and scratch): %zu bytes\n",
+           persistentUsed,
+           nonPersistentUsed);
+
+    Defines defines = {
+        {arenaDefine, arenaSize},
+        {persistentDefine, withMargin(persistentUsed, margin)},
+        {nonPersistentDefine, withMargin(nonPersistentUsed, margin)},
+    };
+
+    if (argc > 1)
+    {
+        if (!writeArenaSizes(argv[1], defines))
+        {
+            printf("Could not write the arena sizes into %s\n", argv[1]);
+            return 1;
+        }
+
+        for (const auto& define : defines)
+        {
+            printf("Wrote \"%s %zu\" into %s\n", define.first, define.second, argv[1]);
+        }
+    }
+
+    return 0;
+}
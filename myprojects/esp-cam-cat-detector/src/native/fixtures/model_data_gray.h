@@ -0,0 +1,17 @@
+#ifndef MODEL_DATA_GRAY_H_
+#define MODEL_DATA_GRAY_H_
+
+/*
+ * Build fixture for MODEL_IS_GRAYSCALE, used by the native_gray env until a real single channel model exists.
+ *
+ * It is the embedded RGB model with its input declared single channel, so the grayscale decode and inference
+ * paths compile against the same headers the firmware uses. Loading it fails the input size check in
+ * InferenceUtil::prepareInput, the luma kernels themselves are checked by resize_bench.cpp.
+ */
+
+#include "../../general/model_data.h"
+
+#undef MODEL_DATA_INPUT_CHANNELS
+#define MODEL_DATA_INPUT_CHANNELS 1
+
+#endif //MODEL_DATA_GRAY_H_
@@ -0,0 +1,121 @@
+#ifndef HOST_SHIM_H
+#define HOST_SHIM_H
+
+/*
+ * Minimal stand-ins for the Arduino and ESP-IDF pieces used by the inference pipeline headers,
+ * so they can be compiled and run on the host. Include before any of the general/ headers.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+
+typedef enum
+{
+    JPEG_IMAGE_SCALE_0 = 0,
+    JPEG_IMAGE_SCALE_1_2,
+    JPEG_IMAGE_SCALE_1_4,
+    JPEG_IMAGE_SCALE_1_8,
+} esp_jpeg_image_scale_t;
+
+#define IRAM_ATTR
+
+inline const auto hostStartTime = std::chrono::steady_clock::now();
+
+inline unsigned long micros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - hostStartTime).count();
+}
+
+inline unsigned long millis()
+{
+    return micros() / 1000;
+}
+
+inline int64_t esp_timer_get_time()
+{
+    return micros();
+}
+
+inline uint32_t esp_cpu_get_cycle_count()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - hostStartTime).count();
+}
+
+inline void* ps_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+inline void* heap_caps_malloc(size_t size, uint32_t)
+{
+    return malloc(size);
+}
+
+struct HostSerial
+{
+    void print(const char* str)
+    {
+        fputs(str, stdout);
+    }
+
+    void println(const char* str)
+    {
+        puts(str);
+    }
+
+    int printf(const char* format, ...)
+    {
+        va_list args;
+        va_start(args, format);
+        int res = vprintf(format, args);
+        va_end(args);
+        return res;
+    }
+
+    int vprintf(const char* format, va_list args)
+    {
+        return ::vprintf(format, args);
+    }
+};
+
+inline HostSerial Serial;
+
+// The benchmark is single threaded, locks only need to compile
+struct portMUX_TYPE
+{
+};
+
+#define portMUX_INITIALIZER_UNLOCKED {}
+#define portENTER_CRITICAL(lock)
+#define portEXIT_CRITICAL(lock)
+
+typedef void* SemaphoreHandle_t;
+#define portMAX_DELAY 0xFFFFFFFF
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+    static int mutex;
+    return &mutex;
+}
+
+inline int xSemaphoreTake(SemaphoreHandle_t, uint32_t)
+{
+    return 1;
+}
+
+inline int xSemaphoreGive(SemaphoreHandle_t)
+{
+    return 1;
+}
+
+#endif //HOST_SHIM_H
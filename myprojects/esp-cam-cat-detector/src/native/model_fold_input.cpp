@@ -0,0 +1,165 @@
+/*
+ * Removes the Quantize op converting the uint8 camera input to the int8 the rest of the model runs on.
+ *
+ * The converter adds it when a model is exported with a uint8 input. Invoke then makes a full pass over the
+ * input to requantize it into a second tensor. Once it's removed the model takes the int8 tensor directly, and
+ * InferenceUtil::prepareInput builds a lookup table from the quantization of the removed input that the decoder
+ * applies to every row it resizes. The pixel scale and zero point are printed, for an embedded model add them
+ * to model_data.h after generating it from the output, for a stored one pass them to model_pack. Build and run:
+ *   pio run -e native_fold
+ *   .pio/build/native_fold/program model.tflite model_folded.tflite
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+#include "tensorflow/lite/schema/schema_generated.h"
+
+// Index of the operator reading the subgraph input, -1 if there isn't exactly one
+int findInputConsumer(const tflite::SubGraphT& subgraph, int input)
+{
+    int consumer = -1;
+    for (size_t i = 0; i < subgraph.operators.size(); i++)
+    {
+        for (int tensor : subgraph.operators[i]->inputs)
+        {
+            if (tensor == input)
+            {
+                if (consumer != -1)
+                {
+                    return -1;
+                }
+                consumer = i;
+            }
+        }
+    }
+    return consumer;
+}
+
+// Drops a tensor nothing references anymore and shifts every index after it
+void removeTensor(tflite::ModelT& model, tflite::SubGraphT& subgraph, int index)
+{
+    auto shift = [index](std::vector<int32_t>& indices)
+    {
+        for (int32_t& tensor : indices)
+        {
+            if (tensor > index)
+            {
+                tensor--;
+            }
+        }
+    };
+
+    subgraph.tensors.erase(subgraph.tensors.begin() + index);
+    shift(subgraph.inputs);
+    shift(subgraph.outputs);
+    for (auto& op : subgraph.operators)
+    {
+        shift(op->inputs);
+        shift(op->outputs);
+        shift(op->intermediates);
+    }
+
+    for (auto& signature : model.signature_defs)
+    {
+        for (auto* tensors : {&signature->inputs, &signature->outputs})
+        {
+            for (auto& tensor : *tensors)
+            {
+                if ((int) tensor->tensor_index > index)
+                {
+                    tensor->tensor_index--;
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        printf("Usage: %s <model.tflite> <out.tflite>\n", argv[0]);
+        return 2;
+    }
+
+    std::ifstream in(argv[1], std::ios::binary);
+    std::vector<uint8_t> buffer(std::istreambuf_iterator<char>(in), {});
+    flatbuffers::Verifier verifier(buffer.data(), buffer.size());
+    if (buffer.empty() || !tflite::VerifyModelBuffer(verifier))
+    {
+        printf("Could not read a model from %s\n", argv[1]);
+        return 1;
+    }
+
+    std::unique_ptr<tflite::ModelT> model(tflite::GetModel(buffer.data())->UnPack());
+    if (model->subgraphs.empty() || model->subgraphs[0]->inputs.size() != 1)
+    {
+        printf("Expected a single subgraph input.\n");
+        return 1;
+    }
+
+    tflite::SubGraphT& subgraph = *model->subgraphs[0];
+    int input = subgraph.inputs[0];
+    int consumer = findInputConsumer(subgraph, input);
+    if (consumer < 0)
+    {
+        printf("The input is read by more than one operator, nothing to fold.\n");
+        return 1;
+    }
+
+    const tflite::OperatorT& op = *subgraph.operators[consumer];
+    const tflite::OperatorCodeT& code = *model->operator_codes[op.opcode_index];
+    tflite::BuiltinOperator builtin = std::max(code.builtin_code, (tflite::BuiltinOperator) code.deprecated_builtin_code);
+    if (builtin != tflite::BuiltinOperator_QUANTIZE || op.outputs.size() != 1)
+    {
+        printf("The input goes to %s, not a Quantize op.\n", tflite::EnumNameBuiltinOperator(builtin));
+        return 1;
+    }
+
+    const tflite::TensorT& pixels = *subgraph.tensors[input];
+    const tflite::TensorT& quantized = *subgraph.tensors[op.outputs[0]];
+    if (pixels.type != tflite::TensorType_UINT8 || quantized.type != tflite::TensorType_INT8 ||
+        pixels.quantization == nullptr || pixels.quantization->scale.size() != 1 || pixels.quantization->zero_point.size() != 1)
+    {
+        printf("Expected a per tensor uint8 input quantized to int8.\n");
+        return 1;
+    }
+
+    float scale = pixels.quantization->scale[0];
+    int zeroPoint = pixels.quantization->zero_point[0];
+
+    int folded = op.outputs[0];
+    subgraph.inputs[0] = folded;
+    subgraph.operators.erase(subgraph.operators.begin() + consumer);
+    for (auto& signature : model->signature_defs)
+    {
+        for (auto& tensor : signature->inputs)
+        {
+            if ((int) tensor->tensor_index == input)
+            {
+                tensor->tensor_index = folded;
+            }
+        }
+    }
+    removeTensor(*model, subgraph, input);
+
+    flatbuffers::FlatBufferBuilder builder;
+    builder.Finish(tflite::Model::Pack(builder, model.get()), tflite::ModelIdentifier());
+
+    std::ofstream out(argv[2], std::ios::binary);
+    out.write((const char*) builder.GetBufferPointer(), builder.GetSize());
+    if (!out)
+    {
+        printf("Could not write %s\n", argv[2]);
+        return 1;
+    }
+
+    printf("Wrote %s, %zu operators left.\n", argv[2], subgraph.operators.size());
+    printf("For model_data.h:\n#define MODEL_DATA_INPUT_SCALE %.9gf\n#define MODEL_DATA_INPUT_ZERO_POINT %d\n", scale, zeroPoint);
+    printf("For model_pack: --input-scale %.9g --input-zero-point %d\n", scale, zeroPoint);
+    return 0;
+}
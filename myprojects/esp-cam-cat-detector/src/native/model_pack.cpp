@@ -0,0 +1,177 @@
+/*
+ * Packs a .tflite model with the header ModelStore expects, for the model partitions or the SD card.
+ *
+ * The input dimensions are read from the model, the class table and thresholds come from the arguments in the
+ * order of the model output channels. Arena sizes are optional, arena_size prints them for a model compiled
+ * into model_data.h. The input scale and zero point are needed for models stripped by model_fold_input, which
+ * prints them. Only flatbuffers headers are needed from TFLM. Build and run with:
+ *   pio run -e native_pack
+ *   .pio/build/native_pack/program model.tflite model.bin --version 3 --class bg:1 --class cat:0.75 --class human:0.5
+ *
+ * Copy model.bin to /models/model.bin on the SD card and POST /model-install, or write it straight to a slot:
+ *   parttool.py write_partition --partition-name model_a --input model.bin
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "../general/model_format.h"
+
+bool parseClass(const char* arg, ModelFormat::Header& header)
+{
+    const char* separator = strchr(arg, ':');
+    size_t nameLen = separator != nullptr ? separator - arg : 0;
+    if (nameLen == 0 || nameLen >= MODEL_FORMAT_LABEL_LENGTH || header.classCount >= MODEL_FORMAT_MAX_CLASSES)
+    {
+        return false;
+    }
+
+    memcpy(header.classNames[header.classCount], arg, nameLen);
+    header.thresholds[header.classCount] = atof(separator + 1);
+    header.classCount++;
+    return true;
+}
+
+bool readInputShape(const std::vector<uint8_t>& model, ModelFormat::Header& header)
+{
+    const tflite::Model* parsed = tflite::GetModel(model.data());
+    if (parsed->subgraphs() == nullptr || parsed->subgraphs()->size() == 0)
+    {
+        return false;
+    }
+
+    const tflite::SubGraph* subgraph = parsed->subgraphs()->Get(0);
+    if (subgraph->inputs() == nullptr || subgraph->inputs()->size() != 1)
+    {
+        return false;
+    }
+
+    // NHWC
+    const flatbuffers::Vector<int32_t>* shape = subgraph->tensors()->Get(subgraph->inputs()->Get(0))->shape();
+    if (shape == nullptr || shape->size() != 4)
+    {
+        return false;
+    }
+
+    header.inputHeight = shape->Get(1);
+    header.inputWidth = shape->Get(2);
+    header.inputChannels = shape->Get(3);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        printf("Usage: %s <model.tflite> <out.bin> [--version n] [--arena bytes] [--persistent bytes] "
+               "[--nonpersistent bytes] [--input-scale s --input-zero-point z] --class name:threshold...\n", argv[0]);
+        return 2;
+    }
+
+    std::ifstream in(argv[1], std::ios::binary);
+    std::vector<uint8_t> model(std::istreambuf_iterator<char>(in), {});
+    if (model.empty())
+    {
+        printf("Could not read %s\n", argv[1]);
+        return 1;
+    }
+
+    ModelFormat::Header header{};
+    header.magic = MODEL_FORMAT_MAGIC;
+    header.formatVersion = MODEL_FORMAT_VERSION;
+    header.headerSize = sizeof(ModelFormat::Header);
+    header.dataOffset = MODEL_FORMAT_DATA_OFFSET;
+    header.modelSize = model.size();
+    header.modelCrc = ModelFormat::crc32(model.data(), model.size());
+
+    for (int i = 3; i < argc; i++)
+    {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--version") == 0 && hasValue)
+        {
+            header.modelVersion = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--arena") == 0 && hasValue)
+        {
+            header.arenaSize = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--persistent") == 0 && hasValue)
+        {
+            header.persistentArenaSize = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--nonpersistent") == 0 && hasValue)
+        {
+            header.nonPersistentArenaSize = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--input-scale") == 0 && hasValue)
+        {
+            header.inputScale = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--input-zero-point") == 0 && hasValue)
+        {
+            header.inputZeroPoint = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--class") == 0 && hasValue)
+        {
+            if (!parseClass(argv[++i], header))
+            {
+                printf("Invalid class %s, expected name:threshold with a name under %d characters.\n", argv[i], MODEL_FORMAT_LABEL_LENGTH);
+                return 2;
+            }
+        }
+        else
+        {
+            printf("Unknown argument %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    ModelFormat::Status status = ModelFormat::validateModel(header, model.data());
+    if (status != ModelFormat::OK)
+    {
+        printf("%s is not a valid model: %s\n", argv[1], ModelFormat::statusName(status));
+        return 1;
+    }
+
+    if (!readInputShape(model, header))
+    {
+        printf("Could not read a single NHWC input from %s\n", argv[1]);
+        return 1;
+    }
+
+    header.headerCrc = ModelFormat::headerCrc(header);
+
+    status = ModelFormat::validateHeader(header, header.dataOffset + header.modelSize);
+    if (status != ModelFormat::OK)
+    {
+        printf("Invalid header: %s\n", ModelFormat::statusName(status));
+        return 1;
+    }
+
+    std::vector<uint8_t> out(header.dataOffset + header.modelSize, 0xFF);
+    memcpy(out.data(), &header, sizeof(header));
+    memcpy(out.data() + header.dataOffset, model.data(), model.size());
+
+    std::ofstream file(argv[2], std::ios::binary);
+    file.write((const char*) out.data(), out.size());
+    if (!file)
+    {
+        printf("Could not write %s\n", argv[2]);
+        return 1;
+    }
+
+    printf("Wrote %s: version %lu, %ux%ux%u input, %u classes, %lu model bytes, crc %08lx\n",
+           argv[2],
+           (unsigned long) header.modelVersion,
+           header.inputWidth,
+           header.inputHeight,
+           header.inputChannels,
+           header.classCount,
+           (unsigned long) header.modelSize,
+           (unsigned long) header.modelCrc);
+    return 0;
+}
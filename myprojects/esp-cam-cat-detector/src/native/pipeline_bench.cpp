@@ -0,0 +1,339 @@
+/*
+ * Host benchmark and regression check for the full inference pipeline.
+ *
+ * Runs every JPEG of a directory (e.g. a copy of /final-detections from the SD card) through
+ * InferenceUtil::runInferenceFromImage with the embedded model, reports per stage timings and compares the
+ * detections against a golden file.
+ *
+ * TFLM is linked as the static library built by its own makefile with the reference kernels:
+ *   git clone https://github.com/tensorflow/tflite-micro && cd tflite-micro
+ *   make -f tensorflow/lite/micro/tools/make/Makefile microlite
+ *   export TFLM_DIR=$(pwd)
+ *
+ * Build and run with:
+ *   pio run -e native_pipeline
+ *   .pio/build/native_pipeline/program <jpeg dir> [golden file] [--write-golden]
+ *
+ * Exits with 1 when any detection differs from the golden file. Built with -DMODEL_ENABLE_GATE every image also goes
+ * through InferenceUtil::runCascadeFromImage and the cascade counters are printed. That needs a gate_model_data.h,
+ * which isn't in the tree, so the cascade has not been measured yet.
+ */
+
+#include "host_shim.h"
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../general/inference_util.h"
+
+namespace fs = std::filesystem;
+
+constexpr float valueTolerance = 0.02f;
+constexpr float positionTolerance = 0.5f;
+
+struct Detection
+{
+    int classId = 0;
+    float x = 0;
+    float y = 0;
+    float value = 0;
+};
+
+struct StageTimes
+{
+    const char* name;
+    std::vector<unsigned long> samples;
+
+    void print() const
+    {
+        if (samples.empty())
+        {
+            return;
+        }
+
+        std::vector<unsigned long> sorted = samples;
+        std::sort(sorted.begin(), sorted.end());
+
+        double sum = 0;
+        for (unsigned long s : sorted)
+        {
+            sum += s;
+        }
+
+        auto percentile = [&](double p)
+        {
+            return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+        };
+
+        printf("  %-20s mean %8.0f us  p50 %8lu us  p95 %8lu us  max %8lu us\n",
+               name,
+               sum / sorted.size(),
+               percentile(0.5),
+               percentile(0.95),
+               sorted.back());
+    }
+};
+
+std::vector<uint8_t> readFile(const fs::path& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), {});
+}
+
+// One line per image: <file name> [<class id> <x> <y> <value>]...
+bool readGolden(const std::string& path, std::map<std::string, std::vector<Detection>>& golden)
+{
+    std::ifstream file(path);
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream in(line);
+        std::string name;
+        if (!(in >> name))
+        {
+            continue;
+        }
+
+        std::vector<Detection>& detections = golden[name];
+        Detection d;
+        while (in >> d.classId >> d.x >> d.y >> d.value)
+        {
+            detections.push_back(d);
+        }
+    }
+
+    return true;
+}
+
+bool sameDetections(const std::vector<Detection>& a, const std::vector<Detection>& b)
+{
+    if (a.size() != b.size())
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        if (a[i].classId != b[i].classId ||
+            std::fabs(a[i].x - b[i].x) > positionTolerance ||
+            std::fabs(a[i].y - b[i].y) > positionTolerance ||
+            std::fabs(a[i].value - b[i].value) > valueTolerance)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::string formatDetections(const std::vector<Detection>& detections)
+{
+    std::string out;
+    char buf[96];
+    for (const Detection& d : detections)
+    {
+        snprintf(buf, sizeof(buf), " %d %.1f %.1f %.3f", d.classId, d.x, d.y, d.value);
+        out += buf;
+    }
+    return out;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <jpeg dir> [golden file] [--write-golden]\n", argv[0]);
+        return 2;
+    }
+
+    std::string imageDir = argv[1];
+    std::string goldenPath = argc > 2 ? argv[2] : "";
+    bool writeGolden = argc > 3 && strcmp(argv[3], "--write-golden") == 0;
+
+    if (!InferenceUtil::setupBuffers())
+    {
+        printf("Could not reserve pipeline buffers.\n");
+        return 2;
+    }
+
+    int modelStatus = InferenceUtil::loadModel();
+    if (modelStatus != ModelUtil::OK)
+    {
+        printf("Could not load model: %d\n", modelStatus);
+        return 2;
+    }
+
+    std::vector<fs::path> images;
+    for (const auto& entry : fs::directory_iterator(imageDir))
+    {
+        std::string ext = entry.path().extension().string();
+        if (ext == ".jpg" || ext == ".jpeg" || ext == ".JPG")
+        {
+            images.push_back(entry.path());
+        }
+    }
+    std::sort(images.begin(), images.end());
+
+    std::map<std::string, std::vector<Detection>> golden;
+    bool compareGolden = !goldenPath.empty() && !writeGolden;
+    if (compareGolden && !readGolden(goldenPath, golden))
+    {
+        printf("Could not read golden file %s\n", goldenPath.c_str());
+        return 2;
+    }
+
+    std::ofstream goldenOut;
+    if (writeGolden)
+    {
+        goldenOut.open(goldenPath);
+        if (!goldenOut.is_open())
+        {
+            printf("Could not write golden file %s\n", goldenPath.c_str());
+            return 2;
+        }
+    }
+
+    StageTimes decodeTimes{"decode + resize"};
+    StageTimes invokeTimes{"invoke + extract"};
+    StageTimes totalTimes{"end to end"};
+
+    std::vector<uint8_t> input(InferenceUtil::inputSize);
+    size_t failures = 0;
+    size_t diffs = 0;
+    size_t missing = 0;
+
+    for (const fs::path& path : images)
+    {
+        std::vector<uint8_t> jpeg = readFile(path);
+        std::string name = path.filename().string();
+
+        // Decode stage alone, with the same scale and crop the pipeline picks for the full frame
+        IMAGE_UTIL::ImageDimensions dimensions{};
+        if (!IMAGE_UTIL::jpegGetSize(jpeg.data(), jpeg.size(), dimensions))
+        {
+            printf("%s: could not read jpeg size\n", name.c_str());
+            failures++;
+            continue;
+        }
+
+        esp_jpeg_image_scale_t scale = IMAGE_UTIL::selectDecodeScale(dimensions, MODEL_DATA_INPUT_WIDTH, MODEL_DATA_INPUT_HEIGHT);
+        size_t decodeLen = 0;
+        uint8_t* decodeBuffer = BufferPool::borrow(BufferPool::DECODE, 0, &decodeLen);
+
+        unsigned long start = micros();
+        IMAGE_UTIL::Status decodeStatus = InferenceUtil::decodeToInput(jpeg.data(), jpeg.size(), input.data(), decodeBuffer, decodeLen, scale);
+        decodeTimes.samples.push_back(micros() - start);
+        BufferPool::giveBack(decodeBuffer);
+
+        if (decodeStatus != IMAGE_UTIL::OK)
+        {
+            printf("%s: decode failed: %d\n", name.c_str(), decodeStatus);
+            failures++;
+            continue;
+        }
+
+        // Model stage alone on the already decoded input
+        InferenceUtil::InferenceOutput stageOutput{};
+        start = micros();
+        InferenceUtil::runClassifierAndExtractInfo([&](uint8_t* dst)
+        {
+            memcpy(dst, input.data(), input.size());
+            return true;
+        }, stageOutput);
+        invokeTimes.samples.push_back(micros() - start);
+
+        // Whole pipeline as it runs on the device, its detections are the ones compared
+        InferenceUtil::InferenceOutput output{};
+        start = micros();
+        InferenceUtil::runInferenceFromImage(output, jpeg.data(), jpeg.size());
+        totalTimes.samples.push_back(micros() - start);
+
+        if (output.status != ModelUtil::OK)
+        {
+            printf("%s: inference failed: %d\n", name.c_str(), output.status);
+            failures++;
+            continue;
+        }
+
+#ifdef MODEL_ENABLE_GATE
+        InferenceUtil::InferenceOutput cascadeOutput{};
+        InferenceUtil::runCascadeFromImage(cascadeOutput, jpeg.data(), jpeg.size(), InferenceUtil::CascadePolicy{}, false);
+        if (cascadeOutput.gated && output.count > 0)
+        {
+            printf("%s: gate rejected a frame with %zu detections, presence %.3f\n",
+                   name.c_str(),
+                   output.count,
+                   InferenceUtil::cascadeStats.lastPresence);
+        }
+#endif
+
+        std::vector<Detection> detections;
+        for (size_t i = 0; i < output.count; i++)
+        {
+            const InferenceUtil::InferenceValues& values = output.foundValues[i];
+            detections.push_back({values.classId, values.x, values.y, values.value});
+        }
+
+        if (writeGolden)
+        {
+            goldenOut << name << formatDetections(detections) << "\n";
+        }
+        else if (compareGolden)
+        {
+            auto expected = golden.find(name);
+            if (expected == golden.end())
+            {
+                missing++;
+            }
+            else if (!sameDetections(expected->second, detections))
+            {
+                diffs++;
+                printf("%s: expected%s\n%s: got     %s\n",
+                       name.c_str(),
+                       formatDetections(expected->second).c_str(),
+                       name.c_str(),
+                       formatDetections(detections).c_str());
+            }
+        }
+    }
+
+    printf("\n%zu images, %zu failed\n", images.size(), failures);
+    decodeTimes.print();
+    invokeTimes.print();
+    totalTimes.print();
+
+    char stats[1024];
+    LatencyStats::toJson(stats, sizeof(stats));
+    printf("\nPipeline stage histograms: %s\n", stats);
+
+#ifdef MODEL_ENABLE_GATE
+    InferenceUtil::cascadeToJson(stats, sizeof(stats));
+    printf("\nCascade: %s\n", stats);
+#endif
+
+#ifdef MODEL_ENABLE_PROFILER
+    static char profile[4096];
+    ModelUtil::profilerToJson(profile, sizeof(profile));
+    printf("\nOperator profile (host clock ns, not device cycles): %s\n", profile);
+#endif
+
+    if (writeGolden)
+    {
+        printf("\nWrote golden file %s\n", goldenPath.c_str());
+    }
+    else if (compareGolden)
+    {
+        printf("\n%zu images differ from the golden file, %zu not in it\n", diffs, missing);
+    }
+
+    return failures > 0 || diffs > 0 || missing > 0 ? 1 : 0;
+}
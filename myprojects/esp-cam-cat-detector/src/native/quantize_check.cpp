@@ -0,0 +1,114 @@
+/*
+ * Checks ModelUtil::fillRequantizeTable against TFLM's Quantize kernel for all 256 input values.
+ *
+ * The table replaces the uint8 to int8 Quantize op model_fold_input removes, so a folded model only gives the
+ * same detections if every pixel value maps exactly to what the op produced. Each case runs the real kernel on
+ * a uint8 tensor holding 0..255 and compares its output with the table built for the same quantization. The
+ * cases cover the usual camera input quantizations, the same-scale path Requantize takes as a shortcut, and
+ * scale ratios that round differently in float and fixed-point. TFLM is linked the same way as
+ * pipeline_bench.cpp. Build and run with:
+ *   pio run -e native_quantize
+ *   .pio/build/native_quantize/program
+ */
+
+#include "host_shim.h"
+
+#include "tensorflow/lite/micro/kernels/kernel_runner.h"
+#include "tensorflow/lite/micro/kernels/micro_ops.h"
+#include "tensorflow/lite/micro/test_helpers.h"
+#include "../general/model_util.h"
+
+struct QuantizeCase
+{
+    float pixelScale;
+    int pixelZeroPoint;
+    float inputScale;
+    int inputZeroPoint;
+};
+
+constexpr QuantizeCase cases[] = {
+    {0.003921569f, 0, 0.003921569f, -128}, // pixels / 255, the usual export
+    {1.0f, 0, 1.0f, -128},
+    {0.003921569f, 0, 0.007843138f, -1},
+    {0.007843138f, 128, 0.003921569f, -128},
+    {0.0123f, 3, 0.0456f, 7},
+    {0.02f, 17, 0.0049f, -100}, // saturates on both ends
+    {0.5f, 0, 0.25f, -128},
+    {0.0039215689f, 0, 0.0039215684f, -128}, // ratio next to 1, same-scale shortcut not taken
+};
+
+// Runs TFLM's Quantize kernel on every uint8 value, false if it doesn't prepare or invoke
+bool runQuantizeKernel(const QuantizeCase& test, int8_t* output)
+{
+    uint8_t values[256];
+    for (int value = 0; value < 256; value++)
+    {
+        values[value] = value;
+    }
+
+    int dims[] = {2, 1, 256};
+    TfLiteIntArray* shape = tflite::testing::IntArrayFromInts(dims);
+
+    // The kernel reads the output quantization from the affine parameters, not only from params
+    float inputScales[] = {1, test.pixelScale};
+    int inputZeroPoints[] = {1, test.pixelZeroPoint};
+    TfLiteAffineQuantization inputQuantization = {tflite::testing::FloatArrayFromFloats(inputScales),
+                                                  tflite::testing::IntArrayFromInts(inputZeroPoints), 0};
+    float outputScales[] = {1, test.inputScale};
+    int outputZeroPoints[] = {1, test.inputZeroPoint};
+    TfLiteAffineQuantization outputQuantization = {tflite::testing::FloatArrayFromFloats(outputScales),
+                                                   tflite::testing::IntArrayFromInts(outputZeroPoints), 0};
+
+    TfLiteTensor tensors[] = {
+        tflite::testing::CreateQuantizedTensor(values, shape, test.pixelScale, test.pixelZeroPoint),
+        tflite::testing::CreateQuantizedTensor(output, shape, test.inputScale, test.inputZeroPoint),
+    };
+    tensors[0].quantization = {kTfLiteAffineQuantization, &inputQuantization};
+    tensors[1].quantization = {kTfLiteAffineQuantization, &outputQuantization};
+
+    int inputs[] = {1, 0};
+    int outputs[] = {1, 1};
+    const auto registration = tflite::Register_QUANTIZE();
+    tflite::micro::KernelRunner runner(registration, tensors, 2, tflite::testing::IntArrayFromInts(inputs),
+                                       tflite::testing::IntArrayFromInts(outputs), nullptr);
+    return runner.InitAndPrepare() == kTfLiteOk && runner.Invoke() == kTfLiteOk;
+}
+
+int main()
+{
+    int failures = 0;
+    for (const QuantizeCase& test : cases)
+    {
+        int8_t expected[256]{};
+        if (!runQuantizeKernel(test, expected))
+        {
+            printf("scale %.9g zp %d -> scale %.9g zp %d: Quantize kernel failed\n",
+                   test.pixelScale, test.pixelZeroPoint, test.inputScale, test.inputZeroPoint);
+            failures++;
+            continue;
+        }
+
+        int8_t table[256];
+        ModelUtil::fillRequantizeTable(test.pixelScale, test.pixelZeroPoint, test.inputScale, test.inputZeroPoint,
+                                       table);
+
+        int mismatches = 0;
+        for (int value = 0; value < 256; value++)
+        {
+            if (table[value] != expected[value])
+            {
+                if (mismatches++ < 4)
+                {
+                    printf("  %d: table %d, kernel %d\n", value, table[value], expected[value]);
+                }
+            }
+        }
+
+        printf("scale %.9g zp %d -> scale %.9g zp %d: %s\n", test.pixelScale, test.pixelZeroPoint,
+               test.inputScale, test.inputZeroPoint, mismatches == 0 ? "ok" : "MISMATCH");
+        failures += mismatches != 0;
+    }
+
+    printf("%d of %zu cases failed\n", failures, sizeof(cases) / sizeof(cases[0]));
+    return failures == 0 ? 0 : 1;
+}
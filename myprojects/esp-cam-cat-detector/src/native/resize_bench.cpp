@@ -0,0 +1,317 @@
+/*
+ * Host benchmark for the IMAGE_UTIL resize kernels.
+ *
+ * Checks that the packed vertical blend is bit exact with the scalar reference, and that the luma path used by
+ * MODEL_IS_GRAYSCALE is bit exact with the RGB one, then reports the time per frame of the legacy float resize
+ * and of the fixed-point resize with each blend variant.
+ *
+ * Build and run with: pio run -e native && .pio/build/native/program
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+typedef enum
+{
+    JPEG_IMAGE_SCALE_0 = 0,
+    JPEG_IMAGE_SCALE_1_2,
+    JPEG_IMAGE_SCALE_1_4,
+    JPEG_IMAGE_SCALE_1_8,
+} esp_jpeg_image_scale_t;
+
+#include "../general/image_util.h"
+
+using namespace IMAGE_UTIL;
+using BlendFn = void (*)(const uint8_t*, const uint8_t*, uint16_t, size_t, uint8_t*);
+
+constexpr int dstSize = 96;
+constexpr int iterations = 200;
+
+// Original float implementation, kept here only as a baseline
+void resizeFloat(uint8_t* src, int src_w, int src_h, int dst_w, int dst_h)
+{
+    int crop_size = src_w < src_h ? src_w : src_h;
+    int x_offset = (src_w - crop_size) / 2;
+    int y_offset = (src_h - crop_size) / 2;
+
+    float x_ratio = (float)(crop_size - 1) / (dst_w - 1);
+    float y_ratio = (float)(crop_size - 1) / (dst_h - 1);
+
+    for (int y = 0; y < dst_h; y++)
+    {
+        float fy = y * y_ratio;
+        int y0 = (int)fy;
+        int y1 = y0 + 1 < crop_size ? y0 + 1 : y0;
+        float wy = fy - y0;
+
+        for (int x = 0; x < dst_w; x++)
+        {
+            float fx = x * x_ratio;
+            int x0 = (int)fx;
+            int x1 = x0 + 1 < crop_size ? x0 + 1 : x0;
+            float wx = fx - x0;
+
+            for (int c = 0; c < 3; c++)
+            {
+                float val = (1 - wx) * (1 - wy) * src[((y0 + y_offset) * src_w + (x0 + x_offset)) * 3 + c] +
+                    wx * (1 - wy) * src[((y0 + y_offset) * src_w + (x1 + x_offset)) * 3 + c] +
+                    (1 - wx) * wy * src[((y1 + y_offset) * src_w + (x0 + x_offset)) * 3 + c] +
+                    wx * wy * src[((y1 + y_offset) * src_w + (x1 + x_offset)) * 3 + c];
+                src[(y * dst_w + x) * 3 + c] = (uint8_t)(val + 0.5f);
+            }
+        }
+    }
+}
+
+// Same as cropResizeInPlace, but with the blend variant chosen at runtime
+void resizeFixed(uint8_t* src, int src_w, int src_h, int dst_w, int dst_h, BlendFn blend)
+{
+    int crop_size = src_w < src_h ? src_w : src_h;
+    int x_offset = (src_w - crop_size) / 2;
+    int y_offset = (src_h - crop_size) / 2;
+
+    ResizeTap xTaps[RESIZE_MAX_DST_SIZE];
+    ResizeTap yTaps[RESIZE_MAX_DST_SIZE];
+    computeResizeTaps(crop_size, dst_w, xTaps);
+    computeResizeTaps(crop_size, dst_h, yTaps);
+
+    static ResizeRowCache cache;
+    cache.clear();
+
+    auto sourceRow = [&](int row)
+    {
+        return src + ((size_t)(row + y_offset) * src_w + x_offset) * 3;
+    };
+
+    for (int y = 0; y < dst_h; y++)
+    {
+        const ResizeTap& tap = yTaps[y];
+        const uint8_t* top = cache.get(tap.i0, tap.i1, sourceRow(tap.i0), xTaps, dst_w);
+        const uint8_t* bottom = cache.get(tap.i1, tap.i0, sourceRow(tap.i1), xTaps, dst_w);
+        blend(top, bottom, tap.weight, (size_t)dst_w * 3, src + (size_t)y * dst_w * 3);
+    }
+}
+
+// Same as resizeFixed on a single channel image, the way the decoder resizes luma rows
+void resizeFixedLuma(const uint8_t* src, int src_w, int src_h, int dst_w, int dst_h, uint8_t* out)
+{
+    int crop_size = src_w < src_h ? src_w : src_h;
+    int x_offset = (src_w - crop_size) / 2;
+    int y_offset = (src_h - crop_size) / 2;
+
+    ResizeTap xTaps[RESIZE_MAX_DST_SIZE];
+    ResizeTap yTaps[RESIZE_MAX_DST_SIZE];
+    computeResizeTaps(crop_size, dst_w, xTaps);
+    computeResizeTaps(crop_size, dst_h, yTaps);
+
+    static ResizeRowCache cache;
+    cache.clear();
+
+    for (int y = 0; y < dst_h; y++)
+    {
+        const ResizeTap& tap = yTaps[y];
+        const uint8_t* top = cache.get(tap.i0, tap.i1, src + (size_t)(tap.i0 + y_offset) * src_w + x_offset, xTaps, dst_w, 1);
+        const uint8_t* bottom = cache.get(tap.i1, tap.i0, src + (size_t)(tap.i1 + y_offset) * src_w + x_offset, xTaps, dst_w, 1);
+        blendRows(top, bottom, tap.weight, dst_w, out + (size_t)y * dst_w);
+    }
+}
+
+/*
+ * rgbToGrayscale against the exact value of its Q8 weights for every color, which also has to keep grays
+ * unchanged and stay within one step of BT.601 in float.
+ */
+bool checkGrayscaleBitExact()
+{
+    for (int r = 0; r < 256; r++)
+    {
+        for (int g = 0; g < 256; g++)
+        {
+            for (int b = 0; b < 256; b++)
+            {
+                uint8_t luma = rgbToGrayscale(r, g, b);
+                int expected = (int)std::floor((77.0 * r + 150.0 * g + 29.0 * b) / 256.0 + 0.5);
+                double bt601 = 0.299 * r + 0.587 * g + 0.114 * b;
+                if (luma != expected || std::fabs(luma - bt601) > 1.0 || (r == g && g == b && luma != r))
+                {
+                    printf("Grayscale mismatch for %d,%d,%d: %u, expected %d, BT.601 %.2f\n", r, g, b, luma, expected, bt601);
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+/*
+ * A gray image resized through the luma path has to give exactly the bytes of the same image expanded with
+ * grayToBgr and resized as RGB, since both use the same taps and rounding per channel.
+ */
+bool checkLumaBitExact(int w, int h)
+{
+    std::vector<uint8_t> gray((size_t)w * h);
+    for (size_t i = 0; i < gray.size(); i++)
+    {
+        gray[i] = i % 97 == 0 ? 255 : rand() & 0xFF;
+    }
+
+    std::vector<uint8_t> rgb(gray.size() * 3);
+    grayToBgr(gray.data(), gray.size(), rgb.data());
+    for (size_t i = 0; i < gray.size(); i++)
+    {
+        if (rgb[i * 3] != gray[i] || rgb[i * 3 + 1] != gray[i] || rgb[i * 3 + 2] != gray[i])
+        {
+            printf("grayToBgr mismatch at pixel %zu\n", i);
+            return false;
+        }
+    }
+
+    std::vector<uint8_t> lumaOut((size_t)dstSize * dstSize);
+    resizeFixedLuma(gray.data(), w, h, dstSize, dstSize, lumaOut.data());
+    resizeFixed(rgb.data(), w, h, dstSize, dstSize, blendRowsReference);
+
+    std::vector<uint8_t> expanded(lumaOut.size() * 3);
+    grayToBgr(lumaOut.data(), lumaOut.size(), expanded.data());
+    if (memcmp(expanded.data(), rgb.data(), expanded.size()) != 0)
+    {
+        printf("Luma resize of %dx%d differs from the RGB resize\n", w, h);
+        return false;
+    }
+
+    // The row resampler on its own, against the RGB one on the first channel
+    ResizeTap xTaps[RESIZE_MAX_DST_SIZE];
+    computeResizeTaps(w, dstSize, xTaps);
+    uint8_t lumaRow[RESIZE_MAX_DST_SIZE];
+    uint8_t rgbRow[RESIZE_MAX_DST_SIZE * 3];
+    std::vector<uint8_t> rgbSource((size_t)w * 3);
+    grayToBgr(gray.data(), w, rgbSource.data());
+    resizeRowHorizontalLuma(gray.data(), xTaps, dstSize, lumaRow);
+    resizeRowHorizontal(rgbSource.data(), xTaps, dstSize, rgbRow);
+    for (int x = 0; x < dstSize; x++)
+    {
+        if (lumaRow[x] != rgbRow[x * 3])
+        {
+            printf("resizeRowHorizontalLuma differs at %d for width %d\n", x, w);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool checkBlendBitExact()
+{
+    alignas(4) uint8_t top[RESIZE_MAX_DST_SIZE * 3 + 4];
+    alignas(4) uint8_t bottom[RESIZE_MAX_DST_SIZE * 3 + 4];
+    alignas(4) uint8_t outRef[RESIZE_MAX_DST_SIZE * 3 + 4];
+    alignas(4) uint8_t outPacked[RESIZE_MAX_DST_SIZE * 3 + 4];
+
+    for (int round = 0; round < 64; round++)
+    {
+        for (size_t i = 0; i < sizeof(top); i++)
+        {
+            // Saturated values hit the worst case for the packed lanes
+            top[i] = round % 4 == 0 ? 255 : rand() & 0xFF;
+            bottom[i] = round % 4 == 0 ? 255 : rand() & 0xFF;
+        }
+
+        for (uint16_t weight = 0; weight < RESIZE_WEIGHT_ONE; weight++)
+        {
+            size_t offset = round % 4;
+            size_t len = RESIZE_MAX_DST_SIZE * 3 - (round % 7);
+
+            blendRowsReference(top + offset, bottom + offset, weight, len, outRef + offset);
+            blendRowsPacked(top + offset, bottom + offset, weight, len, outPacked + offset);
+
+            if (memcmp(outRef + offset, outPacked + offset, len) != 0)
+            {
+                printf("Mismatch with weight=%u, offset=%zu, len=%zu\n", weight, offset, len);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+template <typename Fn>
+double benchmark(const std::vector<uint8_t>& image, Fn&& fn)
+{
+    std::vector<uint8_t> work(image.size());
+
+    double total = 0;
+    for (int i = 0; i < iterations; i++)
+    {
+        memcpy(work.data(), image.data(), image.size());
+
+        auto start = std::chrono::steady_clock::now();
+        fn(work.data());
+        auto end = std::chrono::steady_clock::now();
+
+        total += std::chrono::duration<double, std::micro>(end - start).count();
+    }
+
+    return total / iterations;
+}
+
+int main()
+{
+    if (!checkBlendBitExact())
+    {
+        printf("Packed blend is not bit exact with the reference.\n");
+        return 1;
+    }
+    printf("Packed blend is bit exact with the reference.\n");
+
+    if (!checkGrayscaleBitExact() || !checkLumaBitExact(240, 240) || !checkLumaBitExact(320, 240) || !checkLumaBitExact(97, 131))
+    {
+        printf("Luma path is not bit exact with the reference.\n");
+        return 1;
+    }
+    printf("Luma path is bit exact with the reference.\n\n");
+
+    constexpr int sizes[][2] = {{240, 240}, {320, 240}};
+    for (const auto& size : sizes)
+    {
+        int w = size[0];
+        int h = size[1];
+
+        std::vector<uint8_t> image((size_t)w * h * 3);
+        for (size_t i = 0; i < image.size(); i++)
+        {
+            image[i] = rand() & 0xFF;
+        }
+
+        std::vector<uint8_t> outRef = image;
+        std::vector<uint8_t> outPacked = image;
+        std::vector<uint8_t> outDefault = image;
+        resizeFixed(outRef.data(), w, h, dstSize, dstSize, blendRowsReference);
+        resizeFixed(outPacked.data(), w, h, dstSize, dstSize, blendRowsPacked);
+        cropResizeInPlace(outDefault.data(), w, h, dstSize, dstSize);
+
+        size_t dstLen = dstSize * dstSize * 3;
+        bool exact = memcmp(outRef.data(), outPacked.data(), dstLen) == 0 &&
+            memcmp(outRef.data(), outDefault.data(), dstLen) == 0;
+
+        double floatUs = benchmark(image, [&](uint8_t* buf) { resizeFloat(buf, w, h, dstSize, dstSize); });
+        double refUs = benchmark(image, [&](uint8_t* buf) { resizeFixed(buf, w, h, dstSize, dstSize, blendRowsReference); });
+        double packedUs = benchmark(image, [&](uint8_t* buf) { resizeFixed(buf, w, h, dstSize, dstSize, blendRowsPacked); });
+
+        printf("%dx%d -> %dx%d (%s)\n", w, h, dstSize, dstSize, exact ? "outputs match" : "OUTPUTS DIFFER");
+        printf("  float:           %8.1f us/frame\n", floatUs);
+        printf("  fixed reference: %8.1f us/frame\n", refUs);
+        printf("  fixed packed:    %8.1f us/frame\n", packedUs);
+
+        if (!exact)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
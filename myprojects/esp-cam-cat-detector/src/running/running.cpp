@@ -9,11 +9,17 @@
 #include <general/config_page_setup.h>
 #include <general/cam_config.h>
 #include <general/inference_util.h>
+#include <general/jpeg_util.h>
 #include <general/model_util.h>
+#include <general/model_store.h>
 #include <general/util.h>
 #include <general/iot_setup.h>
+#include <general/frame_pipeline.h>
+#include <general/motion_gate.h>
+#include <general/batch_eval.h>
+#include <general/event_recorder.h>
+#include <general/inference_scheduler.h>
 
-#define AVERAGING_WINDOW 3
 #define INFERENCE_THRESHOLD 0.7f
 #define DETECTION_FOLDER "/final-detections"
 #define EMPTY_FOLDER "/final-empty"
@@ -22,7 +28,7 @@ volatile bool cameraInit = false;
 bool timeInit = false;
 
 unsigned long inferenceTimer = 0;
-unsigned long inferenceDelay = 800;
+unsigned long inferenceDelay = 800; // poll period while inference is paused, the scheduler sets it otherwise
 
 unsigned long luminosityUpdateInterval = 30 * 60 * 1000;
 unsigned long luminosityReadTimer = -luminosityUpdateInterval;
@@ -30,8 +36,6 @@ unsigned long luminosityReadTimer = -luminosityUpdateInterval;
 unsigned long saveEmptyImageInterval = 45 * 60 * 1000;
 unsigned long lastSavedEmptyImage = -saveEmptyImageInterval;
 
-esp_jpeg_image_scale_t jpegScale = JPEG_IMAGE_SCALE_0;
-
 void updateLuminosity()
 {
     IotProperties::setLuminosity(readLuminosity());
@@ -55,58 +59,149 @@ void delayTaskFn(TickType_t &lastWake, TickType_t interval)
 
 void inferenceTask(void *args)
 {
-    TickType_t interval = pdMS_TO_TICKS(inferenceDelay);
     TickType_t lastWake = xTaskGetTickCount();
 
     ActionController action;
     action.setup();
 
+    InferenceUtil::DetectionTracker tracker;
+    InferenceUtil::RoiTracker roi;
+
     while (true)
     {
-        if (!cameraInit || !IotProperties::isInferenceOn())
+        ConfigPageSetup::Settings settings = ConfigPageSetup::settings();
+        if (!cameraInit || !IotProperties::isInferenceOn() || BatchEval::running())
         {
-            delayTaskFn(lastWake, interval);
+            tracker.reset();
+            MotionGate::reset();
+            roi.reset();
+            InferenceScheduler::reset();
+            delayTaskFn(lastWake, pdMS_TO_TICKS(inferenceDelay));
             continue;
         }
 
-        camera_fb_t *fb = esp_camera_fb_get();
+        TickType_t interval = InferenceScheduler::tickInterval();
+        camera_fb_t *fb = FramePipeline::acquire(interval);
         if (!fb)
         {
-            MLOGN("Could not acquire framebuffer.");
+            MLOGN("No frame available from the capture task.");
+            delayTaskFn(lastWake, interval);
+            continue;
+        }
+
+        int64_t frameId = FramePipeline::frameTimestampUs(fb);
+        if (tracker.isLastFrame(frameId))
+        {
+            MLOGN("Framebuffer already processed, skipping.");
+            FramePipeline::release(fb);
             delayTaskFn(lastWake, interval);
             continue;
         }
 
-        float average = 0;
-        for (uint8_t i = 0; i < AVERAGING_WINDOW; i++)
+        // The motion gate runs on every tick, the scheduler only spaces out the detector runs.
+        // Tracks that are still decaying count as activity, so a cat briefly missed keeps the burst rate
+        MotionGate::Decision gate = MotionGate::check(fb->buf, fb->len, settings.motionThreshold);
+        InferenceScheduler::Activity activity = InferenceScheduler::QUIET;
+        if (tracker.count > 0)
         {
-            InferenceUtil::InferenceOutput result{};
-            InferenceUtil::runInferenceFromImage(result, fb->buf, fb->len, nullptr, nullptr, jpegScale);
+            activity = InferenceScheduler::DETECTION;
+        }
+        else if (gate == MotionGate::MOTION || gate == MotionGate::HOLD)
+        {
+            activity = InferenceScheduler::MOTION;
+        }
+        InferenceScheduler::update(activity, settings.scheduler);
+
+        if (gate == MotionGate::SKIP || (gate != MotionGate::FORCED && !InferenceScheduler::detectorDue()))
+        {
+            EventRecorder::push(fb->buf, fb->len, frameId / 1000, -1);
+            FramePipeline::release(fb);
+            action.loop();
+            delayTaskFn(lastWake, InferenceScheduler::tickInterval());
+            continue;
+        }
+        InferenceScheduler::markRun();
+
+        // Anything still tracked skips the presence gate, the detector has to confirm or lose it
+        InferenceUtil::InferenceOutput result{};
+        InferenceUtil::runCascadeFromImage(result, fb->buf, fb->len, settings.cascade, tracker.count > 0, &roi);
+        // Only a frame the tracker took can trigger, a failed run must not fire again on the tracks of the last one
+        bool tracked = result.status == ModelUtil::OK && tracker.update(result, frameId);
 
-            float val = InferenceUtil::triggerCertainty(result);
-            MLOGF("Inference ran, current certainty: %f\n", val);
+        if (result.count > 0)
+        {
+            MotionGate::markActive();
+        }
 
-            average += val;
-            delay(5);
+        float certainty = tracked ? tracker.triggerCertainty() : 0;
+        EventRecorder::push(fb->buf, fb->len, frameId / 1000, result.status == ModelUtil::OK && !result.gated ? InferenceUtil::triggerCertainty(result) : -1);
+        if (tracked)
+        {
+            MLOGF("Inference ran, current certainty: %f, tracked over %zu tracks: %f\n",
+                InferenceUtil::triggerCertainty(result),
+                tracker.count,
+                certainty);
+        }
+        else
+        {
+            MLOGF("Inference failed: %d\n", result.status);
         }
-        average /= AVERAGING_WINDOW;
 
-        if (average >= INFERENCE_THRESHOLD)
+        if (tracked && certainty >= INFERENCE_THRESHOLD)
         {
-            action.doAction();
-            MLOGF("Average %f is higher than threshold, triggering.\n", average);
-            saveImg(fb, average, DETECTION_FOLDER);
+            {
+                LatencyStats::ScopedTimer timer(LatencyStats::ACTUATION);
+                action.doAction();
+            }
+            MLOGF("Tracked certainty %f is higher than threshold, triggering.\n", certainty);
+            saveImg(fb, certainty, DETECTION_FOLDER);
+            if (IotProperties::isSavingOn())
+            {
+                EventRecorder::trigger();
+            }
         }
-        else if (millis() - lastSavedEmptyImage > saveEmptyImageInterval)
+        else if (tracked && millis() - lastSavedEmptyImage > saveEmptyImageInterval)
         {
-            saveImg(fb, average, EMPTY_FOLDER);
+            saveImg(fb, certainty, EMPTY_FOLDER);
             lastSavedEmptyImage = millis();
         }
 
-        esp_camera_fb_return(fb);
+        FramePipeline::release(fb);
         action.loop();
-        vTaskDelayUntil(&lastWake, interval);
+
+        // A fresh detection moves to the burst period right away instead of on the next tick
+        if (tracker.count > 0 && activity != InferenceScheduler::DETECTION)
+        {
+            InferenceScheduler::update(InferenceScheduler::DETECTION, settings.scheduler);
+        }
+        delayTaskFn(lastWake, InferenceScheduler::tickInterval());
+    }
+}
+
+// Replies to a model switch with the model that actually runs after the reload, 200 only if it is the one in slot
+void sendModelSwitchResult(ESP_CONFIG_PAGE::REQUEST_T req, const char *action, int slot, int reloadRes)
+{
+    char running[48];
+    ModelStore::describeCurrent(running, sizeof(running));
+
+    char out[160];
+    if (reloadRes != ModelUtil::OK)
+    {
+        snprintf(out, sizeof(out), "%s %s, no model could be loaded: %d", action, ModelStore::slotNames[slot], reloadRes);
+        ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::INTERNAL_SERVER_ERROR, out, req);
+        return;
+    }
+
+    if (ModelStore::current.source != ModelStore::PARTITION || ModelStore::current.slot != slot)
+    {
+        snprintf(out, sizeof(out), "%s %s but it failed to load: %d, it was dropped, running %s",
+                 action, ModelStore::slotNames[slot], ModelStore::lastFailure.status, running);
+        ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::BAD_REQUEST, out, req);
+        return;
     }
+
+    snprintf(out, sizeof(out), "%s, running %s", action, running);
+    ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, out, req);
 }
 
 void handleServerUpload()
@@ -234,6 +329,16 @@ void setup()
 
     setupPins();
 
+    if (!InferenceUtil::setupBuffers())
+    {
+        MLOGN("Error creating the inference lock or reserving inference buffers.");
+    }
+
+    if (!MotionGate::setup())
+    {
+        MLOGN("Error reserving motion gate buffers, gate disabled.");
+    }
+
     WiFi.setSleep(WIFI_PS_NONE);
     esp_log_level_set("*", ESP_LOG_VERBOSE);
 
@@ -242,16 +347,24 @@ void setup()
     if (cameraInit)
     {
         CamConfig::setRes(FRAMESIZE_240X240);
-        jpegScale = JPEG_IMAGE_SCALE_0;
     }
 
     MLOGF("Free PSRAM after camera init: %lu\n", ESP.getFreePsram());
     MLOGF("Free DRAM after camera init: %zu\n", ESP.getFreeHeap());
 
     sdInit = CamConfig::initSdCard();
+    if (sdInit && !SdWriter::setup())
+    {
+        MLOGN("Error starting the sd writer, images won't be saved.");
+    }
+    else if (sdInit && !EventRecorder::setup())
+    {
+        MLOGN("Error starting the event recorder, detections will be saved without pre roll.");
+    }
     updateLuminosity();
 
-    int modelInitRes = ModelUtil::loadModel();
+    ModelStore::setup();
+    int modelInitRes = InferenceUtil::loadModel();
     if (modelInitRes != ModelUtil::OK)
     {
         MLOGF("Error initializing model: %d\n", modelInitRes);
@@ -289,6 +402,212 @@ void setup()
         ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, IotProperties::isInferenceOn() ? "enabled" : "disabled", req);
     });
 
+    ESP_CONFIG_PAGE::addServerHandler("/pipeline-stats", HTTP_GET, [](ESP_CONFIG_PAGE::REQUEST_T req)
+    {
+        FramePipeline::Stats stats = FramePipeline::snapshot();
+        char out[192];
+        snprintf(out, sizeof(out),
+            "{\"captured\":%lu,\"consumed\":%lu,\"dropped\":%lu,\"captureErrors\":%lu,\"lastLatencyUs\":%lld,\"maxLatencyUs\":%lld}",
+            (unsigned long) stats.captured,
+            (unsigned long) stats.consumed,
+            (unsigned long) stats.dropped,
+            (unsigned long) stats.captureErrors,
+            stats.lastLatencyUs,
+            stats.maxLatencyUs);
+        ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, out, req);
+    });
+
+    ESP_CONFIG_PAGE::addServerHandler("/motion-stats", HTTP_GET, [](ESP_CONFIG_PAGE::REQUEST_T req)
+    {
+        const MotionGate::Stats &stats = MotionGate::stats;
+        char out[192];
+        snprintf(out, sizeof(out),
+            "{\"motion\":%lu,\"held\":%lu,\"forced\":%lu,\"skipped\":%lu,\"errors\":%lu,\"lastChangedPercent\":%.2f}",
+            (unsigned long) stats.motion,
+            (unsigned long) stats.held,
+            (unsigned long) stats.forced,
+            (unsigned long) stats.skipped,
+            (unsigned long) stats.errors,
+            stats.lastChangedPercent);
+        ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, out, req);
+    });
+
+    ESP_CONFIG_PAGE::addServerHandler("/cascade-stats", HTTP_GET, [](ESP_CONFIG_PAGE::REQUEST_T req)
+    {
+        char out[512];
+        InferenceUtil::cascadeToJson(out, sizeof(out));
+        ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, out, req);
+    });
+
+    ESP_CONFIG_PAGE::addServerHandler("/inf-memory", HTTP_GET, [](ESP_CONFIG_PAGE::REQUEST_T req)
+    {
+        char out[200];
+        snprintf(out, sizeof(out),
+            "{\"arenaPlacement\":\"%s\",\"arenaSize\":%u,\"arenaUsed\":%u,\"freePsram\":%lu,\"freeHeap\":%lu}",
+            ModelUtil::arenaPlacement,
+            (unsigned) ModelUtil::currentArenaSizes.total,
+            (unsigned) ModelUtil::arenaUsedBytes,
+            (unsigned long) ESP.getFreePsram(),
+            (unsigned long) ESP.getFreeHeap());
+        ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, out, req);
+    });
+
+    // Blocks inference while every placement is loaded and timed, a few seconds for the default run count
+    ESP_CONFIG_PAGE::addServerHandler("/inf-placement-bench", HTTP_GET, [](ESP_CONFIG_PAGE::REQUEST_T req)
+    {
+        char paramBuf[8]{};
+        int runs = 20;
+        if (ESP_CONFIG_PAGE::getParam(req, "runs", paramBuf, sizeof(paramBuf)) &&
+            (str2int(&runs, paramBuf, 10) != STR2INT_SUCCESS || runs < 1 || runs > 1000))
+        {
+            ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::BAD_REQUEST, "runs must be between 1 and 1000", req);
+            return;
+        }
+
+        static char out[512];
+        InferenceUtil::benchPlacements(out, sizeof(out), runs);
+        MLOGN(out);
+        ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, out, req);
+    });
+
+    ESP_CONFIG_PAGE::addServerHandler("/inf-stats", HTTP_GET, [](ESP_CONFIG_PAGE::REQUEST_T req)
+    {
+        static char out[1024];
+        LatencyStats::toJson(out, sizeof(out));
+
+        char paramBuf[8]{};
+        if (ESP_CONFIG_PAGE::getParam(req, "reset", paramBuf, sizeof(paramBuf)))
+        {
+            LatencyStats::reset();
+        }
+
+        ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, out, req);
+    });
+
+    ESP_CONFIG_PAGE::addServerHandler("/model-info", HTTP_GET, [](ESP_CONFIG_PAGE::REQUEST_T req)
+    {
+        static char out[1024];
+        ModelStore::toJson(out, sizeof(out));
+        ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, out, req);
+    });
+
+    ESP_CONFIG_PAGE::addServerHandler("/model-install", HTTP_POST, [](ESP_CONFIG_PAGE::REQUEST_T req)
+    {
+        char path[96] = MODEL_STORE_SD_PATH;
+        ESP_CONFIG_PAGE::getParam(req, "path", path, sizeof(path));
+
+        if (!sdInit)
+        {
+            ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::BAD_REQUEST, "sd card not mounted", req);
+            return;
+        }
+
+        int slot = -1;
+        ModelFormat::Status status = ModelStore::installFromFile(path, MODEL_CLASS_COUNT, &slot);
+        if (status != ModelFormat::OK)
+        {
+            ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::BAD_REQUEST, ModelFormat::statusName(status), req);
+            return;
+        }
+
+        sendModelSwitchResult(req, "installed", slot, InferenceUtil::reloadModel());
+    });
+
+    ESP_CONFIG_PAGE::addServerHandler("/model-activate", HTTP_POST, [](ESP_CONFIG_PAGE::REQUEST_T req)
+    {
+        char paramBuf[8]{};
+        ESP_CONFIG_PAGE::getParam(req, "slot", paramBuf, sizeof(paramBuf));
+
+        int slot = -1;
+        if (str2int(&slot, paramBuf, 10) != STR2INT_SUCCESS || slot < 0 || slot >= MODEL_STORE_SLOT_COUNT)
+        {
+            ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::BAD_REQUEST, "slot must be 0 or 1", req);
+            return;
+        }
+
+        ModelFormat::Status status = ModelStore::activate(slot);
+        if (status != ModelFormat::OK)
+        {
+            ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::BAD_REQUEST, ModelFormat::statusName(status), req);
+            return;
+        }
+
+        sendModelSwitchResult(req, "activated", slot, InferenceUtil::reloadModel());
+    });
+
+    ESP_CONFIG_PAGE::addServerHandler("/sd-stats", HTTP_GET, [](ESP_CONFIG_PAGE::REQUEST_T req)
+    {
+        char out[384];
+        SdWriter::toJson(out, sizeof(out));
+        ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, out, req);
+    });
+
+    ESP_CONFIG_PAGE::addServerHandler("/scheduler-stats", HTTP_GET, [](ESP_CONFIG_PAGE::REQUEST_T req)
+    {
+        char out[512];
+        InferenceScheduler::toJson(out, sizeof(out));
+        ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, out, req);
+    });
+
+    ESP_CONFIG_PAGE::addServerHandler("/event-stats", HTTP_GET, [](ESP_CONFIG_PAGE::REQUEST_T req)
+    {
+        char out[384];
+        EventRecorder::toJson(out, sizeof(out));
+        ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, out, req);
+    });
+
+    BatchEval::addFolder(DETECTION_FOLDER, true);
+    BatchEval::addFolder(EMPTY_FOLDER, false);
+
+    ESP_CONFIG_PAGE::addServerHandler("/eval-start", HTTP_POST, [](ESP_CONFIG_PAGE::REQUEST_T req)
+    {
+        float threshold = INFERENCE_THRESHOLD;
+        char paramBuf[16]{};
+        if (ESP_CONFIG_PAGE::getParam(req, "threshold", paramBuf, sizeof(paramBuf)))
+        {
+            threshold = atof(paramBuf);
+        }
+
+        bool started = BatchEval::start(threshold);
+        ESP_CONFIG_PAGE::sendInstantResponse(started ? ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK : ESP_CONFIG_PAGE::CONP_STATUS_CODE::BAD_REQUEST,
+            started ? "started" : "already running or sd card not mounted",
+            req);
+    });
+
+    ESP_CONFIG_PAGE::addServerHandler("/eval-stop", HTTP_POST, [](ESP_CONFIG_PAGE::REQUEST_T req)
+    {
+        BatchEval::stop();
+        ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, "stopping", req);
+    });
+
+    ESP_CONFIG_PAGE::addServerHandler("/eval-status", HTTP_GET, [](ESP_CONFIG_PAGE::REQUEST_T req)
+    {
+        static char out[768];
+        BatchEval::toJson(out, sizeof(out));
+        ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, out, req);
+    });
+
+#ifdef MODEL_ENABLE_PROFILER
+    ESP_CONFIG_PAGE::addServerHandler("/inf-profile", HTTP_GET, [](ESP_CONFIG_PAGE::REQUEST_T req)
+    {
+        static char out[4096];
+        char paramBuf[8]{};
+        bool reset = ESP_CONFIG_PAGE::getParam(req, "reset", paramBuf, sizeof(paramBuf));
+
+        // The inference task writes the profiler during every invoke
+        {
+            InferenceUtil::InferenceLock lock;
+            ModelUtil::profilerToJson(out, sizeof(out));
+            if (reset)
+            {
+                ModelUtil::profiler.reset();
+            }
+        }
+
+        ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, out, req);
+    });
+#endif
+
     ESP_CONFIG_PAGE::addServerHandler("/inf", HTTP_GET, [](ESP_CONFIG_PAGE::REQUEST_T req)
     {
         camera_fb_t *fb = esp_camera_fb_get();
@@ -296,33 +615,42 @@ void setup()
         size_t outImgSize = 0;
 
         InferenceUtil::InferenceOutput result{};
-        InferenceUtil::runInferenceFromImage(result, fb->buf, fb->len, &outImg, &outImgSize, jpegScale);
+        InferenceUtil::runInferenceFromImage(result, fb->buf, fb->len, &outImg, &outImgSize);
         esp_camera_fb_return(fb);
 
-        if (outImg != nullptr)
+        if (outImg == nullptr)
         {
-            ESP_CONFIG_PAGE::ResponseContext c{};
-            ESP_CONFIG_PAGE::initResponseContext(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, "image/jpeg", 0, c);
-            ESP_CONFIG_PAGE::startResponse(req, c);
-
-            ESP_CONFIG_PAGE::sendHeader("x-trigger-certainty", String(InferenceUtil::triggerCertainty(result)).c_str(), c);
-            ESP_CONFIG_PAGE::sendHeader("x-result", InferenceUtil::currentOutput, c);
+            ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::INTERNAL_SERVER_ERROR, "error running inference", req);
+            return;
+        }
 
-            InferenceUtil::drawMarkers(result, outImg);
+        InferenceUtil::drawMarkers(result, outImg);
 
-            uint8_t *outJpeg = nullptr;
-            size_t outJpegSize = 0;
-            fmt2jpg(outImg, outImgSize, 96, 96, PIXFORMAT_RGB888, 200, &outJpeg, &outJpegSize);
-            free(outImg);
+        // Encoded before anything is sent, so a failure can still get an error status
+        size_t outJpegCapacity = 0;
+        size_t outJpegSize = 0;
+        uint8_t *outJpeg = BufferPool::borrow(BufferPool::ENCODE, 0, &outJpegCapacity);
+        bool encoded = outJpeg != nullptr &&
+            JPEG_UTIL::rgb888ToJpeg(outImg, outImgSize, MODEL_INPUT_WIDTH, MODEL_INPUT_HEIGHT, 200, outJpeg, outJpegCapacity, &outJpegSize);
+        BufferPool::giveBack(outImg);
 
-            ESP_CONFIG_PAGE::writeResponse(outJpeg, outJpegSize, c);
-            ESP_CONFIG_PAGE::endResponse(req, c);
-            free(outJpeg);
-        }
-        else
+        if (!encoded)
         {
-            ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::INTERNAL_SERVER_ERROR, "error running inference", req);
+            BufferPool::giveBack(outJpeg);
+            ESP_CONFIG_PAGE::sendInstantResponse(ESP_CONFIG_PAGE::CONP_STATUS_CODE::INTERNAL_SERVER_ERROR, "error encoding image", req);
+            return;
         }
+
+        ESP_CONFIG_PAGE::ResponseContext c{};
+        ESP_CONFIG_PAGE::initResponseContext(ESP_CONFIG_PAGE::CONP_STATUS_CODE::OK, "image/jpeg", 0, c);
+        ESP_CONFIG_PAGE::startResponse(req, c);
+
+        ESP_CONFIG_PAGE::sendHeader("x-trigger-certainty", String(InferenceUtil::triggerCertainty(result)).c_str(), c);
+        ESP_CONFIG_PAGE::sendHeader("x-result", InferenceUtil::currentOutput, c);
+
+        ESP_CONFIG_PAGE::writeResponse(outJpeg, outJpegSize, c);
+        ESP_CONFIG_PAGE::endResponse(req, c);
+        BufferPool::giveBack(outJpeg);
     });
 
     handleServerUpload();
@@ -330,6 +658,12 @@ void setup()
 
     MLOGN("Started.");
 
+    // Capture runs on core 0 next to WiFi, inference on core 1
+    FramePipeline::start([]()
+    {
+        return cameraInit && IotProperties::isInferenceOn() && !StreamBroadcaster::active() && !BatchEval::running();
+    });
+
     xTaskCreatePinnedToCore(
         inferenceTask,
         "inferencetask",
@@ -345,7 +679,7 @@ void loop()
     ConfigPageSetup::configPageLoop();
     IotProperties::loop();
 
-    if (ConfigPageSetup::streamActive)
+    if (StreamBroadcaster::active())
     {
         return;
     }